@@ -1,79 +1,244 @@
 // cfiles, an analysis frontend for the Chemfiles library
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
+#include <algorithm>
 #include <numeric>
 #include <cmath>
 #include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <random>
 
 #include "Autocorrelation.hpp"
+#include "utils.hpp"
+#include "warnings.hpp"
 
-Autocorrelation::Autocorrelation(size_t size):
+const size_t Autocorrelation::MAX_CHUNK_SIZE;
+const size_t Autocorrelation::WORKSPACE_MEMORY;
+const size_t Autocorrelation::TOTAL_WORKSPACE_MEMORY;
+
+/// Relative speed of the direct algorithm compared to the FFT, for the same
+/// number of estimated operations. The direct sum is vectorized by the
+/// compiler, and this value was measured using KissFFT.
+static const double DIRECT_SPEEDUP = 2;
+
+Correlator parse_correlator(const std::string& correlator) {
+    if (correlator == "fft") {
+        return Correlator::FFT;
+    } else if (correlator == "multitau") {
+        return Correlator::MultiTau;
+    } else {
+        throw CFilesError(
+            "unknown correlator '" + correlator + "', expected 'fft' or 'multitau'"
+        );
+    }
+}
+
+size_t parse_max_lag(const std::string& max_lag) {
+    auto lag = string2long(max_lag);
+    if (lag <= 0) {
+        throw CFilesError("maximal lag must be positive, not " + max_lag);
+    }
+    return static_cast<size_t>(lag);
+}
+
+size_t correlation_lags(size_t nsteps, size_t stride, size_t max_lag) {
+    if (max_lag == 0) {
+        return nsteps / 2;
+    }
+    return std::min(max_lag / stride + 1, nsteps);
+}
+
+FFTPlanning parse_fft_planning(const std::string& planning) {
+    if (planning == "estimate") {
+        return FFTPlanning::Estimate;
+    } else if (planning == "measure") {
+        return FFTPlanning::Measure;
+    } else if (planning == "patient") {
+        return FFTPlanning::Patient;
+    } else {
+        throw CFilesError(
+            "unknown FFT planning '" + planning + "', expected 'estimate', 'measure' or 'patient'"
+        );
+    }
+}
+
+#ifdef CFILES_USE_FFTW3
+void load_fft_wisdom(const std::string& path) {
+    if (path.empty()) {
+        return;
+    }
+
+    auto file = std::fopen(path.c_str(), "r");
+    if (file == nullptr) {
+        // this is expected the first time a wisdom file is used
+        return;
+    }
+    std::fclose(file);
+
+    if (!fftwf_import_wisdom_from_filename(path.c_str())) {
+        warn("could not read FFTW wisdom from '" + path + "'");
+    }
+}
+
+void save_fft_wisdom(const std::string& path) {
+    if (path.empty()) {
+        return;
+    }
+
+    // Write to a temporary file first and then rename it, so that multiple
+    // runs sharing the same wisdom file never see a partially written file
+    auto temporary = path + ".tmp" + std::to_string(std::random_device()());
+    if (!fftwf_export_wisdom_to_filename(temporary.c_str())) {
+        warn("could not write FFTW wisdom to '" + temporary + "'");
+        return;
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        warn("could not write FFTW wisdom to '" + path + "'");
+    }
+}
+#else
+void load_fft_wisdom(const std::string&) {}
+void save_fft_wisdom(const std::string&) {}
+#endif
+
+Autocorrelation::Autocorrelation(size_t size, FFTPlanning planning, size_t lags):
     size_(size),
+    lags_(lags == 0 ? size : std::min(lags, size)),
+    direct_(prefer_direct(size_, lags_)),
 #ifdef CFILES_USE_FFTW3
     fft_size_(2 * size_),
 #else
-    fft_size_(std::max(2 * size_, static_cast<size_t>(kiss_fftr_next_fast_size_real(size_)))),
+    fft_size_(std::max(2 * size_, static_cast<size_t>(kiss_fftr_next_fast_size_real(static_cast<int>(size_))))),
 #endif
+    chunk_size_(MAX_CHUNK_SIZE),
+    max_workspaces_(1),
     n_timeseries_(0),
-    result_(size_, 0),
-    spectrum_(nullptr),
-    direct_(fft_size_, false),
-    reverse_(fft_size_, true)
+    planning_(planning),
+    result_(lags_, 0),
+    workspaces_()
+{
+    // Memory used by a single time series in a workspace
+    size_t serie_memory = 0;
+    if (direct_) {
+        serie_memory = size_ * sizeof(float) + lags_ * sizeof(double);
+    } else {
+        serie_memory = fft_size_ * sizeof(float) + (fft_size_ / 2 + 1) * sizeof(fft_complex);
+    }
+    serie_memory = std::max<size_t>(serie_memory, 1);
+    chunk_size_ = std::max<size_t>(std::min(WORKSPACE_MEMORY / serie_memory, MAX_CHUNK_SIZE), 1);
+    max_workspaces_ = std::max<size_t>(TOTAL_WORKSPACE_MEMORY / (chunk_size_ * serie_memory), 1);
+}
+
+Autocorrelation::Workspace::Workspace(size_t fft_size, size_t chunk_size, FFTPlanning planning):
+    series(chunk_size * fft_size),
+    spectrum(chunk_size * (fft_size / 2 + 1)),
+#ifdef CFILES_USE_FFTW3
+    direct(fft_size, chunk_size, series.data(), spectrum.data(), false, planning),
+    reverse(fft_size, chunk_size, series.data(), spectrum.data(), true, planning)
+#else
+    direct(fft_size, false),
+    reverse(fft_size, true)
+#endif
 {
-    spectrum_ = new fft_complex[fft_size_ / 2 + 1];
+    // planning is only used by FFTW
+    (void)planning;
+}
+
+Autocorrelation::Workspace::Workspace(size_t size, size_t lags, size_t chunk_size):
+    series(chunk_size * size),
+    sums(chunk_size * lags, 0.0)
+{}
+
+bool Autocorrelation::prefer_direct(size_t size, size_t lags) {
+    // Estimated cost of the FFT route, which uses two transforms of size
+    // 2 * size with 5 n log2(n) operations each.
+    auto fft_size = 2.0 * static_cast<double>(size);
+    auto fft_cost = 10 * fft_size * std::log2(std::max(fft_size, 2.0));
+    // The direct sum uses 2 operations for each of the (size - lag) terms of
+    // all lags
+    auto lags_d = static_cast<double>(lags);
+    auto direct_cost = 2 * lags_d * (static_cast<double>(size) - (lags_d - 1) / 2) / DIRECT_SPEEDUP;
+    return direct_cost < fft_cost;
 }
 
-Autocorrelation::~Autocorrelation() {
-    delete[] spectrum_;
+void Autocorrelation::add_timeserie(const std::vector<float>& timeserie) {
+    assert(size_ == timeserie.size());
+    add_timeseries(1, 1, [&](size_t, float* data) {
+        std::copy(timeserie.begin(), timeserie.end(), data);
+    });
 }
 
-Autocorrelation::Autocorrelation(Autocorrelation&& other): Autocorrelation(0) {
-    *this = std::move(other);
+void Autocorrelation::add_timeseries(const std::vector<float>& timeseries, size_t nthreads) {
+    assert(size_ != 0 && timeseries.size() % size_ == 0);
+    add_timeseries(timeseries.size() / size_, nthreads, [&](size_t i, float* data) {
+        auto begin = timeseries.begin() + static_cast<std::ptrdiff_t>(i * size_);
+        std::copy(begin, begin + static_cast<std::ptrdiff_t>(size_), data);
+    });
 }
 
-Autocorrelation& Autocorrelation::operator=(Autocorrelation&& other) {
-    this->size_ = std::move(other.size_);
-    this->fft_size_ = std::move(other.fft_size_);
-    this->n_timeseries_ = std::move(other.n_timeseries_);
-    this->result_ = std::move(other.result_);
-    this->spectrum_ = std::move(other.spectrum_);
-    other.spectrum_ = nullptr;
-    this->direct_ = std::move(other.direct_);
-    this->reverse_ = std::move(other.reverse_);
-
-    return *this;
+void Autocorrelation::compute_direct(Workspace& workspace, size_t count) const {
+    assert(count <= chunk_size_);
+    for (size_t serie=0; serie<count; serie++) {
+        auto data = workspace.series.data() + serie * size_;
+        auto sums = workspace.sums.data() + serie * lags_;
+        std::fill(sums, sums + lags_, 0.0);
+        // Iterating over the lags in the inner loop updates independent sums,
+        // allowing the compiler to vectorize it
+        for (size_t i=0; i<size_; i++) {
+            auto value = static_cast<double>(data[i]);
+            auto other = data + i;
+            auto end = std::min(lags_, size_ - i);
+            for (size_t lag=0; lag<end; lag++) {
+                sums[lag] += value * static_cast<double>(other[lag]);
+            }
+        }
+    }
 }
 
-void Autocorrelation::add_timeserie(std::vector<float> timeserie) {
+void Autocorrelation::compute_chunk(Workspace& workspace, size_t count) const {
     // The algorithm used here compute autocorrelation using FFT.
     // It is described in https://doi.org/10.1016/0010-4655(95)00048-K
-    assert(size_ == timeserie.size());
-    n_timeseries_ += 1;
+    assert(count <= chunk_size_);
+    auto spectrum_size = fft_size_ / 2 + 1;
 
-    // Pad the timeserie vector with 0 up to at least 2 * size_
-    timeserie.insert(timeserie.end(), fft_size_ - size_, 0);
+    // Pad the time series with 0 up to fft_size_
+    for (size_t i=0; i<count; i++) {
+        auto series = workspace.series.data() + i * fft_size_;
+        std::fill(series + size_, series + fft_size_, 0.0f);
+    }
 
 #ifdef CFILES_USE_FFTW3
-    fftwf_execute_dft_r2c(direct_, timeserie.data(), spectrum_);
-    for (size_t i=0; i<fft_size_ / 2 + 1; i++) {
-        auto& value = spectrum_[i];
+    // The plans always transform `chunk_size_` series, fill the unused ones
+    // with zeros. Their autocorrelation is zero and does not contribute to
+    // the sum.
+    std::fill(
+        workspace.series.data() + count * fft_size_,
+        workspace.series.data() + chunk_size_ * fft_size_,
+        0.0f
+    );
+
+    fftwf_execute(workspace.direct);
+    for (size_t i=0; i<count * spectrum_size; i++) {
+        auto& value = workspace.spectrum[i];
         // Replace values by their norm
         value[0] = value[0] * value[0] + value[1] * value[1];
         value[1] = 0;
     }
-    fftwf_execute_dft_c2r(reverse_, spectrum_, timeserie.data());
+    fftwf_execute(workspace.reverse);
 #else
-    kiss_fftr(direct_, timeserie.data(), spectrum_);
-    for (size_t i=0; i<fft_size_ / 2 + 1; i++) {
-        auto& value = spectrum_[i];
-        // Replace values by their norm
-        value.r = value.r * value.r + value.i * value.i;
-        value.i = 0;
+    for (size_t i=0; i<count; i++) {
+        auto series = workspace.series.data() + i * fft_size_;
+        auto spectrum = workspace.spectrum.data() + i * spectrum_size;
+        kiss_fftr(workspace.direct, series, spectrum);
+        for (size_t j=0; j<spectrum_size; j++) {
+            auto& value = spectrum[j];
+            // Replace values by their norm
+            value.r = value.r * value.r + value.i * value.i;
+            value.i = 0;
+        }
+        kiss_fftri(workspace.reverse, spectrum, series);
     }
-    kiss_fftri(reverse_, spectrum_, timeserie.data());
 #endif
-
-    for (size_t i=0; i<size_; i++) {
-        result_[i] += timeserie[i];
-    }
 }
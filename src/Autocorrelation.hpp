@@ -4,8 +4,13 @@
 #ifndef CFILES_AUTOCORRELATION_HPP
 #define CFILES_AUTOCORRELATION_HPP
 
+#include <cstdint>
+#include <string>
+#include <utility>
 #include <vector>
+
 #include "Errors.hpp"
+#include "Parallel.hpp"
 
 #ifdef CFILES_USE_FFTW3
 #include <fftw3.h>
@@ -13,19 +18,140 @@
 #include <kiss_fftr.h>
 #endif
 
+/// Algorithm used to compute time correlations
+enum class Correlator {
+    /// Compute the correlation for all lags from the full time series, using
+    /// FFT (see `Autocorrelation`)
+    FFT,
+    /// Compute the correlation for logarithmically spaced lags while reading
+    /// the trajectory (see `MultiTauCorrelator`)
+    MultiTau,
+};
+
+/// Parse the value of a `--correlator` option
+Correlator parse_correlator(const std::string& correlator);
+
+/// Parse the value of a `--max-lag` option
+size_t parse_max_lag(const std::string& max_lag);
+
+/// Get the number of lags to compute in correlations for `nsteps` steps
+/// taken every `stride` steps of the trajectory, with a maximal lag of
+/// `max_lag` trajectory steps. If `max_lag` is 0, this is half the number of
+/// steps.
+size_t correlation_lags(size_t nsteps, size_t stride, size_t max_lag);
+
+/// Strategy used to plan the FFT. This is only used with FFTW, where spending
+/// more time planning can give faster transforms.
+enum class FFTPlanning {
+    /// Use heuristics to select the FFT algorithm (`FFTW_ESTIMATE`)
+    Estimate,
+    /// Time a few FFT algorithms to select the fastest (`FFTW_MEASURE`)
+    Measure,
+    /// Time more FFT algorithms than `Measure` (`FFTW_PATIENT`)
+    Patient,
+};
+
+/// Parse the value of a `--fft-planning` option
+FFTPlanning parse_fft_planning(const std::string& planning);
+
+/// Load FFTW wisdom (previously optimized plans) from the file at `path`, if
+/// it exists. This does nothing if `path` is empty or when not using FFTW.
+void load_fft_wisdom(const std::string& path);
+
+/// Save the FFTW wisdom accumulated while planning to the file at `path`.
+/// This does nothing if `path` is empty or when not using FFTW.
+void save_fft_wisdom(const std::string& path);
+
+/// A memory buffer containing `size` values of type `T`, aligned on a 64
+/// bytes boundary to allow SIMD instructions in FFT.
+template <typename T>
+class AlignedBuffer {
+public:
+    AlignedBuffer(): raw_(nullptr), data_(nullptr), size_(0) {}
+
+    explicit AlignedBuffer(size_t size): raw_(nullptr), data_(nullptr), size_(size) {
+        raw_ = new char[size * sizeof(T) + ALIGNMENT];
+        auto address = reinterpret_cast<uintptr_t>(raw_);
+        auto offset = ALIGNMENT - address % ALIGNMENT;
+        data_ = reinterpret_cast<T*>(raw_ + offset);
+    }
+
+    ~AlignedBuffer() {
+        delete[] raw_;
+    }
+
+    AlignedBuffer(const AlignedBuffer&) = delete;
+    AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+    AlignedBuffer(AlignedBuffer&& other): AlignedBuffer() {
+        *this = std::move(other);
+    }
+
+    AlignedBuffer& operator=(AlignedBuffer&& other) {
+        std::swap(raw_, other.raw_);
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+
+    T* data() {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    T& operator[](size_t i) {
+        return data_[i];
+    }
+
+private:
+    static constexpr uintptr_t ALIGNMENT = 64;
+
+    char* raw_;
+    T* data_;
+    size_t size_;
+};
+
 #ifdef CFILES_USE_FFTW3
 /// A RAII capsule for fftwf_plan
 class FFTWPlan {
 public:
-    FFTWPlan(size_t size, bool reverse) {
+    /// Create an empty plan, which can not be executed
+    FFTWPlan() {}
+
+    /// Create a plan for `howmany` FFT of size `size`, going from the real
+    /// `series` to the complex `spectrum` or the other way around if `reverse`
+    /// is true. The plan can only be used with these arrays, and their content
+    /// is overwritten when planning with anything else than
+    /// `FFTPlanning::Estimate`.
+    FFTWPlan(size_t size, size_t howmany, float* series, fftwf_complex* spectrum, bool reverse, FFTPlanning planning) {
+        int n[] = {static_cast<int>(size)};
+        auto real_size = static_cast<int>(size);
+        auto complex_size = static_cast<int>(size / 2 + 1);
+
+        unsigned flags = FFTW_ESTIMATE;
+        if (planning == FFTPlanning::Measure) {
+            flags = FFTW_MEASURE;
+        } else if (planning == FFTPlanning::Patient) {
+            flags = FFTW_PATIENT;
+        }
+
         if (reverse) {
-            // Use the FFTW_UNALIGNED flag, as this will be used for multiple
-            // array, over which this code does not have control w.r.t.
-            // alignment. Allocating memory with fftw_malloc would need a big
-            // refactoring.
-            plan_ = fftwf_plan_dft_c2r_1d(size, nullptr, nullptr, FFTW_ESTIMATE | FFTW_UNALIGNED);
+            plan_ = fftwf_plan_many_dft_c2r(
+                1, n, static_cast<int>(howmany),
+                spectrum, nullptr, 1, complex_size,
+                series, nullptr, 1, real_size,
+                flags
+            );
         } else {
-            plan_ = fftwf_plan_dft_r2c_1d(size, nullptr, nullptr, FFTW_ESTIMATE | FFTW_UNALIGNED);
+            plan_ = fftwf_plan_many_dft_r2c(
+                1, n, static_cast<int>(howmany),
+                series, nullptr, 1, real_size,
+                spectrum, nullptr, 1, complex_size,
+                flags
+            );
         }
         if (plan_ == nullptr) {
             throw CFilesError("Could not allocate memory for FFT");
@@ -33,7 +159,9 @@ public:
     }
 
     ~FFTWPlan() {
-        fftwf_destroy_plan(plan_);
+        if (plan_ != nullptr) {
+            fftwf_destroy_plan(plan_);
+        }
     }
 
     FFTWPlan(FFTWPlan&& other): plan_(other.plan_) {
@@ -41,9 +169,7 @@ public:
     }
 
     FFTWPlan& operator=(FFTWPlan&& other) {
-        fftwf_destroy_plan(this->plan_);
-        this->plan_ = other.plan_;
-        other.plan_ = nullptr;
+        std::swap(plan_, other.plan_);
         return *this;
     }
 
@@ -61,8 +187,11 @@ using fft_plan = FFTWPlan;
 /// A RAII capsule for kiss_fftr_cfg
 class KissFTTConfig {
 public:
+    /// Create an empty configuration, which can not be used
+    KissFTTConfig() {}
+
     KissFTTConfig(size_t size, bool reverse) {
-        cfg_ = kiss_fftr_alloc(size, reverse, nullptr, nullptr);
+        cfg_ = kiss_fftr_alloc(static_cast<int>(size), reverse, nullptr, nullptr);
         if (cfg_ == nullptr) {
             throw CFilesError("Could not allocate memory for FFT");
         }
@@ -77,9 +206,7 @@ public:
     }
 
     KissFTTConfig& operator=(KissFTTConfig&& other) {
-        kiss_fft_free(this->cfg_);
-        this->cfg_ = other.cfg_;
-        other.cfg_ = nullptr;
+        std::swap(cfg_, other.cfg_);
         return *this;
     }
 
@@ -94,59 +221,192 @@ using fft_complex = kiss_fft_cpx;
 using fft_plan = KissFTTConfig;
 #endif
 
+/// Compute and average the autocorrelation of time series.
+///
+/// Only the first `lags` values of the autocorrelation are computed, using
+/// either a direct O(size * lags) algorithm for short lags, or FFT with
+/// O(size * log(size)) cost otherwise.
 class Autocorrelation {
 public:
-    Autocorrelation(size_t size);
-    ~Autocorrelation();
+    /// Create a new autocorrelation for time series with `size` elements,
+    /// computing the first `lags` values of the autocorrelation (all of them
+    /// if `lags` is 0) and using the given `planning` strategy for FFT
+    Autocorrelation(size_t size, FFTPlanning planning = FFTPlanning::Estimate, size_t lags = 0);
 
     Autocorrelation(const Autocorrelation&) = delete;
     Autocorrelation& operator=(const Autocorrelation&) = delete;
 
-    Autocorrelation(Autocorrelation&&);
-    Autocorrelation& operator=(Autocorrelation&&);
+    Autocorrelation(Autocorrelation&&) = default;
+    Autocorrelation& operator=(Autocorrelation&&) = default;
 
     /// Compute autocorrelation for the given time serie, and store it for
     /// future averaging
-    void add_timeserie(std::vector<float> timeserie);
+    void add_timeserie(const std::vector<float>& timeserie);
+
+    /// Compute the autocorrelation of `count` time series stored one after
+    /// the other in `timeseries`, and store them for future averaging. Up to
+    /// `nthreads` threads are used for the computation.
+    void add_timeseries(const std::vector<float>& timeseries, size_t nthreads);
+
+    /// Compute the autocorrelation of `count` time series, using up to
+    /// `nthreads` threads, and store them for future averaging. The series
+    /// are provided by calling `fill(i, data)`, which should write the `size`
+    /// values of the `i`-th series to `data`. `fill` can be called from
+    /// multiple threads at once.
+    ///
+    /// The accumulated results do not depend on the number of threads.
+    template <typename Fill>
+    void add_timeseries(size_t count, size_t nthreads, Fill fill) {
+        auto nchunks = (count + chunk_size_ - 1) / chunk_size_;
+        if (nthreads == 0) {
+            nthreads = default_threads();
+        }
+        nthreads = std::min(nthreads, max_workspaces_);
+        nthreads = std::max<size_t>(std::min(nthreads, nchunks), 1);
+        while (workspaces_.size() < nthreads) {
+            if (direct_) {
+                workspaces_.emplace_back(size_, lags_, chunk_size_);
+            } else {
+                workspaces_.emplace_back(fft_size_, chunk_size_, planning_);
+            }
+        }
+
+        // Chunks are processed in rounds of `nthreads` chunks. Each thread
+        // computes the autocorrelations of one chunk in its workspace, which
+        // are then added to the result one series at the time, in order.
+        for (size_t round=0; round<nchunks; round+=nthreads) {
+            auto nworkers = std::min(nthreads, nchunks - round);
+            parallel_for(nworkers, nworkers, [&](size_t worker) {
+                auto& workspace = workspaces_[worker];
+                auto first = (round + worker) * chunk_size_;
+                auto chunk_size = std::min<size_t>(count - first, chunk_size_);
+                for (size_t i=0; i<chunk_size; i++) {
+                    fill(first + i, workspace.series.data() + i * stride());
+                }
+                if (direct_) {
+                    compute_direct(workspace, chunk_size);
+                } else {
+                    compute_chunk(workspace, chunk_size);
+                }
+            });
+
+            for (size_t worker=0; worker<nworkers; worker++) {
+                auto first = (round + worker) * chunk_size_;
+                auto chunk_size = std::min<size_t>(count - first, chunk_size_);
+                auto& workspace = workspaces_[worker];
+                for (size_t serie=0; serie<chunk_size; serie++) {
+                    if (direct_) {
+                        auto correlation = workspace.sums.data() + serie * lags_;
+                        for (size_t i=0; i<lags_; i++) {
+                            result_[i] += correlation[i];
+                        }
+                    } else {
+                        auto correlation = workspace.series.data() + serie * fft_size_;
+                        for (size_t i=0; i<lags_; i++) {
+                            result_[i] += correlation[i];
+                        }
+                    }
+                }
+            }
+        }
+        n_timeseries_ += count;
+    }
 
     /// Normalize the averaged autocorrelations
     void normalize() {
-        for (size_t i=0; i<size_; i++) {
-            // fft_size_ is the gain from doing FFT -> iFFT with both FFTW3 and
-            // KissFFT
-            result_[i] /=  fft_size_ * n_timeseries_ * (size_ - i);
+        // fft_size_ is the gain from doing FFT -> iFFT with both FFTW3 and
+        // KissFFT
+        size_t gain = direct_ ? 1 : fft_size_;
+        for (size_t i=0; i<lags_; i++) {
+            result_[i] /=  gain * n_timeseries_ * (size_ - i);
         }
     }
 
-    /// Get the averaged autocorrelations
-    const std::vector<float>& get_result() const {
+    /// Get the averaged autocorrelations, for the first `lags` values
+    const std::vector<double>& get_result() const {
         return result_;
     }
 
+    /// Is this autocorrelation using the direct algorithm instead of FFT?
+    bool direct() const {
+        return direct_;
+    }
+
+    /// Check if the direct algorithm should be faster than FFT to compute the
+    /// first `lags` values of the autocorrelation of time series with `size`
+    /// elements
+    static bool prefer_direct(size_t size, size_t lags);
+
 private:
-    /// Compute autocorrelation using FFT algorithm, and store the result in
-    /// `timeserie`
-    void compute_fft(std::vector<float>& timeserie);
+    /// Maximal number of time series transformed together
+    static const size_t MAX_CHUNK_SIZE = 16;
+    /// Memory budget (in bytes) for the buffers of a single workspace. Fewer
+    /// time series are transformed together when they are long.
+    static const size_t WORKSPACE_MEMORY = 64 * 1024 * 1024;
+    /// Memory budget (in bytes) for the buffers of all the workspaces. Fewer
+    /// threads are used when a single time series does not fit in
+    /// `WORKSPACE_MEMORY`.
+    static const size_t TOTAL_WORKSPACE_MEMORY = 1024 * 1024 * 1024;
+
+    /// Scratch memory and FFT plans used to compute the autocorrelation of a
+    /// chunk of time series.
+    struct Workspace {
+        /// Create a workspace for `chunk_size` FFT of size `fft_size`
+        Workspace(size_t fft_size, size_t chunk_size, FFTPlanning planning);
+        /// Create a workspace for the direct algorithm, with `chunk_size`
+        /// time series of `size` elements and `lags` values in the
+        /// autocorrelation
+        Workspace(size_t size, size_t lags, size_t chunk_size);
+
+        /// Time series, padded with zeros to `fft_size` when using FFT. They
+        /// are replaced by their autocorrelation in `compute_chunk`.
+        AlignedBuffer<float> series;
+        /// Autocorrelation of the time series computed by `compute_direct`,
+        /// indexed by `serie * lags + lag`
+        std::vector<double> sums;
+        /// Spectrum of the time series
+        AlignedBuffer<fft_complex> spectrum;
+        /// FFT configuration
+        fft_plan direct;
+        /// Reverse FFT configuration
+        fft_plan reverse;
+    };
 
-    /// Compute autocorrelation using direct algorithm, and store the result in
-    /// `timeserie`
-    void compute_direct(std::vector<float>& timeserie);
+    /// Compute the autocorrelation of the first `count` series stored in the
+    /// `workspace`, replacing the series with their autocorrelation
+    void compute_chunk(Workspace& workspace, size_t count) const;
+
+    /// Compute the autocorrelation of the first `count` series stored in the
+    /// `workspace` using the direct algorithm, and store it in
+    /// `workspace.sums`
+    void compute_direct(Workspace& workspace, size_t count) const;
+
+    /// Distance between consecutive series in the workspaces
+    size_t stride() const {
+        return direct_ ? size_ : fft_size_;
+    }
 
     /// Number of elements in the time series
     size_t size_;
+    /// Number of values to compute in the autocorrelation
+    size_t lags_;
+    /// Are we using the direct algorithm instead of FFT?
+    bool direct_;
     /// Number of points for the FFT
     size_t fft_size_;
+    /// Number of time series transformed together, and maximal number of
+    /// workspaces, derived from the memory used by each time series
+    size_t chunk_size_;
+    size_t max_workspaces_;
     /// Number of timeseries used
     size_t n_timeseries_;
+    /// Strategy used to create FFT plans
+    FFTPlanning planning_;
     /// Accumulated autocorrelations
-    std::vector<float> result_;
-
-    /// Buffer for FFT data
-    fft_complex* spectrum_;
-    /// FFT configuration
-    fft_plan direct_;
-    /// Reverse FFT configuration
-    fft_plan reverse_;
+    std::vector<double> result_;
+    /// Workspaces for each thread, kept alive between calls to
+    /// `add_timeseries`
+    std::vector<Workspace> workspaces_;
 };
 
 #endif
@@ -6,18 +6,27 @@
 
 #include "Histogram.hpp"
 
-/// Average class, averaging an historgram over multiple steps
-class Averager: public Histogram {
+/// Average class, averaging an historgram with `N` dimensions over multiple
+/// steps. The current step is accumulated in the histogram, using `T` to
+/// store the bins values. The values are promoted to `double` when calling
+/// `step`.
+///
+/// Only the bins touched during a step are visited by `step`, and the sums are
+/// stored by blocks of `BLOCK_SIZE` bins allocated on first use, so that both
+/// the cost of `step` and the memory used by the sums scale with the occupied
+/// region of the histogram instead of its total size.
+template <size_t N, typename T = double>
+class Averager: public Histogram<N, T> {
 public:
     /// Default constructor
-    Averager(): Histogram(), averaged_() {}
+    Averager(): Histogram<N, T>(), blocks_() {}
     /// Constructor for a flat 2d histogram with a specific number of bins in each direction
     /// `n1` and `n2`, and which can hold data in the `min1 - max1` range (resp `min2 - max2`).
     Averager(size_t n1, double min1, double max1, size_t n2, double min2, double max2):
-        Histogram(n1, min1, max1, n2, min2, max2), averaged_(n1 * n2) {}
+        Histogram<N, T>(n1, min1, max1, n2, min2, max2), blocks_(nblocks(n1 * n2)) {}
     /// Constructor with a specific number of bins `nbins`, and which can hold
     /// data in the `min - max` range.
-    Averager(size_t nbins, double min, double max): Histogram(nbins, min, max), averaged_(nbins) {}
+    Averager(size_t nbins, double min, double max): Histogram<N, T>(nbins, min, max), blocks_(nblocks(nbins)) {}
 
     Averager(const Averager&) = default;
     Averager(Averager&&) = default;
@@ -27,22 +36,68 @@ public:
     /// Store the current data for averaging, and clean the current data
     /// (set it to `T()`)
     void step() {
-        for (size_t i=0; i<this->size(); i++) {
-            averaged_[i] += (*this)[i];
-            (*this)[i] = 0;
+        const auto& self = *this;
+        if (this->all_touched()) {
+            for (size_t i=0; i<this->size(); i++) {
+                if (self[i] != T(0)) {
+                    sum(i) += static_cast<double>(self[i]);
+                }
+            }
+        } else {
+            for (auto i: this->touched()) {
+                sum(i) += static_cast<double>(self[i]);
+            }
         }
+        this->clear();
         nsteps_++;
     }
 
+    /// Compute the average of all the steps. The result is then available
+    /// with `averaged`.
     void average() {
-        for (size_t i=0; i<this->size(); i++) {
-            (*this)[i] = averaged_[i] / nsteps_;
+        for (auto& block: blocks_) {
+            for (auto& value: block) {
+                value /= nsteps_;
+            }
         }
     }
 
+    /// Get the averaged value for the bin `i`, after a call to `average`
+    double averaged(size_t i) const {
+        const auto& block = blocks_[i / BLOCK_SIZE];
+        if (block.empty()) {
+            return 0.0;
+        }
+        return block[i % BLOCK_SIZE];
+    }
+
+    /// Get the averaged value for the bin `i, j` of a 2D histogram, after a
+    /// call to `average`
+    double averaged(size_t i, size_t j) const {
+        static_assert(N == 2, "2D indexing is only available for 2D histograms");
+        return averaged(j + i * this->second().nbins);
+    }
+
 private:
-    /// Accumulating the averaged values
-    std::vector<double> averaged_;
+    /// Number of bins in a block of averaged values
+    static constexpr size_t BLOCK_SIZE = 4096;
+
+    static size_t nblocks(size_t size) {
+        return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+
+    /// Get the accumulated value for bin `i`, allocating its block if needed
+    double& sum(size_t i) {
+        auto& block = blocks_[i / BLOCK_SIZE];
+        if (block.empty()) {
+            block.resize(BLOCK_SIZE, 0.0);
+        }
+        return block[i % BLOCK_SIZE];
+    }
+
+    /// Accumulating the averaged values, by blocks of `BLOCK_SIZE` bins. Blocks
+    /// where no value was ever accumulated are left empty.
+    std::vector<std::vector<double>> blocks_;
     /// Number of time `step` was called
     size_t nsteps_ = 0;
 };
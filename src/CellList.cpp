@@ -0,0 +1,241 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+#include "CellList.hpp"
+
+using namespace chemfiles;
+
+CellList::CellList(const UnitCell& cell, const std::vector<Vector3D>& positions, double cutoff):
+    cell_(cell),
+    positions_(positions),
+    cutoff_(cutoff),
+    shape_({{1, 1, 1}}),
+    transform_(Matrix3D::zero()),
+    origin_(0, 0, 0),
+    matrix_(cell.matrix()),
+    inverse_(Matrix3D::zero()),
+    periodic_(cell.shape() != UnitCell::INFINITE)
+{
+    assert(cutoff > 0);
+    if (periodic_) {
+        // The width of the unit cell perpendicular to the plane defined by the
+        // two other cell vectors is volume / |b x c|.
+        auto matrix = cell.matrix();
+        auto a = Vector3D(matrix[0][0], matrix[1][0], matrix[2][0]);
+        auto b = Vector3D(matrix[0][1], matrix[1][1], matrix[2][1]);
+        auto c = Vector3D(matrix[0][2], matrix[1][2], matrix[2][2]);
+        auto volume = std::abs(dot(a, cross(b, c)));
+        auto widths = Vector3D(
+            volume / cross(b, c).norm(),
+            volume / cross(c, a).norm(),
+            volume / cross(a, b).norm()
+        );
+        for (size_t i=0; i<3; i++) {
+            shape_[i] = std::max<size_t>(1, static_cast<size_t>(std::floor(widths[i] / cutoff)));
+        }
+    } else {
+        // Use the bounding box of the atoms for infinite cells
+        auto min = Vector3D(
+            std::numeric_limits<double>::max(),
+            std::numeric_limits<double>::max(),
+            std::numeric_limits<double>::max()
+        );
+        auto max = Vector3D(
+            std::numeric_limits<double>::lowest(),
+            std::numeric_limits<double>::lowest(),
+            std::numeric_limits<double>::lowest()
+        );
+        for (auto& position: positions) {
+            for (size_t i=0; i<3; i++) {
+                min[i] = std::min(min[i], position[i]);
+                max[i] = std::max(max[i], position[i]);
+            }
+        }
+        if (!positions.empty()) {
+            origin_ = min;
+            for (size_t i=0; i<3; i++) {
+                shape_[i] = std::max<size_t>(1, static_cast<size_t>(std::floor((max[i] - min[i]) / cutoff)));
+            }
+        }
+    }
+
+    // Do not use more cells than atoms, to bound the memory used when the
+    // cutoff is small compared to the cell. Larger cells are still correct.
+    auto max_cells = positions.size() + 27;
+    while (ncells() > max_cells) {
+        auto largest = std::max_element(shape_.begin(), shape_.end());
+        *largest = std::max<size_t>(1, *largest / 2);
+    }
+
+    if (periodic_) {
+        inverse_ = matrix_.invert();
+        for (size_t i=0; i<3; i++) {
+            for (size_t j=0; j<3; j++) {
+                transform_[i][j] = static_cast<double>(shape_[i]) * inverse_[i][j];
+            }
+        }
+    } else if (!positions.empty()) {
+        for (size_t i=0; i<3; i++) {
+            auto extent = 0.0;
+            for (auto& position: positions) {
+                extent = std::max(extent, position[i] - origin_[i]);
+            }
+            if (extent > 0) {
+                transform_[i][i] = static_cast<double>(shape_[i]) / extent;
+            }
+        }
+    }
+}
+
+size_t CellList::cell_index(const Vector3D& position) const {
+    auto scaled = transform_ * (position - origin_);
+    size_t index[3];
+    for (size_t i=0; i<3; i++) {
+        auto n = static_cast<double>(shape_[i]);
+        auto value = std::floor(scaled[i]);
+        if (periodic_) {
+            value -= std::floor(value / n) * n;
+        }
+        // clamp to the valid range, which also deals with rounding errors
+        value = std::max(0.0, std::min(value, n - 1));
+        index[i] = static_cast<size_t>(value);
+    }
+    return (index[0] * shape_[1] + index[1]) * shape_[2] + index[2];
+}
+
+CellList::Atoms CellList::sort(const std::vector<size_t>& indexes) const {
+    auto cells = std::vector<size_t>(indexes.size());
+    auto atoms = Atoms();
+    atoms.start.assign(ncells() + 1, 0);
+    for (size_t i=0; i<indexes.size(); i++) {
+        cells[i] = cell_index(positions_[indexes[i]]);
+        atoms.start[cells[i] + 1] += 1;
+    }
+    for (size_t cell=0; cell<ncells(); cell++) {
+        atoms.start[cell + 1] += atoms.start[cell];
+    }
+
+    // counting sort of the atoms by cell
+    auto position = std::vector<size_t>(atoms.start.begin(), atoms.start.end() - 1);
+    atoms.indexes.resize(indexes.size());
+    for (size_t i=0; i<indexes.size(); i++) {
+        atoms.indexes[position[cells[i]]++] = indexes[i];
+    }
+
+    atoms.x.resize(indexes.size());
+    atoms.y.resize(indexes.size());
+    atoms.z.resize(indexes.size());
+    auto shape = cell_.shape();
+    for (size_t i=0; i<atoms.indexes.size(); i++) {
+        auto coordinates = positions_[atoms.indexes[i]];
+        if (shape == UnitCell::TRICLINIC) {
+            coordinates = inverse_ * coordinates;
+            for (size_t k=0; k<3; k++) {
+                coordinates[k] -= std::floor(coordinates[k]);
+            }
+        } else if (shape == UnitCell::ORTHORHOMBIC) {
+            for (size_t k=0; k<3; k++) {
+                coordinates[k] -= std::floor(coordinates[k] / matrix_[k][k]) * matrix_[k][k];
+            }
+        }
+        atoms.x[i] = coordinates[0];
+        atoms.y[i] = coordinates[1];
+        atoms.z[i] = coordinates[2];
+    }
+
+    return atoms;
+}
+
+// The loops below do not contain any branch or function call, allowing the
+// compiler to vectorize them. Since the coordinates are wrapped inside the
+// cell, the differences are between -L and L (-1 and 1 in fractional
+// coordinates), and the minimum image is found by adding or removing a single
+// cell vector.
+void CellList::squared_distances(const Atoms& atoms, size_t i, size_t begin, size_t end, double* distances2) const {
+    const auto xi = atoms.x[i];
+    const auto yi = atoms.y[i];
+    const auto zi = atoms.z[i];
+    const auto x = atoms.x.data();
+    const auto y = atoms.y.data();
+    const auto z = atoms.z.data();
+    const auto count = end - begin;
+
+    auto shape = cell_.shape();
+    if (shape == UnitCell::ORTHORHOMBIC) {
+        const auto a = matrix_[0][0];
+        const auto b = matrix_[1][1];
+        const auto c = matrix_[2][2];
+        for (size_t k=0; k<count; k++) {
+            auto dx = x[begin + k] - xi;
+            auto dy = y[begin + k] - yi;
+            auto dz = z[begin + k] - zi;
+            dx += (dx < -0.5 * a ? a : 0.0) - (dx > 0.5 * a ? a : 0.0);
+            dy += (dy < -0.5 * b ? b : 0.0) - (dy > 0.5 * b ? b : 0.0);
+            dz += (dz < -0.5 * c ? c : 0.0) - (dz > 0.5 * c ? c : 0.0);
+            distances2[k] = dx * dx + dy * dy + dz * dz;
+        }
+    } else if (shape == UnitCell::TRICLINIC) {
+        const auto& m = matrix_;
+        for (size_t k=0; k<count; k++) {
+            auto sx = x[begin + k] - xi;
+            auto sy = y[begin + k] - yi;
+            auto sz = z[begin + k] - zi;
+            sx += (sx < -0.5 ? 1.0 : 0.0) - (sx > 0.5 ? 1.0 : 0.0);
+            sy += (sy < -0.5 ? 1.0 : 0.0) - (sy > 0.5 ? 1.0 : 0.0);
+            sz += (sz < -0.5 ? 1.0 : 0.0) - (sz > 0.5 ? 1.0 : 0.0);
+            auto dx = m[0][0] * sx + m[0][1] * sy + m[0][2] * sz;
+            auto dy = m[1][0] * sx + m[1][1] * sy + m[1][2] * sz;
+            auto dz = m[2][0] * sx + m[2][1] * sy + m[2][2] * sz;
+            distances2[k] = dx * dx + dy * dy + dz * dz;
+        }
+    } else {
+        for (size_t k=0; k<count; k++) {
+            auto dx = x[begin + k] - xi;
+            auto dy = y[begin + k] - yi;
+            auto dz = z[begin + k] - zi;
+            distances2[k] = dx * dx + dy * dy + dz * dz;
+        }
+    }
+}
+
+size_t CellList::find_neighbors(size_t cell, std::array<size_t, 27>& neighbors) const {
+    size_t index[3] = {
+        cell / (shape_[1] * shape_[2]),
+        (cell / shape_[2]) % shape_[1],
+        cell % shape_[2],
+    };
+
+    // neighboring cells along each direction, without duplicates
+    size_t around[3][3];
+    size_t count[3] = {0, 0, 0};
+    for (size_t i=0; i<3; i++) {
+        for (int delta=-1; delta<=1; delta++) {
+            auto n = static_cast<long>(shape_[i]);
+            auto value = static_cast<long>(index[i]) + delta;
+            if (periodic_) {
+                value = (value + n) % n;
+            } else if (value < 0 || value >= n) {
+                continue;
+            }
+            auto neighbor = static_cast<size_t>(value);
+            if (std::find(around[i], around[i] + count[i], neighbor) == around[i] + count[i]) {
+                around[i][count[i]++] = neighbor;
+            }
+        }
+    }
+
+    size_t n = 0;
+    for (size_t i=0; i<count[0]; i++) {
+        for (size_t j=0; j<count[1]; j++) {
+            for (size_t k=0; k<count[2]; k++) {
+                neighbors[n++] = (around[0][i] * shape_[1] + around[1][j]) * shape_[2] + around[2][k];
+            }
+        }
+    }
+    return n;
+}
@@ -0,0 +1,190 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_CELL_LIST_HPP
+#define CFILES_CELL_LIST_HPP
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#include <chemfiles.hpp>
+
+/// Linked-cell neighbor search, finding all the pairs of atoms closer than a
+/// cutoff in O(N) time.
+///
+/// The unit cell is divided in cells whose width in all directions is larger
+/// than the cutoff, so that neighbors of an atom can only be in the same cell
+/// or in one of the directly neighboring cells. This works with orthorhombic,
+/// triclinic and infinite unit cells. For infinite cells, the cells cover the
+/// bounding box of the atoms. Distances are computed with the same minimum
+/// image convention as `chemfiles::Frame::distance`.
+///
+/// The coordinates of the sorted atoms are stored as structure of arrays, to
+/// compute the distances between one atom and all the atoms in a neighboring
+/// cell in a single loop, which the compiler can vectorize.
+class CellList {
+public:
+    /// Set of atoms sorted by cell, created with `CellList::sort`
+    struct Atoms {
+        /// The atoms in cell `c` are `indexes[start[c]]` to
+        /// `indexes[start[c + 1]]` (excluded)
+        std::vector<size_t> start;
+        /// Indexes of the atoms
+        std::vector<size_t> indexes;
+        /// Coordinates of the atoms, in the same order as `indexes`. These
+        /// are fractional coordinates wrapped in [0, 1) for triclinic cells,
+        /// cartesian coordinates wrapped inside the cell for orthorhombic
+        /// cells, and cartesian coordinates for infinite cells.
+        std::vector<double> x;
+        std::vector<double> y;
+        std::vector<double> z;
+    };
+
+    /// Create a new cell list for the given `positions` in the `cell`, for
+    /// pairs closer than `cutoff`. The positions must outlive the cell list.
+    CellList(const chemfiles::UnitCell& cell, const std::vector<chemfiles::Vector3D>& positions, double cutoff);
+
+    /// Sort the atoms with the given `indexes` by cell
+    Atoms sort(const std::vector<size_t>& indexes) const;
+
+    /// Get the number of cells in each direction
+    const std::array<size_t, 3>& shape() const {
+        return shape_;
+    }
+
+    /// Call `function(i, j, distance)` for all pairs of different atoms `i`
+    /// and `j` in `atoms` closer than the cutoff. Each pair is only visited
+    /// once, in an unspecified order.
+    template <typename Function>
+    void foreach_pair(const Atoms& atoms, Function function) const {
+        auto neighbors = std::array<size_t, 27>();
+        for (size_t cell=0; cell<ncells(); cell++) {
+            auto begin = atoms.start[cell];
+            auto end = atoms.start[cell + 1];
+            if (begin == end) {
+                continue;
+            }
+            auto count = find_neighbors(cell, neighbors);
+            for (size_t n=0; n<count; n++) {
+                auto neighbor = neighbors[n];
+                if (neighbor < cell) {
+                    // this pair of cells was already visited
+                    continue;
+                }
+                auto other_begin = atoms.start[neighbor];
+                auto other_end = atoms.start[neighbor + 1];
+                for (auto i=begin; i<end; i++) {
+                    auto first = neighbor == cell ? i + 1 : other_begin;
+                    for (auto j=first; j<other_end; j++) {
+                        visit(atoms.indexes[i], atoms.indexes[j], function);
+                    }
+                }
+            }
+        }
+    }
+
+    /// Call `function(distances2, count)` with batches of `count` squared
+    /// distances for all the pairs of different atoms in `atoms` that could be
+    /// closer than the cutoff. Each pair is only visited once. Some of the
+    /// squared distances are larger than the squared cutoff, and should be
+    /// filtered by `function`.
+    template <typename Function>
+    void foreach_squared_distance(const Atoms& atoms, Function function) const {
+        auto neighbors = std::array<size_t, 27>();
+        auto distances2 = std::vector<double>();
+        for (size_t cell=0; cell<ncells(); cell++) {
+            auto begin = atoms.start[cell];
+            auto end = atoms.start[cell + 1];
+            if (begin == end) {
+                continue;
+            }
+            auto count = find_neighbors(cell, neighbors);
+            for (size_t n=0; n<count; n++) {
+                auto neighbor = neighbors[n];
+                if (neighbor < cell) {
+                    continue;
+                }
+                auto other_end = atoms.start[neighbor + 1];
+                for (auto i=begin; i<end; i++) {
+                    auto first = neighbor == cell ? i + 1 : atoms.start[neighbor];
+                    if (first >= other_end) {
+                        continue;
+                    }
+                    distances2.resize(std::max(distances2.size(), other_end - first));
+                    squared_distances(atoms, i, first, other_end, distances2.data());
+                    function(static_cast<const double*>(distances2.data()), other_end - first);
+                }
+            }
+        }
+    }
+
+    /// Call `function(i, j, distance)` for all pairs of atoms `i` in `first`
+    /// and `j` in `second` closer than the cutoff, excluding pairs of the same
+    /// atom. Pairs of atoms present in both sets are visited in both orders.
+    template <typename Function>
+    void foreach_pair(const Atoms& first, const Atoms& second, Function function) const {
+        auto neighbors = std::array<size_t, 27>();
+        for (size_t cell=0; cell<ncells(); cell++) {
+            if (first.start[cell] == first.start[cell + 1]) {
+                continue;
+            }
+            auto count = find_neighbors(cell, neighbors);
+            for (size_t n=0; n<count; n++) {
+                auto neighbor = neighbors[n];
+                for (auto i=first.start[cell]; i<first.start[cell + 1]; i++) {
+                    for (auto j=second.start[neighbor]; j<second.start[neighbor + 1]; j++) {
+                        if (first.indexes[i] != second.indexes[j]) {
+                            visit(first.indexes[i], second.indexes[j], function);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    size_t ncells() const {
+        return shape_[0] * shape_[1] * shape_[2];
+    }
+
+    /// Get the index of the cell containing the given position
+    size_t cell_index(const chemfiles::Vector3D& position) const;
+
+    /// Compute the squared distances between the atom at position `i` in
+    /// `atoms` and all the atoms at positions `begin` to `end` (excluded),
+    /// and store them in `distances2`
+    void squared_distances(const Atoms& atoms, size_t i, size_t begin, size_t end, double* distances2) const;
+
+    /// Store the indexes of all the different cells neighboring `cell`
+    /// (including `cell` itself) in `neighbors`, and return their number
+    size_t find_neighbors(size_t cell, std::array<size_t, 27>& neighbors) const;
+
+    template <typename Function>
+    void visit(size_t i, size_t j, Function& function) const {
+        auto distance = cell_.wrap(positions_[j] - positions_[i]).norm();
+        if (distance < cutoff_) {
+            function(i, j, distance);
+        }
+    }
+
+    const chemfiles::UnitCell& cell_;
+    const std::vector<chemfiles::Vector3D>& positions_;
+    double cutoff_;
+    /// Number of cells in each direction
+    std::array<size_t, 3> shape_;
+    /// Matrix converting positions to cell coordinates: the cell along
+    /// direction `i` is `floor(transform * (position - origin))[i]`, wrapped
+    /// for periodic cells
+    chemfiles::Matrix3D transform_;
+    /// Origin of the cells, only used with infinite unit cells
+    chemfiles::Vector3D origin_;
+    /// Unit cell matrix
+    chemfiles::Matrix3D matrix_;
+    /// Inverse of the unit cell matrix
+    chemfiles::Matrix3D inverse_;
+    /// Are the cells periodic?
+    bool periodic_;
+};
+
+#endif
@@ -14,6 +14,7 @@
 #include "commands/Msd.hpp"
 #include "commands/Rdf.hpp"
 #include "commands/Rotcf.hpp"
+#include "commands/StructureFactor.hpp"
 
 const std::vector<command_creator>& all_commands() {
     static std::vector<command_creator> commands = {
@@ -28,6 +29,7 @@ const std::vector<command_creator>& all_commands() {
         {"msd", [](){return std::unique_ptr<Command>(new MSD());}},
         {"rdf", [](){return std::unique_ptr<Command>(new Rdf());}},
         {"rotcf", [](){return std::unique_ptr<Command>(new Rotcf());}},
+        {"sq", [](){return std::unique_ptr<Command>(new StructureFactor());}},
     };
     return commands;
 }
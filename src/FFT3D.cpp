@@ -0,0 +1,75 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <cassert>
+
+#include "FFT3D.hpp"
+#include "Errors.hpp"
+
+RealFFT3D::RealFFT3D(std::array<size_t, 3> shape, FFTPlanning planning):
+    shape_(shape),
+    grid_(shape[0] * shape[1] * shape[2]),
+    spectrum_(shape[0] * shape[1] * (shape[2] / 2 + 1))
+{
+    assert(shape_[2] % 2 == 0);
+    auto n0 = static_cast<int>(shape_[0]);
+    auto n1 = static_cast<int>(shape_[1]);
+    auto n2 = static_cast<int>(shape_[2]);
+#ifdef CFILES_USE_FFTW3
+    unsigned flags = FFTW_ESTIMATE;
+    if (planning == FFTPlanning::Measure) {
+        flags = FFTW_MEASURE;
+    } else if (planning == FFTPlanning::Patient) {
+        flags = FFTW_PATIENT;
+    }
+    plan_ = fftwf_plan_dft_r2c_3d(n0, n1, n2, grid_.data(), spectrum_.data(), flags);
+    if (plan_ == nullptr) {
+        throw CFilesError("Could not create FFTW plan");
+    }
+#else
+    // planning is only used by FFTW
+    (void)planning;
+    int dims[3] = {n0, n1, n2};
+    cfg_ = kiss_fftndr_alloc(dims, 3, 0, nullptr, nullptr);
+    if (cfg_ == nullptr) {
+        throw CFilesError("Could not allocate memory for FFT");
+    }
+#endif
+}
+
+RealFFT3D::~RealFFT3D() {
+#ifdef CFILES_USE_FFTW3
+    fftwf_destroy_plan(plan_);
+#else
+    kiss_fftndr_free(cfg_);
+#endif
+}
+
+void RealFFT3D::execute() {
+#ifdef CFILES_USE_FFTW3
+    fftwf_execute(plan_);
+#else
+    kiss_fftndr(cfg_, grid_.data(), spectrum_.data());
+#endif
+}
+
+size_t RealFFT3D::fast_size(size_t size) {
+#ifdef CFILES_USE_FFTW3
+    // FFTW is fast for sizes with small prime factors
+    auto is_fast = [](size_t n) {
+        for (size_t factor: {2, 3, 5, 7}) {
+            while (n % factor == 0) {
+                n /= factor;
+            }
+        }
+        return n == 1;
+    };
+    size = size + size % 2;
+    while (!is_fast(size)) {
+        size += 2;
+    }
+    return size;
+#else
+    return static_cast<size_t>(kiss_fftr_next_fast_size_real(static_cast<int>(size)));
+#endif
+}
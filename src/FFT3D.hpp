@@ -0,0 +1,78 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_FFT3D_HPP
+#define CFILES_FFT3D_HPP
+
+#include <array>
+
+#include "Autocorrelation.hpp"
+
+#ifndef CFILES_USE_FFTW3
+#include <kiss_fftndr.h>
+#endif
+
+/// Real to complex 3D FFT, using the same backend (FFTW or KissFFT) as
+/// `Autocorrelation`.
+///
+/// The real grid has `shape[0] x shape[1] x shape[2]` values in row-major
+/// order, and the spectrum only contains the non-negative frequencies along
+/// the last axis, with `shape[0] x shape[1] x (shape[2] / 2 + 1)` values. The
+/// other half of the spectrum is given by hermitian symmetry.
+class RealFFT3D {
+public:
+    /// Create a FFT for a grid with the given `shape`, using the given
+    /// `planning` strategy. The last dimension of the shape must be even.
+    RealFFT3D(std::array<size_t, 3> shape, FFTPlanning planning = FFTPlanning::Estimate);
+    ~RealFFT3D();
+
+    RealFFT3D(const RealFFT3D&) = delete;
+    RealFFT3D& operator=(const RealFFT3D&) = delete;
+    RealFFT3D(RealFFT3D&&) = delete;
+    RealFFT3D& operator=(RealFFT3D&&) = delete;
+
+    /// Get the shape of the real grid
+    const std::array<size_t, 3>& shape() const {
+        return shape_;
+    }
+
+    /// Get the real grid, which is the input of the FFT
+    float* grid() {
+        return grid_.data();
+    }
+
+    /// Get the number of values in the spectrum
+    size_t spectrum_size() const {
+        return shape_[0] * shape_[1] * (shape_[2] / 2 + 1);
+    }
+
+    /// Get the squared norm of the value at `index` in the spectrum
+    double norm2(size_t index) {
+        auto& value = spectrum_[index];
+#ifdef CFILES_USE_FFTW3
+        return static_cast<double>(value[0]) * value[0] + static_cast<double>(value[1]) * value[1];
+#else
+        return static_cast<double>(value.r) * value.r + static_cast<double>(value.i) * value.i;
+#endif
+    }
+
+    /// Compute the spectrum of the current grid. The grid values are
+    /// preserved with KissFFT but not with FFTW.
+    void execute();
+
+    /// Get the smallest even size larger or equal to `size` for which the FFT
+    /// is fast
+    static size_t fast_size(size_t size);
+
+private:
+    std::array<size_t, 3> shape_;
+    AlignedBuffer<float> grid_;
+    AlignedBuffer<fft_complex> spectrum_;
+#ifdef CFILES_USE_FFTW3
+    fftwf_plan plan_;
+#else
+    kiss_fftndr_cfg cfg_;
+#endif
+};
+
+#endif
@@ -0,0 +1,136 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_GRID_HPP
+#define CFILES_GRID_HPP
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/// Three dimensional grid of counts, used to bin particles in space.
+///
+/// The voxels are stored by cubic bricks of `BRICK_SIZE^3` voxels, so that
+/// neighboring voxels in all three directions are close in memory. Bricks are
+/// only allocated when a value is first added to one of their voxels, and the
+/// counts are stored as 16-bit integers. Counts going over 65535 carry into a
+/// separate sparse map, which is only used for the few voxels needing it.
+class CountGrid {
+public:
+    /// Default constructor, creating an empty grid
+    CountGrid(): shape_({{0, 0, 0}}), bricks_shape_({{0, 0, 0}}) {}
+
+    /// Create a grid with `nx`, `ny` and `nz` voxels in each direction
+    CountGrid(size_t nx, size_t ny, size_t nz): shape_({{nx, ny, nz}}) {
+        for (size_t i=0; i<3; i++) {
+            bricks_shape_[i] = (shape_[i] + BRICK_SIZE - 1) / BRICK_SIZE;
+        }
+        bricks_.resize(bricks_shape_[0] * bricks_shape_[1] * bricks_shape_[2]);
+    }
+
+    CountGrid(const CountGrid&) = default;
+    CountGrid(CountGrid&&) = default;
+    CountGrid& operator=(const CountGrid&) = default;
+    CountGrid& operator=(CountGrid&&) = default;
+
+    /// Get the number of voxels in each direction
+    const std::array<size_t, 3>& shape() const {
+        return shape_;
+    }
+
+    /// Increment the count of the voxel at `i, j, k` by one
+    void increment(size_t i, size_t j, size_t k) {
+        assert(i < shape_[0] && j < shape_[1] && k < shape_[2]);
+        auto& brick = bricks_[brick_index(i, j, k)];
+        if (brick.empty()) {
+            brick.resize(BRICK_VOXELS, 0);
+        }
+        auto local = local_index(i, j, k);
+        brick[local] += 1;
+        if (brick[local] == 0) {
+            overflow_[brick_index(i, j, k) * BRICK_VOXELS + local] += UINT16_MAX + 1;
+        }
+    }
+
+    /// Get the count of the voxel at `i, j, k`
+    uint64_t operator()(size_t i, size_t j, size_t k) const {
+        assert(i < shape_[0] && j < shape_[1] && k < shape_[2]);
+        const auto& brick = bricks_[brick_index(i, j, k)];
+        if (brick.empty()) {
+            return 0;
+        }
+        auto local = local_index(i, j, k);
+        uint64_t count = brick[local];
+        if (!overflow_.empty()) {
+            auto it = overflow_.find(brick_index(i, j, k) * BRICK_VOXELS + local);
+            if (it != overflow_.end()) {
+                count += it->second;
+            }
+        }
+        return count;
+    }
+
+    /// Add all the counts from `other` to this grid. Both grids must have the
+    /// same shape.
+    void merge(const CountGrid& other) {
+        assert(shape_ == other.shape_);
+        for (size_t b=0; b<bricks_.size(); b++) {
+            const auto& source = other.bricks_[b];
+            if (source.empty()) {
+                continue;
+            }
+            auto& brick = bricks_[b];
+            if (brick.empty()) {
+                brick = source;
+                continue;
+            }
+            for (size_t local=0; local<BRICK_VOXELS; local++) {
+                uint32_t total = static_cast<uint32_t>(brick[local]) + source[local];
+                brick[local] = static_cast<uint16_t>(total & UINT16_MAX);
+                if (total > UINT16_MAX) {
+                    overflow_[b * BRICK_VOXELS + local] += total & ~static_cast<uint32_t>(UINT16_MAX);
+                }
+            }
+        }
+        for (auto& it: other.overflow_) {
+            overflow_[it.first] += it.second;
+        }
+    }
+
+    /// Get the number of bytes used to store the counts
+    size_t memory() const {
+        size_t allocated = 0;
+        for (auto& brick: bricks_) {
+            allocated += brick.size() * sizeof(uint16_t);
+        }
+        return allocated + overflow_.size() * (sizeof(size_t) + sizeof(uint64_t));
+    }
+
+private:
+    /// Number of voxels along each side of a brick
+    static constexpr size_t BRICK_SIZE = 8;
+    /// Number of voxels in a brick
+    static constexpr size_t BRICK_VOXELS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+
+    size_t brick_index(size_t i, size_t j, size_t k) const {
+        return ((i / BRICK_SIZE) * bricks_shape_[1] + j / BRICK_SIZE) * bricks_shape_[2] + k / BRICK_SIZE;
+    }
+
+    static size_t local_index(size_t i, size_t j, size_t k) {
+        return ((i % BRICK_SIZE) * BRICK_SIZE + j % BRICK_SIZE) * BRICK_SIZE + k % BRICK_SIZE;
+    }
+
+    /// Number of voxels in each direction
+    std::array<size_t, 3> shape_;
+    /// Number of bricks in each direction
+    std::array<size_t, 3> bricks_shape_;
+    /// Voxels counts, by bricks. Bricks without any count are left empty.
+    std::vector<std::vector<uint16_t>> bricks_;
+    /// Part of the counts which did not fit in 16-bit, indexed by
+    /// `brick * BRICK_VOXELS + local`
+    std::unordered_map<size_t, uint64_t> overflow_;
+};
+
+#endif
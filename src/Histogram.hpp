@@ -4,50 +4,74 @@
 #ifndef CFILES_HISTOGRAM_HPP
 #define CFILES_HISTOGRAM_HPP
 
+#include <algorithm>
+#include <array>
 #include <vector>
+#include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <numeric>
-#include <functional>
 
-#include <fmt/format.h>
 #include "warnings.hpp"
 
-/// Histogram class
-class Histogram {
-public:
-    using iterator = std::vector<double>::const_iterator;
+/// Information for each dimension of a Histogram
+struct HistogramDimension {
+    HistogramDimension(): nbins(0), start(0), width(0) {}
+    HistogramDimension(size_t n, double min, double max): nbins(n), start(min), width((max - min) / n) {}
 
-    /// Information for each dimension of a Histogram
-    struct Dimension {
-        Dimension(size_t n, double min, double max): nbins(n), start(min), width((max - min) / n) {}
+    /// Number of bins
+    size_t nbins;
+    /// Starting value for the histogram
+    double start;
+    /// Width of a bin
+    double width;
 
-        /// Number of bins
-        size_t nbins;
-        /// Starting value for the histogram
-        double start;
-        /// Width of a bin
-        double width;
+    double stop() const {
+        return start + nbins * width;
+    }
 
-        double stop() const {
-            return start + nbins * width;
-        }
+    double coord(size_t i) const {
+        return start + (i + 0.5) * width;
+    }
+};
 
-        double coord(size_t i) const {
-            return start + (i + 0.5) * width;
-        }
-    };
+/// Histogram class, with `N` dimensions known at compile time and storing the
+/// bins values as `T`. Use an integer type for `T` when the histogram only
+/// contains counts, and a floating point type when the bins are normalized in
+/// place.
+///
+/// The histogram keeps track of the bins which became non-zero since the last
+/// call to `clear`, so that consumers like `Averager` only need to visit these
+/// bins. Any write which can not be tracked (through the mutable `operator[]`
+/// or `normalize`) marks the whole histogram as touched.
+template <size_t N, typename T = double>
+class Histogram {
+public:
+    static_assert(N == 1 || N == 2, "only 1D and 2D histograms are supported");
+
+    using Dimension = HistogramDimension;
+    using iterator = typename std::vector<T>::const_iterator;
 
     /// Default constructor
-    Histogram(): Histogram(0, 0, 0, 0, 0, 0) {}
-    /// Constructor for a flat 2d histogram with a specific number of bins in
-    /// each direction `n1` and `n2`, and which can hold data in the `min_1 -
-    /// mafirst_2` range (resp `min_1 - mafirst_2`).
-    Histogram(size_t n1, double min1, double max1, size_t n2, double min2, double max2)
-        : data_(n1 * n2), first_(n1, min1, max1), second_(n2, min2, max2) {}
+    Histogram(): data_(), dimensions_() {}
 
     /// Constructor for a 1d histogram with a specific number of bins `n_bins`,
     /// and which can hold data in the `min - max` range.
-    Histogram(size_t n_bins, double min, double max): Histogram(n_bins, min, max, 1, 0, 1) {}
+    Histogram(size_t n_bins, double min, double max): data_(n_bins, T(0)), dimensions_() {
+        static_assert(N == 1, "this constructor is only available for 1D histograms");
+        dimensions_[0] = Dimension(n_bins, min, max);
+    }
+
+    /// Constructor for a flat 2d histogram with a specific number of bins in
+    /// each direction `n1` and `n2`, and which can hold data in the `min1 -
+    /// max1` range (resp `min2 - max2`).
+    Histogram(size_t n1, double min1, double max1, size_t n2, double min2, double max2)
+        : data_(n1 * n2, T(0)), dimensions_()
+    {
+        static_assert(N == 2, "this constructor is only available for 2D histograms");
+        dimensions_[0] = Dimension(n1, min1, max1);
+        dimensions_[1] = Dimension(n2, min2, max2);
+    }
 
     Histogram(const Histogram&) = default;
     Histogram(Histogram&&) = default;
@@ -66,61 +90,210 @@ public:
         return data_.end();
     }
 
-    double operator[](size_t i) const {
+    T operator[](size_t i) const {
         return data_[i];
     }
 
-    double& operator[](size_t i) {
+    T& operator[](size_t i) {
+        all_touched_ = true;
         return data_[i];
     }
 
-    /// Using call pperator for 2D indexing 2D histogram
-    double operator()(size_t i, size_t j) const {
-        return data_[j + i * second_.nbins];
+    /// Using call operator for 2D indexing 2D histogram
+    T operator()(size_t i, size_t j) const {
+        static_assert(N == 2, "2D indexing is only available for 2D histograms");
+        return data_[j + i * dimensions_[1].nbins];
     }
 
     /// Get the first dimension
-    const Dimension& first() const {return first_;}
+    const Dimension& first() const {
+        return dimensions_[0];
+    }
 
     /// Get the second dimension
-    const Dimension& second() const {return second_;}
-
-    /// Insert some `x,y` in the histogram
-    void insert(double x, double y = 0) {
-        auto bin1 = std::floor((x - first_.start) / first_.width);
-        auto bin2 = std::floor((y - second_.start) / second_.width);
-        if (bin1 >= first_.nbins or bin1 < 0) {
-            warn_once(fmt::format(
-                "point {} is out of histogram boundaries ({}:{})",
-                x, first_.start, first_.stop()
-            ));
+    const Dimension& second() const {
+        static_assert(N == 2, "second dimension is only available for 2D histograms");
+        return dimensions_[1];
+    }
+
+    /// Insert a single value `x` in this 1D histogram
+    void insert(double x) {
+        static_assert(N == 1, "this function is only available for 1D histograms");
+        auto bin = std::floor((x - first().start) / first().width);
+        if (bin >= first().nbins or bin < 0) {
+            static WarningSite OUT_OF_BOUNDS("point {} is out of histogram boundaries ({}:{})");
+            OUT_OF_BOUNDS.emit(x, first().start, first().stop());
             return;
         }
-        if (bin2 >= second_.nbins or bin2 < 0) {
-            warn_once(fmt::format(
-                "point {} is out of histogram boundaries ({}:{})",
-                y, second_.start, second_.stop()
-            ));
+        increment(static_cast<size_t>(bin));
+    }
+
+    /// Insert a single point `x, y` in this 2D histogram
+    void insert(double x, double y) {
+        static_assert(N == 2, "this function is only available for 2D histograms");
+        auto bin1 = std::floor((x - first().start) / first().width);
+        auto bin2 = std::floor((y - second().start) / second().width);
+        if (bin1 >= first().nbins or bin1 < 0) {
+            static WarningSite OUT_OF_BOUNDS("point {} is out of histogram boundaries ({}:{})");
+            OUT_OF_BOUNDS.emit(x, first().start, first().stop());
+            return;
+        }
+        if (bin2 >= second().nbins or bin2 < 0) {
+            static WarningSite OUT_OF_BOUNDS("point {} is out of histogram boundaries ({}:{})");
+            OUT_OF_BOUNDS.emit(y, second().start, second().stop());
             return;
         }
-        data_[bin2 + bin1 * second_.nbins] += 1;
+        increment(static_cast<size_t>(bin2) + static_cast<size_t>(bin1) * second().nbins);
+    }
+
+    /// Insert all the `values` in this 1D histogram. Values outside of the
+    /// histogram boundaries are not inserted, but counted in `out_of_bounds`.
+    void insert_many(const std::vector<double>& values) {
+        static_assert(N == 1, "this function is only available for 1D histograms");
+        assert(first().nbins < INT32_MAX);
+        const auto start = first().start;
+        const auto inverse = 1.0 / first().width;
+        const auto nbins = static_cast<double>(first().nbins);
+
+        int32_t bins[BATCH_SIZE];
+        for (size_t batch=0; batch<values.size(); batch+=BATCH_SIZE) {
+            size_t count = values.size() - batch;
+            if (count > BATCH_SIZE) {
+                count = BATCH_SIZE;
+            }
+            auto batch_values = values.data() + batch;
+            // This loop is branch-free to allow the compiler to vectorize it.
+            // The comparisons are false for NaN, which end up out of bounds.
+            for (size_t i=0; i<count; i++) {
+                auto bin = (batch_values[i] - start) * inverse;
+                auto inside = (bin >= 0.0) & (bin < nbins);
+                bins[i] = inside ? static_cast<int32_t>(bin) : -1;
+            }
+            scatter(bins, count);
+        }
+    }
+
+    /// Insert all the `(x[i], y[i])` points in this 2D histogram. Points
+    /// outside of the histogram boundaries are not inserted, but counted in
+    /// `out_of_bounds`.
+    void insert_many(const std::vector<double>& x, const std::vector<double>& y) {
+        static_assert(N == 2, "this function is only available for 2D histograms");
+        assert(x.size() == y.size());
+        assert(data_.size() < INT32_MAX);
+        const auto start_1 = first().start;
+        const auto inverse_1 = 1.0 / first().width;
+        const auto nbins_1 = static_cast<double>(first().nbins);
+        const auto start_2 = second().start;
+        const auto inverse_2 = 1.0 / second().width;
+        const auto nbins_2 = static_cast<double>(second().nbins);
+        const auto stride = static_cast<int32_t>(second().nbins);
+
+        int32_t bins[BATCH_SIZE];
+        for (size_t batch=0; batch<x.size(); batch+=BATCH_SIZE) {
+            size_t count = x.size() - batch;
+            if (count > BATCH_SIZE) {
+                count = BATCH_SIZE;
+            }
+            auto batch_x = x.data() + batch;
+            auto batch_y = y.data() + batch;
+            for (size_t i=0; i<count; i++) {
+                auto bin_1 = (batch_x[i] - start_1) * inverse_1;
+                auto bin_2 = (batch_y[i] - start_2) * inverse_2;
+                auto inside = (bin_1 >= 0.0) & (bin_1 < nbins_1) & (bin_2 >= 0.0) & (bin_2 < nbins_2);
+                bins[i] = inside ? static_cast<int32_t>(bin_1) * stride + static_cast<int32_t>(bin_2) : -1;
+            }
+            scatter(bins, count);
+        }
+    }
+
+    /// Add `value` to the bin at index `bin`, for callers which already
+    /// binned and counted their values
+    void add(size_t bin, T value) {
+        assert(bin < data_.size());
+        if (data_[bin] == T(0) && value != T(0)) {
+            touched_.push_back(bin);
+        }
+        data_[bin] += value;
+    }
+
+    /// Get the number of values which where outside of the histogram
+    /// boundaries in `insert_many`
+    size_t out_of_bounds() const {
+        return out_of_bounds_;
     }
 
     /// Normalize the data with a `function` callback, which will be called for
     /// each value. The function should take two arguments being the current
     /// bin index and the data, and return the new data.
-    void normalize(std::function<double(size_t, double)> function) {
+    template <typename Function>
+    void normalize(Function function) {
+        all_touched_ = true;
         for (size_t i = 0; i < this->size(); i++){
             data_[i] = function(i, data_[i]);
         }
     }
+
+    /// Set all the bins to zero
+    void clear() {
+        if (all_touched_) {
+            std::fill(data_.begin(), data_.end(), T(0));
+        } else {
+            for (auto bin: touched_) {
+                data_[bin] = T(0);
+            }
+        }
+        touched_.clear();
+        all_touched_ = false;
+    }
+
+protected:
+    /// Indexes of the bins which became non-zero since the last call to
+    /// `clear`. Only meaningful if `all_touched_` is false.
+    const std::vector<size_t>& touched() const {
+        return touched_;
+    }
+
+    /// Check if any bin could have been modified since the last call to
+    /// `clear`, without being recorded in `touched`.
+    bool all_touched() const {
+        return all_touched_;
+    }
+
 private:
+    /// Number of values to bin at once in `insert_many`
+    static constexpr size_t BATCH_SIZE = 256;
+
+    /// Increment the bins at the given indexes, -1 being used for values
+    /// outside of the histogram
+    void scatter(const int32_t* bins, size_t count) {
+        for (size_t i=0; i<count; i++) {
+            if (bins[i] >= 0) {
+                increment(static_cast<size_t>(bins[i]));
+            } else {
+                out_of_bounds_ += 1;
+            }
+        }
+    }
+
+    /// Increment the bin at index `bin`, recording it in `touched_` if it was
+    /// empty
+    void increment(size_t bin) {
+        if (data_[bin] == T(0)) {
+            touched_.push_back(bin);
+        }
+        data_[bin] += 1;
+    }
+
     /// Histogram data
-    std::vector<double> data_;
-    /// First dimension
-    Dimension first_;
-    /// Second dimension
-    Dimension second_;
+    std::vector<T> data_;
+    /// Histogram dimensions
+    std::array<Dimension, N> dimensions_;
+    /// Number of values outside of the histogram in `insert_many`
+    size_t out_of_bounds_ = 0;
+    /// Bins which became non-zero since the last call to `clear`
+    std::vector<size_t> touched_;
+    /// Were bins modified without being recorded in `touched_`?
+    bool all_touched_ = false;
 };
 
 #endif
@@ -0,0 +1,138 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <algorithm>
+#include <cassert>
+
+#include "MultiTau.hpp"
+#include "Errors.hpp"
+
+const size_t MultiTauCorrelator::POINTS;
+const size_t MultiTauCorrelator::AVERAGING;
+
+/// Maximal number of levels. This is enough for any trajectory that could
+/// be stored on disk, and allow to never re-allocate `levels_`.
+static const size_t MAX_LEVELS = 64;
+
+MultiTauCorrelator::MultiTauCorrelator(size_t nseries, size_t dimension, Operation operation, std::vector<double> weights):
+    nseries_(nseries), dimension_(dimension), operation_(operation), weights_(std::move(weights))
+{
+    if (weights_.empty()) {
+        weights_.assign(dimension_, 1.0);
+    }
+    if (weights_.size() != dimension_) {
+        throw CFilesError("the number of weights must match the dimension of the correlator");
+    }
+    levels_.reserve(MAX_LEVELS);
+}
+
+void MultiTauCorrelator::add_series(size_t count) {
+    assert(operation_ == Product);
+    nseries_ += count;
+    for (auto& level: levels_) {
+        level.values.resize(nseries_ * POINTS * dimension_, 0.0);
+        level.accumulator.resize(nseries_ * dimension_, 0.0);
+    }
+}
+
+void MultiTauCorrelator::add(const std::vector<double>& values) {
+    assert(values.size() == nseries_ * dimension_);
+    add(0, values.data());
+}
+
+size_t MultiTauCorrelator::first_lag(size_t level) {
+    // lags below POINTS / AVERAGING are already computed with a better
+    // resolution in the previous level
+    return level == 0 ? 0 : POINTS / AVERAGING;
+}
+
+void MultiTauCorrelator::add(size_t index, const double* values) {
+    if (index == levels_.size()) {
+        if (index == MAX_LEVELS) {
+            throw CFilesError("too many steps for the multiple-tau correlator");
+        }
+        auto level = Level();
+        level.values.assign(nseries_ * POINTS * dimension_, 0.0);
+        level.accumulator.assign(nseries_ * dimension_, 0.0);
+        level.correlation.assign(POINTS, 0.0);
+        level.origins.assign(POINTS, 0);
+        levels_.emplace_back(std::move(level));
+    }
+    auto& level = levels_[index];
+
+    auto head = level.head;
+    level.count += 1;
+    auto available = std::min(level.count, POINTS);
+
+    // Store the new values and correlate them with the previous ones
+    for (size_t serie=0; serie<nseries_; serie++) {
+        auto input = values + serie * dimension_;
+        auto stored = level.values.data() + serie * POINTS * dimension_;
+        auto current = stored + head * dimension_;
+        std::copy(input, input + dimension_, current);
+
+        for (size_t lag=first_lag(index); lag<available; lag++) {
+            auto previous = stored + ((head + POINTS - lag) % POINTS) * dimension_;
+            double sum = 0;
+            if (operation_ == Product) {
+                for (size_t i=0; i<dimension_; i++) {
+                    sum += weights_[i] * current[i] * previous[i];
+                }
+            } else {
+                for (size_t i=0; i<dimension_; i++) {
+                    auto delta = current[i] - previous[i];
+                    sum += weights_[i] * delta * delta;
+                }
+            }
+            level.correlation[lag] += sum;
+        }
+    }
+    for (size_t lag=first_lag(index); lag<available; lag++) {
+        level.origins[lag] += 1;
+    }
+    level.head = (head + 1) % POINTS;
+
+    // Average consecutive values and send them to the next level
+    for (size_t i=0; i<nseries_ * dimension_; i++) {
+        level.accumulator[i] += values[i];
+    }
+    level.accumulated += 1;
+    if (level.accumulated == AVERAGING) {
+        for (auto& value: level.accumulator) {
+            value /= AVERAGING;
+        }
+        // `levels_` never re-allocate, so `level` stays valid
+        add(index + 1, level.accumulator.data());
+        std::fill(level.accumulator.begin(), level.accumulator.end(), 0.0);
+        level.accumulated = 0;
+    }
+}
+
+std::vector<size_t> MultiTauCorrelator::lags() const {
+    auto lags = std::vector<size_t>();
+    size_t resolution = 1;
+    for (size_t index=0; index<levels_.size(); index++) {
+        auto& level = levels_[index];
+        for (size_t lag=first_lag(index); lag<POINTS; lag++) {
+            if (level.origins[lag] != 0) {
+                lags.push_back(lag * resolution);
+            }
+        }
+        resolution *= AVERAGING;
+    }
+    return lags;
+}
+
+std::vector<double> MultiTauCorrelator::correlation() const {
+    auto correlation = std::vector<double>();
+    for (size_t index=0; index<levels_.size(); index++) {
+        auto& level = levels_[index];
+        for (size_t lag=first_lag(index); lag<POINTS; lag++) {
+            if (level.origins[lag] != 0) {
+                auto norm = static_cast<double>(level.origins[lag]) * static_cast<double>(nseries_);
+                correlation.push_back(nseries_ == 0 ? 0.0 : level.correlation[lag] / norm);
+            }
+        }
+    }
+    return correlation;
+}
@@ -0,0 +1,96 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_MULTITAU_HPP
+#define CFILES_MULTITAU_HPP
+
+#include <vector>
+
+/// Streaming multiple-tau correlator, as described in
+/// https://doi.org/10.1063/1.3491098.
+///
+/// The correlator averages a correlation function over multiple time series
+/// of vectors with `dimension` components, receiving the values of all the
+/// series one step at the time. The time series are stored in a hierarchy of
+/// levels: level 0 stores the last `points` values of each series, and each
+/// following level stores the last `points` averages of `averaging`
+/// consecutive values of the previous level. Lags are then computed with a
+/// resolution of `averaging^level` steps in each level, giving logarithmically
+/// spaced lags using `O(points * log(nsteps))` memory for each series.
+class MultiTauCorrelator {
+public:
+    /// Function to correlate between the values at times `t` and `t + lag`
+    enum Operation {
+        /// Sum over the components of `weight * x(t) * x(t + lag)`
+        Product,
+        /// Sum over the components of `weight * (x(t + lag) - x(t))^2`
+        SquaredDifference,
+    };
+
+    /// Create a new correlator for `nseries` time series of vectors with
+    /// `dimension` components, using the given `operation`. The components
+    /// are weighted by `weights` (all weights are 1 if it is empty).
+    MultiTauCorrelator(size_t nseries, size_t dimension, Operation operation, std::vector<double> weights = {});
+
+    /// Add `count` new time series, which are considered to be zero for all
+    /// the steps before the current one. This is only valid with the `Product`
+    /// operation.
+    void add_series(size_t count);
+
+    /// Get the number of time series in this correlator
+    size_t nseries() const {
+        return nseries_;
+    }
+
+    /// Add the values of all the time series for the next step. `values` must
+    /// contain `nseries * dimension` values, with all the components of the
+    /// first series, then all the components of the second series, etc.
+    void add(const std::vector<double>& values);
+
+    /// Get the lags (in number of steps) for which the correlation is
+    /// available, in increasing order
+    std::vector<size_t> lags() const;
+
+    /// Get the correlation for all the lags returned by `lags`, averaged over
+    /// all the time origins and all the time series
+    std::vector<double> correlation() const;
+
+private:
+    /// Number of values in each level
+    static const size_t POINTS = 16;
+    /// Number of values averaged together when going from one level to the
+    /// next one
+    static const size_t AVERAGING = 2;
+
+    struct Level {
+        /// Last `POINTS` values of all the series, indexed by `(serie *
+        /// POINTS + slot) * dimension + component`
+        std::vector<double> values;
+        /// Sum of the values to average before sending them to the next
+        /// level, indexed by `serie * dimension + component`
+        std::vector<double> accumulator;
+        /// Number of values in the accumulator
+        size_t accumulated = 0;
+        /// Slot where the next value will be stored
+        size_t head = 0;
+        /// Number of values added to this level
+        size_t count = 0;
+        /// Sum over the series of the correlation for each lag
+        std::vector<double> correlation;
+        /// Number of time origins used for each lag
+        std::vector<size_t> origins;
+    };
+
+    /// Add a value for all the series at the given `level`
+    void add(size_t level, const double* values);
+    /// Get the first lag index computed in the given `level`
+    static size_t first_lag(size_t level);
+
+    size_t nseries_;
+    size_t dimension_;
+    Operation operation_;
+    std::vector<double> weights_;
+    std::vector<Level> levels_;
+};
+
+#endif
@@ -0,0 +1,485 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "Output.hpp"
+#include "Errors.hpp"
+
+constexpr size_t BufferedFile::BUFFER_SIZE;
+
+OutputFormat parse_output_format(const std::string& format) {
+    if (format == "text") {
+        return OutputFormat::Text;
+    } else if (format == "npy") {
+        return OutputFormat::Numpy;
+    } else {
+        throw CFilesError("unknown output format '" + format + "', expected 'text' or 'npy'");
+    }
+}
+
+std::string output_extension(OutputFormat format) {
+    switch (format) {
+    case OutputFormat::Text:
+        return ".dat";
+    case OutputFormat::Numpy:
+        return ".npz";
+    }
+    return ".dat";
+}
+
+std::string selection_output_path(const std::string& path, size_t selection, size_t nselections) {
+    if (nselections <= 1) {
+        return path;
+    }
+
+    auto index = "." + std::to_string(selection);
+    auto slash = path.find_last_of("/\\");
+    auto dot = path.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return path + index;
+    }
+    return path.substr(0, dot) + index + path.substr(dot);
+}
+
+/******************************************************************************/
+
+BufferedFile::BufferedFile(std::string path): path_(std::move(path)), file_(nullptr) {
+    file_ = std::fopen(path_.c_str(), "wb");
+    if (file_ == nullptr) {
+        throw CFilesError("Could not open the '" + path_ + "' file.");
+    }
+    buffer_.reserve(BUFFER_SIZE + 4096);
+}
+
+BufferedFile::~BufferedFile() {
+    if (file_ != nullptr) {
+        try {
+            close();
+        } catch (const CFilesError&) {
+            // ignore errors in destructor
+        }
+    }
+}
+
+void BufferedFile::flush() {
+    if (buffer_.size() != 0) {
+        write_to_file(buffer_.data(), buffer_.size());
+        buffer_.resize(0);
+    }
+}
+
+void BufferedFile::write_to_file(const char* data, size_t size) {
+    if (file_ == nullptr) {
+        throw CFilesError("the '" + path_ + "' file is already closed");
+    }
+    if (std::fwrite(data, 1, size, file_) != size) {
+        throw CFilesError("failed to write to the '" + path_ + "' file");
+    }
+    written_ += size;
+}
+
+void BufferedFile::close() {
+    if (file_ == nullptr) {
+        return;
+    }
+    flush();
+    auto status = std::fclose(file_);
+    file_ = nullptr;
+    if (status != 0) {
+        throw CFilesError("failed to write to the '" + path_ + "' file");
+    }
+}
+
+/******************************************************************************/
+
+static bool is_little_endian() {
+    uint16_t value = 1;
+    char first = 0;
+    std::memcpy(&first, &value, 1);
+    return first == 1;
+}
+
+/// Convert an UTF-8 `string` to UTF-32, as used by NumPy unicode arrays
+static std::vector<uint32_t> utf8_to_utf32(const std::string& string) {
+    auto result = std::vector<uint32_t>();
+    result.reserve(string.size());
+    size_t i = 0;
+    while (i < string.size()) {
+        auto byte = static_cast<unsigned char>(string[i]);
+        uint32_t codepoint = 0;
+        size_t length = 0;
+        if (byte < 0x80) {
+            codepoint = byte;
+            length = 1;
+        } else if ((byte & 0xE0) == 0xC0) {
+            codepoint = byte & 0x1F;
+            length = 2;
+        } else if ((byte & 0xF0) == 0xE0) {
+            codepoint = byte & 0x0F;
+            length = 3;
+        } else if ((byte & 0xF8) == 0xF0) {
+            codepoint = byte & 0x07;
+            length = 4;
+        } else {
+            // invalid byte, use the replacement character
+            result.push_back(0xFFFD);
+            i++;
+            continue;
+        }
+
+        if (i + length > string.size()) {
+            result.push_back(0xFFFD);
+            break;
+        }
+
+        for (size_t j=1; j<length; j++) {
+            codepoint = (codepoint << 6) | (static_cast<unsigned char>(string[i + j]) & 0x3F);
+        }
+        result.push_back(codepoint);
+        i += length;
+    }
+    return result;
+}
+
+/// Build the header of a `.npy` file for an array with the given `descr` and
+/// `shape`
+static std::string npy_header(const std::string& descr, const std::vector<size_t>& shape) {
+    auto dict = "{'descr': '" + descr + "', 'fortran_order': False, 'shape': (";
+    for (auto size: shape) {
+        dict += std::to_string(size) + ", ";
+    }
+    if (shape.size() > 1) {
+        // no trailing comma for tuples with more than one element
+        dict.resize(dict.size() - 2);
+    } else if (shape.size() == 1) {
+        dict.resize(dict.size() - 1);
+    }
+    dict += "), }";
+
+    // magic string (6 bytes) + version (2 bytes) + header length (2 bytes)
+    const size_t preamble = 10;
+    // The total header size must be a multiple of 64, and end with a newline
+    auto total = preamble + dict.size() + 1;
+    auto padding = (64 - total % 64) % 64;
+    dict += std::string(padding, ' ') + '\n';
+
+    if (dict.size() > UINT16_MAX) {
+        throw CFilesError("array shape is too large for the npy format");
+    }
+
+    auto header = std::string("\x93NUMPY\x01\x00", 8);
+    header.push_back(static_cast<char>(dict.size() & 0xFF));
+    header.push_back(static_cast<char>((dict.size() >> 8) & 0xFF));
+    return header + dict;
+}
+
+static size_t shape_size(const std::vector<size_t>& shape) {
+    size_t size = 1;
+    for (auto n: shape) {
+        size *= n;
+    }
+    return size;
+}
+
+void NpzWriter::add(std::string name, std::vector<size_t> shape, const std::vector<double>& data) {
+    if (shape_size(shape) != data.size()) {
+        throw CFilesError("shape and data size do not match for array '" + name + "'");
+    }
+    auto descr = std::string(is_little_endian() ? "<" : ">") + "f8";
+    add_raw(name, descr, shape, reinterpret_cast<const char*>(data.data()), data.size() * sizeof(double));
+}
+
+void NpzWriter::add(std::string name, std::vector<size_t> shape, const std::vector<float>& data) {
+    if (shape_size(shape) != data.size()) {
+        throw CFilesError("shape and data size do not match for array '" + name + "'");
+    }
+    auto descr = std::string(is_little_endian() ? "<" : ">") + "f4";
+    add_raw(name, descr, shape, reinterpret_cast<const char*>(data.data()), data.size() * sizeof(float));
+}
+
+void NpzWriter::add(std::string name, std::vector<size_t> shape, const std::vector<uint64_t>& data) {
+    if (shape_size(shape) != data.size()) {
+        throw CFilesError("shape and data size do not match for array '" + name + "'");
+    }
+    auto descr = std::string(is_little_endian() ? "<" : ">") + "u8";
+    add_raw(name, descr, shape, reinterpret_cast<const char*>(data.data()), data.size() * sizeof(uint64_t));
+}
+
+void NpzWriter::add(std::string name, const std::string& string) {
+    auto utf32 = utf8_to_utf32(string);
+    if (utf32.empty()) {
+        // NumPy does not support zero-sized unicode strings
+        utf32.push_back(0);
+    }
+    auto descr = std::string(is_little_endian() ? "<" : ">") + "U" + std::to_string(utf32.size());
+    add_raw(name, descr, {}, reinterpret_cast<const char*>(utf32.data()), utf32.size() * sizeof(uint32_t));
+}
+
+/// Update the CRC-32 checksum `crc` of some data with the next `size` bytes
+/// starting at `data`. The checksum of empty data is 0.
+static uint32_t crc32(uint32_t crc, const char* data, size_t size) {
+    static const auto TABLE = []() -> std::array<uint32_t, 256> {
+        auto table = std::array<uint32_t, 256>();
+        for (uint32_t i=0; i<256; i++) {
+            uint32_t value = i;
+            for (size_t bit=0; bit<8; bit++) {
+                value = (value & 1) ? (0xEDB88320 ^ (value >> 1)) : (value >> 1);
+            }
+            table[i] = value;
+        }
+        return table;
+    }();
+
+    crc = crc ^ 0xFFFFFFFF;
+    for (size_t i=0; i<size; i++) {
+        crc = TABLE[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+/// Append `value` to `output` as a little-endian integer of `size` bytes
+static void write_le(std::string& output, uint64_t value, size_t size) {
+    for (size_t i=0; i<size; i++) {
+        output.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+// The npz format is a zip archive containing one `<name>.npy` file per array.
+// We only use the stored (uncompressed) zip method. Sizes and offsets which do
+// not fit in the 32-bit fields of the zip format are stored in Zip64 extra
+// fields, and the 32-bit fields are set to 0xFFFFFFFF.
+static bool needs_zip64(uint64_t value) {
+    return value >= UINT32_MAX;
+}
+
+/// Get the value to store in a 32-bit field of the zip format
+static uint64_t zip32(uint64_t value) {
+    return needs_zip64(value) ? UINT32_MAX : value;
+}
+
+// 1980-01-01, the earliest date in the zip format
+static const uint16_t DOS_DATE = (1 << 5) | 1;
+
+NpzWriter::NpzWriter(std::string path): file_(new BufferedFile(std::move(path))) {}
+
+void NpzWriter::add_raw(const std::string& name, const std::string& descr, const std::vector<size_t>& shape, const char* data, size_t size) {
+    if (!file_) {
+        throw CFilesError("can not add the '" + name + "' array to an npz archive which was already written");
+    }
+
+    auto npy = npy_header(descr, shape);
+    auto crc = crc32(crc32(0, npy.data(), npy.size()), data, size);
+    auto record = entry{name + ".npy", crc, npy.size() + size, file_->position()};
+    bool zip64 = needs_zip64(record.size);
+
+    auto header = std::string();
+    write_le(header, 0x04034b50, 4);              // local file header signature
+    write_le(header, zip64 ? 45 : 20, 2);         // version needed to extract
+    write_le(header, 0, 2);                       // general purpose flags
+    write_le(header, 0, 2);                       // compression method (stored)
+    write_le(header, 0, 2);                       // last modification time
+    write_le(header, DOS_DATE, 2);                // last modification date
+    write_le(header, record.crc, 4);              // CRC-32
+    write_le(header, zip32(record.size), 4);      // compressed size
+    write_le(header, zip32(record.size), 4);      // uncompressed size
+    write_le(header, record.filename.size(), 2);  // file name length
+    write_le(header, zip64 ? 20 : 0, 2);          // extra field length
+    header += record.filename;
+    if (zip64) {
+        write_le(header, 0x0001, 2);       // Zip64 extra field tag
+        write_le(header, 16, 2);           // size of the extra field
+        write_le(header, record.size, 8);  // uncompressed size
+        write_le(header, record.size, 8);  // compressed size
+    }
+
+    file_->write(header);
+    file_->write(npy);
+    file_->write(data, size);
+    entries_.emplace_back(std::move(record));
+}
+
+void NpzWriter::write() {
+    if (!file_) {
+        throw CFilesError("this npz archive was already written");
+    }
+
+    auto directory_offset = file_->position();
+    for (auto& entry: entries_) {
+        // Zip64 extra field, containing only the values which do not fit in
+        // the corresponding 32-bit fields
+        auto extra = std::string();
+        if (needs_zip64(entry.size)) {
+            write_le(extra, entry.size, 8);  // uncompressed size
+            write_le(extra, entry.size, 8);  // compressed size
+        }
+        if (needs_zip64(entry.offset)) {
+            write_le(extra, entry.offset, 8);  // offset of local header
+        }
+        bool zip64 = !extra.empty();
+
+        auto record = std::string();
+        write_le(record, 0x02014b50, 4);                    // central file header signature
+        write_le(record, zip64 ? 45 : 20, 2);               // version made by
+        write_le(record, zip64 ? 45 : 20, 2);               // version needed to extract
+        write_le(record, 0, 2);                             // general purpose flags
+        write_le(record, 0, 2);                             // compression method
+        write_le(record, 0, 2);                             // last modification time
+        write_le(record, DOS_DATE, 2);                      // last modification date
+        write_le(record, entry.crc, 4);                     // CRC-32
+        write_le(record, zip32(entry.size), 4);             // compressed size
+        write_le(record, zip32(entry.size), 4);             // uncompressed size
+        write_le(record, entry.filename.size(), 2);         // file name length
+        write_le(record, zip64 ? extra.size() + 4 : 0, 2);  // extra field length
+        write_le(record, 0, 2);                             // file comment length
+        write_le(record, 0, 2);                             // disk number start
+        write_le(record, 0, 2);                             // internal file attributes
+        write_le(record, 0, 4);                             // external file attributes
+        write_le(record, zip32(entry.offset), 4);           // offset of local header
+        record += entry.filename;
+        if (zip64) {
+            write_le(record, 0x0001, 2);        // Zip64 extra field tag
+            write_le(record, extra.size(), 2);  // size of the extra field
+            record += extra;
+        }
+        file_->write(record);
+    }
+
+    auto end_offset = file_->position();
+    auto directory_size = end_offset - directory_offset;
+    uint64_t count = entries_.size();
+
+    auto end = std::string();
+    if (count >= UINT16_MAX || needs_zip64(directory_size) || needs_zip64(directory_offset)) {
+        write_le(end, 0x06064b50, 4);        // Zip64 end of central directory signature
+        write_le(end, 44, 8);                // size of the remaining record
+        write_le(end, 45, 2);                // version made by
+        write_le(end, 45, 2);                // version needed to extract
+        write_le(end, 0, 4);                 // number of this disk
+        write_le(end, 0, 4);                 // disk where central directory starts
+        write_le(end, count, 8);             // number of entries on this disk
+        write_le(end, count, 8);             // total number of entries
+        write_le(end, directory_size, 8);    // size of central directory
+        write_le(end, directory_offset, 8);  // offset of central directory
+
+        write_le(end, 0x07064b50, 4);  // Zip64 end of central directory locator signature
+        write_le(end, 0, 4);           // disk where the Zip64 end record is
+        write_le(end, end_offset, 8);  // offset of the Zip64 end record
+        write_le(end, 1, 4);           // total number of disks
+    }
+
+    write_le(end, 0x06054b50, 4);                             // end of central directory signature
+    write_le(end, 0, 2);                                      // number of this disk
+    write_le(end, 0, 2);                                      // disk where central directory starts
+    write_le(end, std::min<uint64_t>(count, UINT16_MAX), 2);  // number of entries on this disk
+    write_le(end, std::min<uint64_t>(count, UINT16_MAX), 2);  // total number of entries
+    write_le(end, zip32(directory_size), 4);                  // size of central directory
+    write_le(end, zip32(directory_offset), 4);                // offset of central directory
+    write_le(end, 0, 2);                                      // comment length
+
+    file_->write(end);
+    file_->close();
+    file_.reset();
+    entries_.clear();
+}
+
+/******************************************************************************/
+
+void ResultWriter::column(std::string name, std::vector<double> values) {
+    columns_.push_back({std::move(name), std::move(values), {}, false});
+}
+
+void ResultWriter::column(std::string name, std::vector<uint64_t> values) {
+    columns_.push_back({std::move(name), {}, std::move(values), true});
+}
+
+void ResultWriter::grid(std::string name,
+                        std::string first_name, std::vector<double> first,
+                        std::string second_name, std::vector<double> second,
+                        std::vector<double> values) {
+    if (first.size() * second.size() != values.size()) {
+        throw CFilesError("grid and axis sizes do not match for '" + name + "'");
+    }
+    grids_.push_back({
+        std::move(name),
+        std::move(first_name), std::move(first),
+        std::move(second_name), std::move(second),
+        std::move(values)
+    });
+}
+
+void ResultWriter::write() {
+    switch (format_) {
+    case OutputFormat::Text:
+        write_text();
+        break;
+    case OutputFormat::Numpy:
+        write_numpy();
+        break;
+    }
+}
+
+void ResultWriter::write_text() {
+    TextWriter writer(path_);
+    for (auto& line: comments_) {
+        writer.comment(line);
+    }
+
+    if (!columns_.empty()) {
+        auto nrows = columns_[0].size();
+        for (auto& column: columns_) {
+            if (column.size() != nrows) {
+                throw CFilesError("all columns must have the same size in text output");
+            }
+        }
+
+        for (size_t i=0; i<nrows; i++) {
+            for (auto& column: columns_) {
+                if (column.is_integer) {
+                    writer.value(column.integers[i]);
+                } else {
+                    writer.value(column.values[i]);
+                }
+            }
+            writer.end_row();
+        }
+    }
+
+    for (auto& grid: grids_) {
+        for (size_t i=0; i<grid.first.size(); i++) {
+            for (size_t j=0; j<grid.second.size(); j++) {
+                writer.row(grid.first[i], grid.second[j], grid.values[i * grid.second.size() + j]);
+            }
+        }
+    }
+
+    writer.close();
+}
+
+void ResultWriter::write_numpy() {
+    auto writer = NpzWriter(path_);
+
+    auto metadata = std::string();
+    for (auto& line: comments_) {
+        metadata += line + "\n";
+    }
+    writer.add("metadata", metadata);
+
+    for (auto& column: columns_) {
+        if (column.is_integer) {
+            writer.add(column.name, {column.integers.size()}, column.integers);
+        } else {
+            writer.add(column.name, {column.values.size()}, column.values);
+        }
+    }
+
+    for (auto& grid: grids_) {
+        writer.add(grid.first_name, {grid.first.size()}, grid.first);
+        writer.add(grid.second_name, {grid.second.size()}, grid.second);
+        writer.add(grid.name, {grid.first.size(), grid.second.size()}, grid.values);
+    }
+
+    writer.write();
+}
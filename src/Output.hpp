@@ -0,0 +1,309 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_OUTPUT_HPP
+#define CFILES_OUTPUT_HPP
+
+#include <cstdio>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+/// Format to use when writing the results of an analysis
+enum class OutputFormat {
+    /// Plain text, with one line per value and comments starting with `#`
+    Text,
+    /// NumPy `.npz` archive, containing one array per result and the comments
+    /// as a `metadata` string
+    Numpy,
+};
+
+/// Parse the value of an `--output-format` option, either `text` or `npy`
+OutputFormat parse_output_format(const std::string& format);
+
+/// Get the default extension for output files using the given `format`
+std::string output_extension(OutputFormat format);
+
+/// Get the path of the output file for the selection at index `selection`,
+/// out of `nselections` selections. When using multiple selections, the
+/// index of the selection is inserted before the extension of `path`.
+std::string selection_output_path(const std::string& path, size_t selection, size_t nselections);
+
+/// A file opened for writing, using a large in-memory buffer to reduce the
+/// number of system calls.
+class BufferedFile {
+public:
+    /// Open the file at `path` for writing, replacing any existing file
+    explicit BufferedFile(std::string path);
+    /// Flush the buffer and close the file. Errors are ignored, call `close`
+    /// explicitly to check for them.
+    ~BufferedFile();
+
+    BufferedFile(const BufferedFile&) = delete;
+    BufferedFile& operator=(const BufferedFile&) = delete;
+
+    /// Write `size` bytes starting at `data` to the file
+    void write(const char* data, size_t size) {
+        if (buffer_.size() + size > BUFFER_SIZE) {
+            flush();
+        }
+        if (size > BUFFER_SIZE) {
+            write_to_file(data, size);
+        } else {
+            buffer_.append(data, data + size);
+        }
+    }
+
+    /// Write the content of `string` to the file
+    void write(const std::string& string) {
+        write(string.data(), string.size());
+    }
+
+    /// Get the in-memory buffer, to format data directly into it. The buffer
+    /// is flushed to the file once it grows past its nominal size.
+    fmt::memory_buffer& buffer() {
+        return buffer_;
+    }
+
+    /// Flush the in-memory buffer to the file if it is full
+    void maybe_flush() {
+        if (buffer_.size() > BUFFER_SIZE) {
+            flush();
+        }
+    }
+
+    /// Write the in-memory buffer to the file
+    void flush();
+    /// Flush the buffer and close the file, throwing an error on failure
+    void close();
+
+    /// Get the path to this file
+    const std::string& path() const {
+        return path_;
+    }
+
+    /// Get the number of bytes written so far, including the buffered ones
+    uint64_t position() const {
+        return written_ + buffer_.size();
+    }
+
+private:
+    void write_to_file(const char* data, size_t size);
+
+    static constexpr size_t BUFFER_SIZE = 1 << 20;
+
+    std::string path_;
+    std::FILE* file_;
+    fmt::memory_buffer buffer_;
+    uint64_t written_ = 0;
+};
+
+/// Writer for plain text output files. Floating point values are written with
+/// 8 significant digits.
+class TextWriter {
+public:
+    explicit TextWriter(std::string path): file_(std::move(path)) {}
+
+    /// Write a comment line, prefixed by `# `
+    void comment(const std::string& line) {
+        file_.write("# ", 2);
+        file_.write(line);
+        file_.write("\n", 1);
+    }
+
+    /// Write all the `values` on a single line, separated by spaces
+    template <typename... Args>
+    void row(const Args&... values) {
+        write_values(values...);
+        end_row();
+    }
+
+    /// Write a single `value` on the current line, separated from the
+    /// previous value by a space. Use `end_row` to terminate the line.
+    template <typename T>
+    void value(const T& value) {
+        if (!line_start_) {
+            file_.buffer().push_back(' ');
+        }
+        write_value(value);
+        line_start_ = false;
+    }
+
+    /// Terminate the current line
+    void end_row() {
+        file_.buffer().push_back('\n');
+        line_start_ = true;
+        file_.maybe_flush();
+    }
+
+    /// Write some raw `text` to the file
+    void write(const std::string& text) {
+        file_.write(text);
+    }
+
+    /// Flush all the data and close the file
+    void close() {
+        file_.close();
+    }
+
+private:
+    template <typename T, typename... Args>
+    void write_values(const T& value, const Args&... values) {
+        write_value(value);
+        file_.buffer().push_back(' ');
+        write_values(values...);
+    }
+
+    template <typename T>
+    void write_values(const T& value) {
+        write_value(value);
+    }
+
+    void write_value(double value) {
+        fmt::format_to(std::back_inserter(file_.buffer()), "{:.8g}", value);
+    }
+
+    void write_value(float value) {
+        write_value(static_cast<double>(value));
+    }
+
+    void write_value(unsigned long long value) {
+        auto formatted = fmt::format_int(value);
+        file_.buffer().append(formatted.data(), formatted.data() + formatted.size());
+    }
+
+    void write_value(unsigned long value) {
+        write_value(static_cast<unsigned long long>(value));
+    }
+
+    void write_value(unsigned value) {
+        write_value(static_cast<unsigned long long>(value));
+    }
+
+    void write_value(long long value) {
+        auto formatted = fmt::format_int(value);
+        file_.buffer().append(formatted.data(), formatted.data() + formatted.size());
+    }
+
+    void write_value(long value) {
+        write_value(static_cast<long long>(value));
+    }
+
+    void write_value(int value) {
+        write_value(static_cast<long long>(value));
+    }
+
+    void write_value(const std::string& value) {
+        file_.buffer().append(value.data(), value.data() + value.size());
+    }
+
+    BufferedFile file_;
+    bool line_start_ = true;
+};
+
+/// Writer for NumPy `.npz` archives, which can be loaded with `numpy.load`.
+/// Arrays are stored uncompressed, in C order. Each array is written to the
+/// file when it is added, and the archive is completed by `write`.
+class NpzWriter {
+public:
+    /// Create the archive at `path`, replacing any existing file
+    explicit NpzWriter(std::string path);
+
+    NpzWriter(NpzWriter&&) = default;
+    NpzWriter& operator=(NpzWriter&&) = default;
+
+    /// Add a `float64` array with the given `name` and `shape`
+    void add(std::string name, std::vector<size_t> shape, const std::vector<double>& data);
+    /// Add a `float32` array with the given `name` and `shape`
+    void add(std::string name, std::vector<size_t> shape, const std::vector<float>& data);
+    /// Add an `uint64` array with the given `name` and `shape`
+    void add(std::string name, std::vector<size_t> shape, const std::vector<uint64_t>& data);
+    /// Add a scalar unicode string array with the given `name`
+    void add(std::string name, const std::string& string);
+
+    /// Write the central directory of the archive and close the file
+    void write();
+
+private:
+    /// An entry already written to the file, which still needs a record in
+    /// the central directory
+    struct entry {
+        std::string filename;
+        uint32_t crc;
+        uint64_t size;
+        uint64_t offset;
+    };
+
+    void add_raw(const std::string& name, const std::string& descr, const std::vector<size_t>& shape, const char* data, size_t size);
+
+    std::unique_ptr<BufferedFile> file_;
+    std::vector<entry> entries_;
+};
+
+/// Results of an analysis, written either as text or as a NumPy archive.
+///
+/// The results are made of comments (written at the top of text files, and as
+/// the `metadata` string in NumPy archives), columns of the same length
+/// (written one row per line in text files), and 2D grids with their two axes
+/// (written as `first second value` lines in text files).
+class ResultWriter {
+public:
+    ResultWriter(std::string path, OutputFormat format): path_(std::move(path)), format_(format) {}
+
+    /// Add a comment line
+    void comment(std::string line) {
+        comments_.emplace_back(std::move(line));
+    }
+
+    /// Add a column of floating point values with the given `name`
+    void column(std::string name, std::vector<double> values);
+    /// Add a column of integer values with the given `name`
+    void column(std::string name, std::vector<uint64_t> values);
+
+    /// Add a 2D grid of `values` named `name`, using `first` and `second` as
+    /// the coordinates along the two axis of the grid. The `values` are stored
+    /// in row-major order, with `first.size()` rows.
+    void grid(std::string name,
+              std::string first_name, std::vector<double> first,
+              std::string second_name, std::vector<double> second,
+              std::vector<double> values);
+
+    /// Write all the results to the file
+    void write();
+
+private:
+    struct column_data {
+        std::string name;
+        std::vector<double> values;
+        std::vector<uint64_t> integers;
+        bool is_integer;
+
+        size_t size() const {
+            return is_integer ? integers.size() : values.size();
+        }
+    };
+
+    struct grid_data {
+        std::string name;
+        std::string first_name;
+        std::vector<double> first;
+        std::string second_name;
+        std::vector<double> second;
+        std::vector<double> values;
+    };
+
+    void write_text();
+    void write_numpy();
+
+    std::string path_;
+    OutputFormat format_;
+    std::vector<std::string> comments_;
+    std::vector<column_data> columns_;
+    std::vector<grid_data> grids_;
+};
+
+#endif
@@ -0,0 +1,44 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include "Parallel.hpp"
+#include "Errors.hpp"
+#include "utils.hpp"
+
+size_t default_threads() {
+    auto threads = std::thread::hardware_concurrency();
+    if (threads == 0) {
+        // the value is not computable or well defined
+        return 1;
+    }
+    return threads;
+}
+
+size_t parse_threads(const std::string& string) {
+    auto threads = string2long(string);
+    if (threads <= 0) {
+        throw CFilesError("number of threads must be positive, not " + string);
+    }
+    return static_cast<size_t>(threads);
+}
+
+std::vector<block_range> split_blocks(size_t size, size_t nblocks) {
+    auto blocks = std::vector<block_range>();
+    if (size == 0) {
+        return blocks;
+    }
+
+    nblocks = std::max<size_t>(1, std::min(nblocks, size));
+    auto block_size = size / nblocks;
+    auto remainder = size % nblocks;
+
+    size_t begin = 0;
+    for (size_t i=0; i<nblocks; i++) {
+        // spread the remainder over the first blocks
+        auto end = begin + block_size + (i < remainder ? 1 : 0);
+        blocks.push_back({begin, end});
+        begin = end;
+    }
+
+    return blocks;
+}
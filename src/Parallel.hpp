@@ -0,0 +1,93 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_PARALLEL_HPP
+#define CFILES_PARALLEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// A contiguous block of indexes, going from `begin` to `end` (excluded)
+struct block_range {
+    size_t begin;
+    size_t end;
+
+    size_t size() const {
+        return end - begin;
+    }
+};
+
+/// Get the number of threads to use when the user did not specify one. This
+/// is the number of hardware threads available on this machine.
+size_t default_threads();
+
+/// Parse the value of a `--threads` option
+size_t parse_threads(const std::string& string);
+
+/// Split the `[0, size)` range in at most `nblocks` contiguous blocks of
+/// (almost) equal size. Empty blocks are never returned.
+std::vector<block_range> split_blocks(size_t size, size_t nblocks);
+
+/// Call `function(i)` for all `i` in `[0, n)`, using up to `nthreads` threads.
+/// Tasks are distributed dynamically to the threads, and there is no guarantee
+/// on the order in which they are executed. If `function` throws, the first
+/// exception is re-thrown in the calling thread once all the threads finished,
+/// and the remaining tasks are not started.
+template <typename Function>
+void parallel_for(size_t n, size_t nthreads, Function function) {
+    if (nthreads == 0) {
+        nthreads = default_threads();
+    }
+    nthreads = std::min(nthreads, n);
+
+    if (nthreads <= 1) {
+        for (size_t i=0; i<n; i++) {
+            function(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto worker = [&]() {
+        while (!failed) {
+            auto i = next++;
+            if (i >= n) {
+                return;
+            }
+            try {
+                function(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                failed = true;
+            }
+        }
+    };
+
+    auto threads = std::vector<std::thread>();
+    threads.reserve(nthreads - 1);
+    for (size_t i=1; i<nthreads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread: threads) {
+        thread.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+#endif
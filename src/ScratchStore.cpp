@@ -0,0 +1,137 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "ScratchStore.hpp"
+#include "Errors.hpp"
+
+/// Size in bytes of the tiles buffered by `ScratchStore::Writer`
+static const size_t TILE_BYTES = 4 * 1024 * 1024;
+/// Minimal number of steps in a tile, so that flushing a tile writes at least
+/// a full cache line for each series
+static const size_t MIN_TILE_STEPS = 16;
+
+#ifndef _WIN32
+/// Create a new temporary file in `directory` with the given `size` in bytes,
+/// and map it in memory
+static float* map_temporary_file(const std::string& directory, size_t size) {
+    auto path = directory + "/cfiles-scratch-XXXXXX";
+    auto fd = mkstemp(&path[0]);
+    if (fd == -1) {
+        throw CFilesError(
+            "could not create a temporary file in '" + directory + "': " + std::strerror(errno)
+        );
+    }
+    // remove the file right away, it will be deleted by the system when the
+    // mapping is closed, even if cfiles is killed
+    unlink(path.c_str());
+
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        auto message = std::string(std::strerror(errno));
+        close(fd);
+        throw CFilesError("could not allocate a temporary file in '" + directory + "': " + message);
+    }
+
+    auto data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    auto message = std::string(std::strerror(errno));
+    // the mapping stays valid after closing the file descriptor
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw CFilesError("could not map a temporary file in memory: " + message);
+    }
+    return static_cast<float*>(data);
+}
+
+ScratchStore::ScratchStore(size_t nseries, size_t length, const std::string& directory):
+    nseries_(nseries), length_(length), data_(nullptr), size_(nseries * length * sizeof(float))
+{
+    if (size_ == 0) {
+        return;
+    }
+
+    if (directory.empty()) {
+        auto data = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (data == MAP_FAILED) {
+            throw CFilesError("could not allocate memory for the time series: " + std::string(std::strerror(errno)));
+        }
+        data_ = static_cast<float*>(data);
+    } else {
+        data_ = map_temporary_file(directory, size_);
+    }
+}
+
+ScratchStore::~ScratchStore() {
+    if (data_ != nullptr) {
+        munmap(data_, size_);
+    }
+}
+#else
+ScratchStore::ScratchStore(size_t nseries, size_t length, const std::string& directory):
+    nseries_(nseries), length_(length), data_(nullptr), size_(nseries * length * sizeof(float))
+{
+    if (!directory.empty()) {
+        throw CFilesError("temporary scratch files are not supported on Windows");
+    }
+    if (size_ != 0) {
+        data_ = new float[nseries * length]();
+    }
+}
+
+ScratchStore::~ScratchStore() {
+    delete[] data_;
+}
+#endif
+
+ScratchStore::ScratchStore(ScratchStore&& other):
+    nseries_(0), length_(0), data_(nullptr), size_(0)
+{
+    *this = std::move(other);
+}
+
+ScratchStore& ScratchStore::operator=(ScratchStore&& other) {
+    std::swap(nseries_, other.nseries_);
+    std::swap(length_, other.length_);
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    return *this;
+}
+
+ScratchStore::Writer::Writer(ScratchStore& store, size_t first):
+    store_(store), tile_(), tile_steps_(1), first_(first), count_(0)
+{
+    auto step_bytes = std::max<size_t>(store_.nseries() * sizeof(float), 1);
+    tile_steps_ = std::max<size_t>(TILE_BYTES / step_bytes, MIN_TILE_STEPS);
+    tile_steps_ = std::max<size_t>(std::min(tile_steps_, store_.length()), 1);
+    tile_.resize(tile_steps_ * store_.nseries());
+}
+
+float* ScratchStore::Writer::next() {
+    if (count_ == tile_steps_) {
+        flush();
+    }
+    assert(first_ + count_ < store_.length());
+    auto values = tile_.data() + count_ * store_.nseries();
+    count_ += 1;
+    return values;
+}
+
+void ScratchStore::Writer::flush() {
+    auto nseries = store_.nseries();
+    for (size_t serie=0; serie<nseries; serie++) {
+        auto output = store_.serie(serie) + first_;
+        for (size_t step=0; step<count_; step++) {
+            output[step] = tile_[step * nseries + serie];
+        }
+    }
+    first_ += count_;
+    count_ = 0;
+}
@@ -0,0 +1,102 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_SCRATCH_STORE_HPP
+#define CFILES_SCRATCH_STORE_HPP
+
+#include <string>
+#include <vector>
+
+/// Storage for `nseries` time series of `length` float values, used to keep
+/// per-atom data for all the steps of a trajectory before computing time
+/// correlations.
+///
+/// The series are stored one after the other (all the steps of the first
+/// series, then all the steps of the second series, ...) in a memory mapping.
+/// The mapping is either anonymous, or backed by a temporary file in a given
+/// directory, which allows to store more data than the available memory.
+///
+/// The values are produced one step at the time when reading the trajectory,
+/// but read one series at the time when computing correlations. Writing
+/// directly one step would touch one memory page per series, so the values
+/// are written through a `Writer`, which buffers a tile of steps and
+/// transposes it into the store.
+class ScratchStore {
+public:
+    /// Create a new store for `nseries` series of `length` values, all
+    /// initialized to zero. If `directory` is not empty, the data is stored in
+    /// a temporary file inside this directory, which is removed when the
+    /// store is destroyed.
+    ScratchStore(size_t nseries, size_t length, const std::string& directory = "");
+    ~ScratchStore();
+
+    ScratchStore(const ScratchStore&) = delete;
+    ScratchStore& operator=(const ScratchStore&) = delete;
+    ScratchStore(ScratchStore&& other);
+    ScratchStore& operator=(ScratchStore&& other);
+
+    /// Get the number of series in this store
+    size_t nseries() const {
+        return nseries_;
+    }
+
+    /// Get the number of values in each series
+    size_t length() const {
+        return length_;
+    }
+
+    /// Get the values of the series at index `i`
+    float* serie(size_t i) {
+        return data_ + i * length_;
+    }
+
+    /// Get the values of the series at index `i`
+    const float* serie(size_t i) const {
+        return data_ + i * length_;
+    }
+
+    /// Write values for consecutive steps of all the series in a store.
+    /// Multiple writers can be used at the same time from different threads,
+    /// as long as they write to different steps.
+    class Writer {
+    public:
+        /// Create a writer for `store`, starting at step `first`
+        Writer(ScratchStore& store, size_t first);
+        /// The destructor does not flush, `flush` must be called explicitly
+        ~Writer() = default;
+
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+        Writer(Writer&&) = default;
+        Writer& operator=(Writer&&) = delete;
+
+        /// Get memory for the values of all the series at the next step.
+        /// The returned pointer is only valid until the next call to `next`
+        /// or `flush`, and the values must be set before these calls.
+        float* next();
+
+        /// Write the buffered steps to the store
+        void flush();
+
+    private:
+        ScratchStore& store_;
+        /// Buffered values, indexed by `step * nseries + serie`
+        std::vector<float> tile_;
+        /// Number of steps in a full tile
+        size_t tile_steps_;
+        /// First step in the current tile
+        size_t first_;
+        /// Number of steps in the current tile
+        size_t count_;
+    };
+
+private:
+    size_t nseries_;
+    size_t length_;
+    /// Start of the memory mapping
+    float* data_;
+    /// Size of the memory mapping in bytes
+    size_t size_;
+};
+
+#endif
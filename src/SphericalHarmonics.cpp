@@ -0,0 +1,79 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <cmath>
+
+#include "SphericalHarmonics.hpp"
+
+using namespace chemfiles;
+
+SphericalHarmonics::SphericalHarmonics(size_t l): l_(l), normalization_(l + 1) {
+    // sqrt((l - m)! / (l + m)!), times sqrt(2) for m > 0
+    for (size_t m=0; m<=l; m++) {
+        double ratio = 1.0;
+        for (size_t k=l-m+1; k<=l+m; k++) {
+            ratio /= static_cast<double>(k);
+        }
+        normalization_[m] = std::sqrt(m == 0 ? ratio : 2 * ratio);
+    }
+}
+
+double SphericalHarmonics::legendre(size_t m, double z, double diagonal) const {
+    // recurrence in l starting from P_m^m
+    double previous = 0.0;
+    double current = diagonal;
+    for (size_t l=m+1; l<=l_; l++) {
+        auto next = (static_cast<double>(2 * l - 1) * z * current - static_cast<double>(l + m - 1) * previous) / static_cast<double>(l - m);
+        previous = current;
+        current = next;
+    }
+    return current;
+}
+
+void SphericalHarmonics::compute(const Vector3D& u, double* values) const {
+    auto z = u[2];
+    // real and imaginary part of (x + i y)^m, which is sin(θ)^m exp(i m φ)
+    double real = 1.0;
+    double imaginary = 0.0;
+    // associated Legendre polynomial P_m^m divided by sin(θ)^m, (2m - 1)!!
+    double diagonal = 1.0;
+    for (size_t m=0; m<=l_; m++) {
+        if (m != 0) {
+            auto new_real = real * u[0] - imaginary * u[1];
+            imaginary = real * u[1] + imaginary * u[0];
+            real = new_real;
+            diagonal *= static_cast<double>(2 * m - 1);
+        }
+
+        auto value = normalization_[m] * legendre(m, z, diagonal);
+        if (m == 0) {
+            values[0] = value;
+        } else {
+            values[2 * m - 1] = value * real;
+            values[2 * m] = value * imaginary;
+        }
+    }
+}
+
+double SphericalHarmonics::value(const Vector3D& u, size_t index) const {
+    auto m = (index + 1) / 2;
+    // (x + i y)^m and (2m - 1)!!, as in `compute`
+    double real = 1.0;
+    double imaginary = 0.0;
+    double diagonal = 1.0;
+    for (size_t k=1; k<=m; k++) {
+        auto new_real = real * u[0] - imaginary * u[1];
+        imaginary = real * u[1] + imaginary * u[0];
+        real = new_real;
+        diagonal *= static_cast<double>(2 * k - 1);
+    }
+
+    auto value = normalization_[m] * legendre(m, u[2], diagonal);
+    if (m == 0) {
+        return value;
+    } else if (index % 2 == 1) {
+        return value * real;
+    } else {
+        return value * imaginary;
+    }
+}
@@ -0,0 +1,57 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_SPHERICAL_HARMONICS_HPP
+#define CFILES_SPHERICAL_HARMONICS_HPP
+
+#include <vector>
+
+#include <chemfiles.hpp>
+
+/// Real spherical harmonics of a given degree `l`, evaluated on unit vectors.
+///
+/// The `2l + 1` harmonics are normalized such that the sum over all of them
+/// of `Y(u) * Y(v)` is the Legendre polynomial `P_l(u ⋅ v)` (addition
+/// theorem). The correlation of `P_l(u(0) ⋅ u(t))` can then be computed as the
+/// sum of the autocorrelations of the `2l + 1` harmonics.
+///
+/// The harmonics are computed as polynomials of the vector components, using
+/// the recurrence relations of the associated Legendre polynomials, without
+/// any trigonometric function.
+class SphericalHarmonics {
+public:
+    /// Create the spherical harmonics of degree `l`
+    explicit SphericalHarmonics(size_t l);
+
+    /// Get the degree of the harmonics
+    size_t degree() const {
+        return l_;
+    }
+
+    /// Get the number of harmonics, `2l + 1`
+    size_t size() const {
+        return 2 * l_ + 1;
+    }
+
+    /// Compute all the harmonics for the unit vector `u`, and store them in
+    /// `values`, which must have room for `size()` values. The harmonic of
+    /// order `m = 0` comes first, followed by the cosine and sine parts for
+    /// each order `m > 0`.
+    void compute(const chemfiles::Vector3D& u, double* values) const;
+
+    /// Compute only the harmonic at `index` for the unit vector `u`, using
+    /// the same order as `compute`. This costs `O(l)` operations instead of
+    /// `O(l^2)` for all the harmonics.
+    double value(const chemfiles::Vector3D& u, size_t index) const;
+
+private:
+    /// Associated Legendre polynomial `P_l^m(z)` divided by `sin(θ)^m`,
+    /// starting the recurrence in `l` from `diagonal = P_m^m / sin(θ)^m`
+    double legendre(size_t m, double z, double diagonal) const;
+
+    size_t l_;
+    /// Normalization of the harmonics of order `m`
+    std::vector<double> normalization_;
+};
+
+#endif
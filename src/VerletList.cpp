@@ -0,0 +1,100 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <algorithm>
+#include <cassert>
+
+#include "VerletList.hpp"
+#include "CellList.hpp"
+
+using namespace chemfiles;
+
+VerletList::VerletList(double cutoff, double skin):
+    cutoff_(cutoff),
+    skin_(skin),
+    cell_(nullptr),
+    positions_(nullptr),
+    single_(true),
+    matrix_(Matrix3D::zero()),
+    builds_(0)
+{
+    assert(cutoff > 0);
+    assert(skin >= 0);
+}
+
+void VerletList::update(const UnitCell& cell, const std::vector<Vector3D>& positions, const std::vector<size_t>& atoms) {
+    cell_ = &cell;
+    positions_ = &positions;
+    if (needs_rebuild(atoms, {}, true)) {
+        build(atoms, {}, true);
+    }
+}
+
+void VerletList::update(const UnitCell& cell, const std::vector<Vector3D>& positions, const std::vector<size_t>& first, const std::vector<size_t>& second) {
+    cell_ = &cell;
+    positions_ = &positions;
+    if (needs_rebuild(first, second, false)) {
+        build(first, second, false);
+    }
+}
+
+bool VerletList::needs_rebuild(const std::vector<size_t>& first, const std::vector<size_t>& second, bool single) const {
+    if (builds_ == 0 || single != single_ || first != first_ || second != second_) {
+        return true;
+    }
+
+    auto matrix = cell_->matrix();
+    for (size_t i=0; i<3; i++) {
+        for (size_t j=0; j<3; j++) {
+            if (matrix[i][j] != matrix_[i][j]) {
+                return true;
+            }
+        }
+    }
+
+    // Rebuild when any atom moved by more than half the skin, since two atoms
+    // moving toward each other could then get closer than the cutoff
+    auto& positions = *positions_;
+    auto max_displacement2 = skin_ * skin_ / 4;
+    size_t index = 0;
+    for (auto atoms: {&first_, &second_}) {
+        for (auto i: *atoms) {
+            auto displacement = cell_->wrap(positions[i] - reference_[index]);
+            if (dot(displacement, displacement) > max_displacement2) {
+                return true;
+            }
+            index++;
+        }
+    }
+    return false;
+}
+
+void VerletList::build(const std::vector<size_t>& first, const std::vector<size_t>& second, bool single) {
+    single_ = single;
+    first_ = first;
+    second_ = second;
+    matrix_ = cell_->matrix();
+
+    auto& positions = *positions_;
+    reference_.clear();
+    for (auto i: first_) {
+        reference_.push_back(positions[i]);
+    }
+    for (auto i: second_) {
+        reference_.push_back(positions[i]);
+    }
+
+    pairs_.clear();
+    auto neighbors = CellList(*cell_, positions, cutoff_ + skin_);
+    auto add_pair = [this](size_t i, size_t j, double) {
+        pairs_.emplace_back(i, j);
+    };
+    if (single_) {
+        neighbors.foreach_pair(neighbors.sort(first_), add_pair);
+    } else {
+        neighbors.foreach_pair(neighbors.sort(first_), neighbors.sort(second_), add_pair);
+    }
+    // visit the pairs in memory order when computing distances
+    std::sort(pairs_.begin(), pairs_.end());
+    builds_ += 1;
+}
@@ -0,0 +1,81 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_VERLET_LIST_HPP
+#define CFILES_VERLET_LIST_HPP
+
+#include <utility>
+#include <vector>
+
+#include <chemfiles.hpp>
+
+/// Neighbor list reused across consecutive frames of a trajectory.
+///
+/// The list stores all the pairs closer than `cutoff + skin`, found with a
+/// `CellList`. As long as no atom moved by more than `skin / 2` since the list
+/// was built, all the pairs closer than `cutoff` are still in the list, and
+/// only the distances of the stored pairs need to be computed for a new frame.
+/// The list is also rebuilt when the atoms or the unit cell change.
+class VerletList {
+public:
+    /// Create a new list for pairs closer than `cutoff`, with the given `skin`
+    VerletList(double cutoff, double skin);
+
+    /// Update the list with the `positions` of a new frame, for all the pairs
+    /// of different atoms in `atoms`. The cell and positions must stay alive
+    /// until the next call to `update`.
+    void update(const chemfiles::UnitCell& cell, const std::vector<chemfiles::Vector3D>& positions, const std::vector<size_t>& atoms);
+
+    /// Update the list with the `positions` of a new frame, for all the pairs
+    /// of different atoms with `i` in `first` and `j` in `second`. The cell
+    /// and positions must stay alive until the next call to `update`.
+    void update(const chemfiles::UnitCell& cell, const std::vector<chemfiles::Vector3D>& positions, const std::vector<size_t>& first, const std::vector<size_t>& second);
+
+    /// Call `function(i, j, distance)` for all pairs closer than the cutoff
+    /// in the last frame given to `update`. With a single set of atoms, each
+    /// pair is visited once. With two sets of atoms, the pairs of atoms
+    /// present in both sets are visited in both orders.
+    template <typename Function>
+    void foreach_pair(Function function) const {
+        auto& positions = *positions_;
+        for (auto& pair: pairs_) {
+            auto distance = cell_->wrap(positions[pair.second] - positions[pair.first]).norm();
+            if (distance < cutoff_) {
+                function(pair.first, pair.second, distance);
+            }
+        }
+    }
+
+    /// Get the number of times the list was built
+    size_t builds() const {
+        return builds_;
+    }
+
+private:
+    /// Check if the list must be rebuilt for a new frame
+    bool needs_rebuild(const std::vector<size_t>& first, const std::vector<size_t>& second, bool single) const;
+    /// Build the list from scratch
+    void build(const std::vector<size_t>& first, const std::vector<size_t>& second, bool single);
+
+    double cutoff_;
+    double skin_;
+    /// Cell and positions of the last frame
+    const chemfiles::UnitCell* cell_;
+    const std::vector<chemfiles::Vector3D>* positions_;
+    /// Was the list built for a single set of atoms?
+    bool single_;
+    /// Sets of atoms used to build the list
+    std::vector<size_t> first_;
+    std::vector<size_t> second_;
+    /// Unit cell matrix when the list was built
+    chemfiles::Matrix3D matrix_;
+    /// Positions of the atoms in `first_` and then `second_` when the list
+    /// was built
+    std::vector<chemfiles::Vector3D> reference_;
+    /// Pairs closer than `cutoff + skin` when the list was built
+    std::vector<std::pair<size_t, size_t>> pairs_;
+    /// Number of times the list was built
+    size_t builds_;
+};
+
+#endif
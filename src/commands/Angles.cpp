@@ -3,7 +3,6 @@
 
 #include <docopt/docopt.h>
 #include <algorithm>
-#include <fstream>
 
 #include "Angles.hpp"
 #include "Errors.hpp"
@@ -26,7 +25,7 @@ For more information about chemfiles selection language, please see
 http://chemfiles.github.io/chemfiles/latest/selections.html
 
 Usage:
-  cfiles angles [options] <trajectory>
+  cfiles angles [options] <trajectory> [--selection=<sel>...]
   cfiles angles (-h | --help)
 
 Examples:
@@ -35,15 +34,20 @@ Examples:
   cfiles angles methane.xyz --cell 15:15:25 --guess-bonds --points=150
   cfiles angles result.xtc --topology=initial.mol --topology-format=PDB
   cfiles angles simulation.pdb --steps=:1000:5 -o partial-angles.dat
+  cfiles angles water.tng -s "angles: all" -s "dihedrals: all"
 
 Options:
   -h --help                     show this help
   -o <file>, --output=<file>    write result to <file>. This default to the
                                 trajectory file name with the `.angles.dat`
-                                extension.
+                                extension, or `.angles.npz` for NumPy output.
   -s <sel>, --selection=<sel>   selection to use for the atoms. This must be a
                                 selection of size 3 (for angles) or 4 (for
-                                dihedral angles) [default: angles: all]
+                                dihedral angles). This option can be repeated
+                                to compute multiple distributions from a single
+                                pass over the trajectory, the index of the
+                                selection is then added to the output file
+                                name. The default is "angles: all".
   -p <n>, --points=<n>          number of points in the histogram [default: 200])";
 
 
@@ -51,7 +55,7 @@ std::string Angles::description() const {
     return "compute angles and dihedral angles distribution";
 }
 
-Averager Angles::setup(int argc, const char* argv[]) {
+size_t Angles::setup(int argc, const char* argv[]) {
     auto options = command_header("angles", Angles().description());
     options += "Guillaume Fraux <guillaume@fraux.fr>\n\n";
     options += std::string(OPTIONS) + AveCommand::AVERAGE_OPTIONS;
@@ -62,58 +66,73 @@ Averager Angles::setup(int argc, const char* argv[]) {
     if (args["--output"]) {
         options_.outfile = args["--output"].asString();
     } else {
-        options_.outfile = AveCommand::options().trajectory + ".angles.dat";
+        auto extension = output_extension(AveCommand::options().output_format);
+        options_.outfile = AveCommand::options().trajectory + ".angles" + extension;
     }
 
     options_.npoints = string2long(args["--points"].asString());
-    options_.selection = args["--selection"].asString();
+    options_.selections = args["--selection"].asStringList();
+    if (options_.selections.empty()) {
+        options_.selections.emplace_back("angles: all");
+    }
 
-    selection_ = Selection(options_.selection);
-    if (selection_.size() == 3) {
-        return Averager(options_.npoints, 0, PI);
-    } else if (selection_.size() == 4) {
-        return Averager(options_.npoints, -PI, PI);
-    } else {
-        throw CFilesError("Can not use a selection with less than three atoms in angle distribution.");
+    for (auto& string: options_.selections) {
+        auto selection = Selection(string);
+        if (selection.size() == 3) {
+            histograms_.emplace_back(options_.npoints, 0, PI);
+        } else if (selection.size() == 4) {
+            histograms_.emplace_back(options_.npoints, -PI, PI);
+        } else {
+            throw CFilesError("Can not use a selection with less than three atoms in angle distribution.");
+        }
+        selections_.emplace_back(std::move(selection));
+        no_angles_.emplace_back(new WarningSite("No angle corresponding to '{}' found."));
     }
+    return selections_.size();
 }
 
-void Angles::finish(const Histogram& histogram) {
+void Angles::finish(size_t selection) {
+    auto& histogram = histograms_[selection];
+    check_out_of_bounds(histogram);
+    histogram.average();
+
     double sum = 0;
     for (size_t i=0; i<histogram.size(); i++) {
-        sum += rad2deg(histogram.first().width) * histogram[i];
+        sum += rad2deg(histogram.first().width) * histogram.averaged(i);
     }
 
-    std::ofstream outfile(options_.outfile, std::ios::out);
-    if(outfile.is_open()) {
-        outfile << "# Angles distribution in trajectory " << AveCommand::options().trajectory << std::endl;
-        outfile << "# Selection: " << options_.selection << std::endl;
-
-        for (size_t i=0; i<histogram.size(); i++) {
-            outfile << rad2deg(histogram.first().coord(i)) << "  " << histogram[i] / sum << "\n";
-        }
-    } else {
-        throw CFilesError("Could not open the '" + options_.outfile + "' file.");
+    auto angles = std::vector<double>(histogram.size());
+    auto distribution = std::vector<double>(histogram.size());
+    for (size_t i=0; i<histogram.size(); i++) {
+        angles[i] = rad2deg(histogram.first().coord(i));
+        distribution[i] = histogram.averaged(i) / sum;
     }
+
+    auto output = ResultWriter(output_path(options_.outfile, selection), AveCommand::options().output_format);
+    output.comment("Angles distribution in trajectory " + AveCommand::options().trajectory);
+    output.comment("Selection: " + options_.selections[selection]);
+    output.column("angle", std::move(angles));
+    output.column("distribution", std::move(distribution));
+    output.write();
 }
 
-void Angles::accumulate(const Frame& frame, Histogram& histogram) {
-    auto matched = selection_.evaluate(frame);
+void Angles::accumulate(const Frame& frame, size_t selection) {
+    auto matched = selections_[selection].evaluate(frame);
     if (matched.empty()) {
-        warn_once(
-            "No angle corresponding to '" + selection_.string() + "' found."
-        );
+        no_angles_[selection]->emit(selections_[selection].string());
     }
 
+    angles_.clear();
     for (auto match: matched) {
         assert(match.size() == 3 || match.size() == 4);
 
         if (match.size() == 3) {
-            auto theta = frame.angle(match[0], match[1], match[2]);
-            histogram.insert(theta);
+            angles_.push_back(frame.angle(match[0], match[1], match[2]));
         } else if (match.size() == 4) {
-            auto phi = frame.dihedral(match[0], match[1], match[2], match[3]);
-            histogram.insert(phi);
+            angles_.push_back(frame.dihedral(match[0], match[1], match[2], match[3]));
         }
     }
+    auto& histogram = histograms_[selection];
+    histogram.insert_many(angles_);
+    histogram.step();
 }
@@ -4,32 +4,41 @@
 #ifndef CFILES_ANGLES_HPP
 #define CFILES_ANGLES_HPP
 
+#include <memory>
+
 #include "AveCommand.hpp"
 #include "utils.hpp"
+#include "warnings.hpp"
 
 class Angles final: public AveCommand {
 public:
     struct Options {
         /// Output data file
         std::string outfile;
-        /// Selection for the atoms in radial distribution
-        std::string selection;
+        /// Selections for the atoms in the angles
+        std::vector<std::string> selections;
         /// Number of points in the histogram
         size_t npoints;
     };
 
-    Angles(): selection_("angles: all") {}
+    Angles() {}
     std::string description() const override;
 
-    Averager setup(int argc, const char* argv[]) override;
-    void accumulate(const chemfiles::Frame& frame, Histogram& histogram) override;
-    void finish(const Histogram& histogram) override;
+    size_t setup(int argc, const char* argv[]) override;
+    void accumulate(const chemfiles::Frame& frame, size_t selection) override;
+    void finish(size_t selection) override;
 
 private:
     /// Options for this instance of RDF
     Options options_;
-    /// Selection for the atoms in the pair
-    chemfiles::Selection selection_;
+    /// Selections for the atoms in the angles
+    std::vector<chemfiles::Selection> selections_;
+    /// Angles distribution for each selection
+    std::vector<Averager<1, uint32_t>> histograms_;
+    /// Per-frame buffer for the angles, inserted in the histogram all at once
+    std::vector<double> angles_;
+    /// Warning emitted when no angle matches each selection
+    std::vector<std::unique_ptr<WarningSite>> no_angles_;
 };
 
 #endif
@@ -26,11 +26,15 @@ const std::string AveCommand::AVERAGE_OPTIONS = R"(
                                 <start> to <end> (excluded) by steps of
                                 <stride>. The default values are 0 for <start>,
                                 the number of steps for <end> and 1 for
-                                <stride>.)";
+                                <stride>.
+  --output-format=<fmt>         format of the output file, either `text` for a
+                                plain text file or `npy` for a NumPy `.npz`
+                                archive [default: text])";
 
 void AveCommand::parse_options(const std::map<std::string, docopt::value>& args) {
     options_.trajectory = args.at("<trajectory>").asString();
     options_.guess_bonds = args.at("--guess-bonds").asBool();
+    options_.output_format = parse_output_format(args.at("--output-format").asString());
 
     if (args.at("--steps")) {
         options_.steps = steps_range::parse(args.at("--steps").asString());
@@ -61,7 +65,7 @@ void AveCommand::parse_options(const std::map<std::string, docopt::value>& args)
 }
 
 int AveCommand::run(int argc, const char* argv[]) {
-    histogram_ = setup(argc, argv);
+    nselections_ = setup(argc, argv);
 
     auto file = Trajectory(options_.trajectory);
     if (options_.custom_cell) {
@@ -82,12 +86,14 @@ int AveCommand::run(int argc, const char* argv[]) {
             frame.guess_bonds();
         }
         if (!options_.custom_cell && frame.cell().shape() == UnitCell::INFINITE) {
-            warn_once(
+            static WarningSite INFINITE_CELL(
                 "this frame has an infinite unit cell, it's not what you want most of the time"
             );
+            INFINITE_CELL.emit();
+        }
+        for (size_t i=0; i<nselections_; i++) {
+            accumulate(frame, i);
         }
-        accumulate(frame, histogram_);
-        histogram_.step();
         steps_done++;
     }
 
@@ -97,8 +103,12 @@ int AveCommand::run(int argc, const char* argv[]) {
         );
     }
 
-    histogram_.average();
-
-    finish(histogram_);
+    for (size_t i=0; i<nselections_; i++) {
+        finish(i);
+    }
     return 0;
 }
+
+std::string AveCommand::output_path(const std::string& path, size_t selection) const {
+    return selection_output_path(path, selection, nselections_);
+}
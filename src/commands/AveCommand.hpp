@@ -9,6 +9,8 @@
 
 #include "Averager.hpp"
 #include "Command.hpp"
+#include "Output.hpp"
+#include "warnings.hpp"
 #include "utils.hpp"
 
 namespace docopt {
@@ -35,6 +37,8 @@ public:
         std::string topology_format = "";
         /// Should we try to guess the topology?
         bool guess_bonds = false;
+        /// Format to use for the output file
+        OutputFormat output_format = OutputFormat::Text;
     };
 
     /// A strinc containing Doctopt style options for all time-averaged commands.
@@ -44,25 +48,44 @@ public:
     virtual ~AveCommand() = default;
     int run(int argc, const char* argv[]) override final;
 
-    /// Setup the command and the histogram.
+    /// Setup the command and the histograms, returning the number of
+    /// selections to use. All the selections are evaluated on the same frames,
+    /// so the trajectory is only read once.
     /// This function MUST call `AverageCommand::parse_options`.
-    virtual Averager setup(int argc, const char* argv[]) = 0;
-    /// Add the data from a `frame` to the `histogram`
-    virtual void accumulate(const chemfiles::Frame& frame, Histogram& histogram) = 0;
-    /// Finish the run, and write any output
-    virtual void finish(const Histogram& histogram) = 0;
+    virtual size_t setup(int argc, const char* argv[]) = 0;
+    /// Add the data from a `frame` for the selection at index `selection` to
+    /// the corresponding averager, and call `step` on it.
+    virtual void accumulate(const chemfiles::Frame& frame, size_t selection) = 0;
+    /// Average the data for the selection at index `selection`, and write any
+    /// output
+    virtual void finish(size_t selection) = 0;
 
 protected:
     /// Get access to the options for this run
     const Options& options() const {return options_;}
     /// Parse the options from a doctop map/
     void parse_options(const std::map<std::string, docopt::value>& args);
+    /// Get the path of the output file for the selection at index `selection`.
+    /// When using multiple selections, the index of the selection is inserted
+    /// before the extension of `path`.
+    std::string output_path(const std::string& path, size_t selection) const;
+
+    /// Warn if some values where outside of the `histogram` boundaries
+    template <size_t N, typename T>
+    static void check_out_of_bounds(const Histogram<N, T>& histogram) {
+        if (histogram.out_of_bounds() != 0) {
+            warn(
+                std::to_string(histogram.out_of_bounds()) +
+                " values were outside of the histogram boundaries and have been ignored"
+            );
+        }
+    }
 
 private:
     /// Options
     Options options_;
-    /// Averaging histogram for the data
-    Averager histogram_;
+    /// Number of selections used in this run
+    size_t nselections_ = 0;
 };
 
 #endif
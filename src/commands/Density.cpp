@@ -2,11 +2,10 @@
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
 #include <docopt/docopt.h>
-#include <sstream>
-#include <fstream>
 
 #include "Density.hpp"
 #include "Errors.hpp"
+#include "Parallel.hpp"
 #include "utils.hpp"
 #include "warnings.hpp"
 
@@ -29,11 +28,18 @@ the same type are used (e.g. twice --axis option), the order will be the one the
 user gave. If the axis types are different (e.g. --axis and --radial), the
 --axis will be first. Two axis of type radial are forbidden.
 
+3D density maps can be computed with the --grid option instead of --axis and
+--radial. With --fractional, the grid covers the whole unit cell, starting at
+--origin. Otherwise, the grid covers the box going from <min> to <max> in the
+x, y and z directions, relative to --origin. The --max and --min options then
+accept up to three values. The output contains the average number of particles
+in each voxel, as a Gaussian cube or OpenDX file (see --grid-format).
+
 For more information about chemfiles selection language, please see
 http://chemfiles.org/chemfiles/latest/selections.html
 
 Usage:
-  cfiles density [options] <trajectory> [--axis=<axis>...] [--radial=<axis>...]
+  cfiles density [options] <trajectory> [--axis=<axis>...] [--radial=<axis>...] [--selection=<sel>...]
   cfiles density (-h | --help)
 
 Examples:
@@ -41,14 +47,22 @@ Examples:
   cfiles density in.pdb --selection="x > 3" --points=500
   cfiles density nt.pdb --radial=Z --max=3 --origin=0:0:2
   cfiles density nt.pdb --axis=Z --radial=Z --max=10:5 --origin=0:0:2
+  cfiles density ions.xyz --axis=Z -s "name Na" -s "name Cl"
+  cfiles density water.xyz --grid=100:100:50 --fractional -s "name O"
 
 Options:
   -h --help                     show this help
   -o <file>, --output=<file>    write result to <file>. This default to the
                                 trajectory file name with the `.density.dat`
-                                extension.
+                                extension, or `.density.npz` for NumPy output.
+                                3D grids use the `.density.cube` or
+                                `.density.dx` extension.
   -s <sel>, --selection=<sel>   selection to use for the particles. This must
-                                be a selection of size 1. [default: atoms: all]
+                                be a selection of size 1. This option can be
+                                repeated to compute multiple profiles from a
+                                single pass over the trajectory, the index of
+                                the selection is then added to the output file
+                                name. The default is "atoms: all".
   --axis=<axis>...              computes a linear density profile along <axis>.
                                 It should be either one of X, Y, or Z
                                 or a vector defining the axis (e.g. 1:1:1).
@@ -56,8 +70,20 @@ Options:
                                 distance to <axis>. It should be either one of
                                 X, Y , or Z; or a vector defining the axis
                                 (e.g. 1:1:1).
+  --grid=<n>                    computes a 3D density map on a grid with <n>
+                                points in each direction. <n> format is one of
+                                <nx:ny:nz> or <n>.
+  --grid-format=<fmt>           format of the file for 3D grids, either `cube`
+                                or `dx`. This is ignored for NumPy output.
+                                [default: cube]
+  --threads=<n>                 number of threads to use when computing 3D
+                                grids. Each thread uses its own copy of the
+                                grid, and fewer threads are used for very
+                                large grids. This default to the number of
+                                available cores.
   --origin=<coord>              coordinates for the origin of the axis (only
-                                relevant for radial profiles). [default: 0:0:0]
+                                relevant for radial profiles and 3D grids).
+                                [default: 0:0:0]
   --fractional                  use fractional coordinates instead of cartesian
                                 coordinates
   -p <n>, --points=<n>          number of points in the profile [default: 200]
@@ -65,7 +91,16 @@ Options:
   --min=<min>                   minimum distance in the profile. [default: 0]
                                 For radial profiles, <min> must be positive.)";
 
-Averager Density::setup(int argc, const char* argv[]) {
+/// Minimal number of atoms to bin in each thread for 3D grids
+static const size_t MIN_ATOMS_PER_THREAD = 10000;
+/// Memory budget (in bytes) for the private copies of a 3D grid used by the
+/// threads, assuming all the voxels are allocated
+static const size_t PRIVATE_GRIDS_MEMORY = 1024 * 1024 * 1024;
+
+/// Conversion factor from angstroms to bohrs, used in cube files
+static const double ANGSTROM_TO_BOHR = 1.0 / 0.52917721067;
+
+size_t Density::setup(int argc, const char* argv[]) {
     auto options = command_header("density", Density().description()) + "\n";
     options += "Laura Scalfi <laura.scalfi@ens.fr>\n\n";
     options += std::string(OPTIONS) + AveCommand::AVERAGE_OPTIONS;
@@ -73,16 +108,17 @@ Averager Density::setup(int argc, const char* argv[]) {
 
     AveCommand::parse_options(args);
 
-    options_.selection = args.at("--selection").asString();
-    selection_ = Selection(options_.selection);
-    if (selection_.size() != 1) {
-        throw CFilesError("Can not use a selection with size different than 1.");
+    options_.selections = args.at("--selection").asStringList();
+    if (options_.selections.empty()) {
+        options_.selections.emplace_back("atoms: all");
     }
-
-    if (args.at("--output")){
-        options_.outfile = args.at("--output").asString();
-    } else {
-        options_.outfile = AveCommand::options().trajectory + ".density.dat";
+    for (auto& string: options_.selections) {
+        auto selection = Selection(string);
+        if (selection.size() != 1) {
+            throw CFilesError("Can not use a selection with size different than 1.");
+        }
+        selections_.emplace_back(std::move(selection));
+        no_atoms_.emplace_back(new WarningSite("No matching atom for selection '{}' at step {}"));
     }
 
     if (args.at("--axis")) {
@@ -97,12 +133,58 @@ Averager Density::setup(int argc, const char* argv[]) {
         }
     }
 
+    if (args.at("--grid")) {
+        if (!axis_.empty()) {
+            throw CFilesError("Can not use --grid together with --axis or --radial");
+        }
+        auto splitted = split(args.at("--grid").asString(), ':');
+        if (splitted.size() == 1) {
+            options_.grid[0] = string2long(splitted[0]);
+            options_.grid[1] = string2long(splitted[0]);
+            options_.grid[2] = string2long(splitted[0]);
+        } else if (splitted.size() == 3) {
+            options_.grid[0] = string2long(splitted[0]);
+            options_.grid[1] = string2long(splitted[1]);
+            options_.grid[2] = string2long(splitted[2]);
+        } else {
+            throw CFilesError("Grid size should be <n> or <nx:ny:nz>");
+        }
+        if (options_.grid[0] == 0 or options_.grid[1] == 0 or options_.grid[2] == 0) {
+            throw CFilesError("Grid size should be positive");
+        }
+    }
+
+    auto grid_format = args.at("--grid-format").asString();
+    if (grid_format == "cube") {
+        options_.grid_format = GridFormat::Cube;
+    } else if (grid_format == "dx") {
+        options_.grid_format = GridFormat::DX;
+    } else {
+        throw CFilesError("Unknown grid format '" + grid_format + "', expected 'cube' or 'dx'");
+    }
+
+    if (args.at("--threads")) {
+        options_.threads = parse_threads(args.at("--threads").asString());
+    } else {
+        options_.threads = default_threads();
+    }
+
     size_t dimension = dimensionality();
 
-    if (dimension == 0 or dimension > 2) {
+    if (dimension == 0 or axis_.size() > 2) {
         throw CFilesError("No axis or too many axis were given");
     }
 
+    if (args.at("--output")){
+        options_.outfile = args.at("--output").asString();
+    } else {
+        auto extension = output_extension(AveCommand::options().output_format);
+        if (dimension == 3 && AveCommand::options().output_format == OutputFormat::Text) {
+            extension = options_.grid_format == GridFormat::Cube ? ".cube" : ".dx";
+        }
+        options_.outfile = AveCommand::options().trajectory + ".density" + extension;
+    }
+
     if (args.at("--points")) {
         auto splitted = split(args.at("--points").asString(), ':');
         if (splitted.size() == 1) {
@@ -135,12 +217,20 @@ Averager Density::setup(int argc, const char* argv[]) {
         if (splitted.size() == 1) {
             options_.max[0] = string2double(splitted[0]);
             options_.max[1] = string2double(splitted[0]);
+            options_.max[2] = string2double(splitted[0]);
         } else if (splitted.size() == 2) {
-            if (dimension < 2) {
+            if (dimension != 2) {
+                throw CFilesError("More --max options than axis");
+            }
+            options_.max[0] = string2double(splitted[0]);
+            options_.max[1] = string2double(splitted[1]);
+        } else if (splitted.size() == 3) {
+            if (dimension != 3) {
                 throw CFilesError("More --max options than axis");
             }
             options_.max[0] = string2double(splitted[0]);
             options_.max[1] = string2double(splitted[1]);
+            options_.max[2] = string2double(splitted[2]);
         } else {
             throw CFilesError("Too many arguments for --max option");
         }
@@ -151,12 +241,20 @@ Averager Density::setup(int argc, const char* argv[]) {
          if (splitted.size() == 1) {
              options_.min[0] = string2double(splitted[0]);
              options_.min[1] = string2double(splitted[0]);
+             options_.min[2] = string2double(splitted[0]);
          } else if (splitted.size() == 2) {
-             if (dimension < 2) {
+             if (dimension != 2) {
+                 throw CFilesError("More --min options than axis");
+             }
+             options_.min[0] = string2double(splitted[0]);
+             options_.min[1] = string2double(splitted[1]);
+         } else if (splitted.size() == 3) {
+             if (dimension != 3) {
                  throw CFilesError("More --min options than axis");
              }
              options_.min[0] = string2double(splitted[0]);
              options_.min[1] = string2double(splitted[1]);
+             options_.min[2] = string2double(splitted[2]);
          } else {
              throw CFilesError("Too many arguments for --min option");
          }
@@ -174,6 +272,21 @@ Averager Density::setup(int argc, const char* argv[]) {
         throw CFilesError("Min > Max for second dimension");
     }
 
+    if (dimension == 3) {
+        if (options_.min[2] > options_.max[2]) {
+            throw CFilesError("Min > Max for third dimension");
+        }
+
+        // The private grids are created when a frame has enough atoms for
+        // multiple threads, up to the memory budget
+        auto grid_memory = options_.grid[0] * options_.grid[1] * options_.grid[2] * sizeof(uint16_t);
+        max_grids_ = std::min(options_.threads, PRIVATE_GRIDS_MEMORY / std::max<size_t>(grid_memory, 1));
+        max_grids_ = std::max<size_t>(max_grids_, 1);
+        grids_ = std::vector<std::vector<ThreadGrid>>(selections_.size());
+        kernel_ = &Density::accumulate_3d;
+        return selections_.size();
+    }
+
     if (axis_[0].is_radial()) {
         if (options_.min[0] < 0) {
             throw CFilesError("Min value for radial axis should be positive");
@@ -184,97 +297,406 @@ Averager Density::setup(int argc, const char* argv[]) {
         }
     }
 
+    if (dimension == 2 && axis_[0].is_radial() && axis_[1].is_radial()) {
+        throw CFilesError("Can not use two radial axis");
+    }
+
+    // Select the kernel once for the whole run, depending on the types of the
+    // axis. The --axis are always before the --radial in `axis_`.
     if (dimension == 1) {
-        return Averager(options_.npoints[0], options_.min[0], options_.max[0]);
+        profiles_1d_ = std::vector<Averager<1, uint32_t>>(
+            selections_.size(),
+            Averager<1, uint32_t>(options_.npoints[0], options_.min[0], options_.max[0])
+        );
+        if (axis_[0].is_linear()) {
+            kernel_ = &Density::accumulate_1d<Axis::Linear>;
+        } else {
+            kernel_ = &Density::accumulate_1d<Axis::Radial>;
+        }
     } else {
         assert(dimension == 2);
-        return Averager(options_.npoints[0], options_.min[0], options_.max[0], options_.npoints[1], options_.min[1], options_.max[1]);
+        profiles_2d_ = std::vector<Averager<2, uint32_t>>(
+            selections_.size(),
+            Averager<2, uint32_t>(options_.npoints[0], options_.min[0], options_.max[0], options_.npoints[1], options_.min[1], options_.max[1])
+        );
+        assert(axis_[0].is_linear());
+        if (axis_[1].is_linear()) {
+            kernel_ = &Density::accumulate_2d<Axis::Linear, Axis::Linear>;
+        } else {
+            kernel_ = &Density::accumulate_2d<Axis::Linear, Axis::Radial>;
+        }
     }
+
+    return selections_.size();
 }
 
 std::string Density::description() const {
     return "compute density profiles";
 }
 
-void Density::accumulate(const chemfiles::Frame& frame, Histogram& profile) {
-    auto positions = frame.positions();
-    auto cell = frame.cell();
+/// Project the `position` of an atom on an axis of the given `Type`
+template <Axis::Type Type>
+static double project(const Axis& axis, const Matrix3D& scaling, const UnitCell& cell, const Vector3D& position, const Vector3D& origin);
+
+template <>
+double project<Axis::Linear>(const Axis& axis, const Matrix3D& scaling, const UnitCell& cell, const Vector3D& position, const Vector3D&) {
+    return dot(axis.vector(), scaling * cell.wrap(position));
+}
 
-    assert(selection_.size() == 1);
-    auto selected = selection_.list(frame);
+template <>
+double project<Axis::Radial>(const Axis& axis, const Matrix3D& scaling, const UnitCell& cell, const Vector3D& position, const Vector3D& origin) {
+    auto point = scaling * cell.wrap(position - origin);
+    auto projected = dot(axis.vector(), point);
+    return sqrt(point.norm() * point.norm() - projected * projected);
+}
+
+void Density::accumulate(const chemfiles::Frame& frame, size_t selection) {
+    (this->*kernel_)(frame, selection);
+}
+
+std::vector<size_t> Density::select(const chemfiles::Frame& frame, size_t selection) {
+    assert(selections_[selection].size() == 1);
+    auto selected = selections_[selection].list(frame);
     if (selected.empty()) {
-        warn(
-            "No matching atom for selection '" + selection_.string() +
-            "' at step " + std::to_string(frame.step())
-        );
+        no_atoms_[selection]->emit(selections_[selection].string(), frame.step());
     }
+    return selected;
+}
 
-    auto scaling = Matrix3D::unit();
+Matrix3D Density::scaling(const UnitCell& cell) const {
     if (options_.fractional) {
-        scaling = cell.matrix().invert();
+        return cell.matrix().invert();
+    } else {
+        return Matrix3D::unit();
     }
+}
 
-    for (auto i: selected) {
-        double x = 0;
-        double y = 0;
-        if (axis_[0].is_linear()) {
-            x = axis_[0].projection(scaling * cell.wrap(positions[i]));
-        } else {
-            assert(axis_[0].is_radial());
-            x = axis_[0].projection(scaling * cell.wrap(positions[i] - options_.origin));
+template <Axis::Type First>
+void Density::accumulate_1d(const chemfiles::Frame& frame, size_t selection) {
+    auto& positions = frame.positions();
+    auto& cell = frame.cell();
+    auto scaling = this->scaling(cell);
+
+    first_values_.clear();
+    for (auto i: select(frame, selection)) {
+        first_values_.push_back(project<First>(axis_[0], scaling, cell, positions[i], options_.origin));
+    }
+
+    auto& profile = profiles_1d_[selection];
+    profile.insert_many(first_values_);
+    profile.step();
+}
+
+template <Axis::Type First, Axis::Type Second>
+void Density::accumulate_2d(const chemfiles::Frame& frame, size_t selection) {
+    auto& positions = frame.positions();
+    auto& cell = frame.cell();
+    auto scaling = this->scaling(cell);
+
+    first_values_.clear();
+    second_values_.clear();
+    for (auto i: select(frame, selection)) {
+        first_values_.push_back(project<First>(axis_[0], scaling, cell, positions[i], options_.origin));
+        second_values_.push_back(project<Second>(axis_[1], scaling, cell, positions[i], options_.origin));
+    }
+
+    auto& profile = profiles_2d_[selection];
+    profile.insert_many(first_values_, second_values_);
+    profile.step();
+}
+
+void Density::accumulate_3d(const chemfiles::Frame& frame, size_t selection) {
+    auto& positions = frame.positions();
+    auto& cell = frame.cell();
+    if (options_.fractional && cell.shape() == UnitCell::INFINITE) {
+        throw CFilesError("Can not use fractional coordinates with an infinite unit cell");
+    }
+
+    if (selection == 0) {
+        auto matrix = cell.matrix();
+        for (size_t i=0; i<3; i++) {
+            for (size_t j=0; j<3; j++) {
+                cell_sum_[i][j] += matrix[i][j];
+            }
         }
-        if (dimensionality() == 2) {
-            if (axis_[1].is_linear()) {
-                y = axis_[1].projection(scaling * cell.wrap(positions[i]));
+        nsteps_++;
+    }
+
+    auto selected = select(frame, selection);
+    auto inverse = scaling(cell);
+    double width[3];
+    for (size_t i=0; i<3; i++) {
+        width[i] = (options_.max[i] - options_.min[i]) / static_cast<double>(options_.grid[i]);
+    }
+
+    // Only use multiple threads if there is enough work for all of them
+    auto& grids = grids_[selection];
+    auto nblocks = std::min(max_grids_, selected.size() / MIN_ATOMS_PER_THREAD + 1);
+    while (grids.size() < nblocks) {
+        grids.push_back(ThreadGrid{CountGrid(options_.grid[0], options_.grid[1], options_.grid[2]), 0});
+    }
+    auto blocks = split_blocks(selected.size(), nblocks);
+    parallel_for(blocks.size(), blocks.size(), [&](size_t block) {
+        auto& grid = grids[block];
+        const auto& shape = grid.counts.shape();
+        for (size_t atom=blocks[block].begin; atom<blocks[block].end; atom++) {
+            auto position = positions[selected[atom]] - options_.origin;
+            size_t bins[3];
+            bool inside = true;
+            if (options_.fractional) {
+                auto fractional = inverse * position;
+                for (size_t i=0; i<3; i++) {
+                    auto value = (fractional[i] - std::floor(fractional[i])) * static_cast<double>(shape[i]);
+                    // rounding can give `value == shape[i]` for values just
+                    // below 1 in fractional coordinates
+                    bins[i] = std::min(static_cast<size_t>(value), shape[i] - 1);
+                }
             } else {
-                assert(axis_[1].is_radial());
-                y = axis_[1].projection(scaling * cell.wrap(positions[i] - options_.origin));
+                position = cell.wrap(position);
+                for (size_t i=0; i<3; i++) {
+                    auto value = (position[i] - options_.min[i]) / width[i];
+                    if (!(value >= 0 && value < static_cast<double>(shape[i]))) {
+                        inside = false;
+                        break;
+                    }
+                    bins[i] = static_cast<size_t>(value);
+                }
+            }
+
+            if (inside) {
+                grid.counts.increment(bins[0], bins[1], bins[2]);
+            } else {
+                grid.out_of_bounds++;
             }
         }
-        if (dimensionality() == 1) {
-            profile.insert(x);
-        } else {
-            profile.insert(x, y);
-        }
-    }
+    });
 }
 
-void Density::finish(const Histogram& profile) {
-    std::ofstream outfile(options_.outfile, std::ios::out);
-    if (outfile.is_open()) {
-        outfile << "# Density profile in trajectory " << AveCommand::options().trajectory << std::endl;
-        outfile << "# along axis " << axis_[0].str();
-        if (dimensionality() == 2) {
-            outfile << " and " << axis_[1].str();
+void Density::finish(size_t selection) {
+    if (dimensionality() == 3) {
+        write_grid(selection);
+        return;
+    }
+
+    auto output = ResultWriter(output_path(options_.outfile, selection), AveCommand::options().output_format);
+    output.comment("Density profile in trajectory " + AveCommand::options().trajectory);
+    if (dimensionality() == 2) {
+        output.comment("along axis " + axis_[0].str() + " and " + axis_[1].str());
+    } else {
+        output.comment("along axis " + axis_[0].str());
+    }
+    output.comment("Selection: " + options_.selections[selection]);
+
+    if (dimensionality() == 1) {
+        auto& profile = profiles_1d_[selection];
+        check_out_of_bounds(profile);
+        profile.average();
+
+        auto coordinates = std::vector<double>(profile.size());
+        auto density = std::vector<double>(profile.size());
+        for (size_t i = 0; i < profile.size(); i++){
+            coordinates[i] = profile.first().coord(i);
+            if (axis_[0].is_linear()) {
+                density[i] = profile.averaged(i);
+            } else {
+                assert(axis_[0].is_radial());
+                density[i] = profile.averaged(i) / profile.first().coord(i);
+            }
         }
-        outfile << std::endl;
-        outfile << "# Selection: " << options_.selection << std::endl;
+        output.column("coordinate", std::move(coordinates));
+        output.column("density", std::move(density));
+    } else {
+        auto& profile = profiles_2d_[selection];
+        check_out_of_bounds(profile);
+        profile.average();
 
-        if (dimensionality() == 1) {
-            for (size_t i = 0; i < profile.size(); i++){
-                if (axis_[0].is_linear()) {
-                    outfile << profile.first().coord(i) << "  " << profile[i] << "\n";
+        output.comment("first second density");
+
+        auto first = std::vector<double>(profile.first().nbins);
+        for (size_t i = 0; i < profile.first().nbins; i++){
+            first[i] = profile.first().coord(i);
+        }
+        auto second = std::vector<double>(profile.second().nbins);
+        for (size_t j = 0; j < profile.second().nbins; j++){
+            second[j] = profile.second().coord(j);
+        }
+
+        auto density = std::vector<double>(first.size() * second.size());
+        for (size_t i = 0; i < profile.first().nbins; i++){
+            for (size_t j = 0; j < profile.second().nbins; j++){
+                if (axis_[0].is_linear() and axis_[1].is_linear()) {
+                    density[i * second.size() + j] = profile.averaged(i, j);
                 } else {
-                    assert(axis_[0].is_radial());
-                    outfile << profile.first().coord(i) << "  " << profile[i] / profile.first().coord(i) << "\n";
+                    assert(axis_[0].is_linear() and axis_[1].is_radial());
+                    density[i * second.size() + j] = profile.averaged(i, j) / profile.second().coord(j);
                 }
             }
-        } else {
-            outfile << "# first second density" << std::endl;
-
-            for (size_t i = 0; i < profile.first().nbins; i++){
-                for (size_t j = 0; j < profile.second().nbins; j++){
-                    outfile << profile.first().coord(i) << "\t" << profile.second().coord(j) << "\t";
-                    if (axis_[0].is_linear() and axis_[1].is_linear()) {
-                        outfile << profile(i, j) << "\n";
-                    } else {
-                        assert(axis_[0].is_linear() and axis_[1].is_radial());
-                        outfile << profile(i, j) / profile.second().coord(j) << "\n";
-                    }
-                }
+        }
+        output.grid("density", "first", std::move(first), "second", std::move(second), std::move(density));
+    }
+
+    output.write();
+}
+
+/// Spatial information for a 3D grid: position of the first voxel, and
+/// vectors between neighboring voxels in each direction.
+struct GridGeometry {
+    Vector3D origin;
+    Vector3D voxels[3];
+};
+
+/// Call `function(value, end_of_row)` for the averaged value of all voxels in
+/// the grid, with the last direction varying fastest
+template <typename Function>
+static void for_each_voxel(const CountGrid& grid, double scale, Function function) {
+    const auto& shape = grid.shape();
+    for (size_t i=0; i<shape[0]; i++) {
+        for (size_t j=0; j<shape[1]; j++) {
+            for (size_t k=0; k<shape[2]; k++) {
+                function(static_cast<double>(grid(i, j, k)) * scale, k == shape[2] - 1);
             }
         }
+    }
+}
+
+static void write_cube(const std::string& path, const std::vector<std::string>& comments, const GridGeometry& geometry, const CountGrid& grid, double scale) {
+    BufferedFile file(path);
+    auto out = std::back_inserter(file.buffer());
+    // cube files contain exactly two comment lines
+    for (size_t i=0; i<2; i++) {
+        fmt::format_to(out, "{}\n", i < comments.size() ? comments[i] : "");
+    }
+
+    auto origin = ANGSTROM_TO_BOHR * geometry.origin;
+    fmt::format_to(out, "{:5d} {:12.6f} {:12.6f} {:12.6f}\n", 0, origin[0], origin[1], origin[2]);
+    for (size_t i=0; i<3; i++) {
+        auto voxel = ANGSTROM_TO_BOHR * geometry.voxels[i];
+        fmt::format_to(out, "{:5d} {:12.6f} {:12.6f} {:12.6f}\n", grid.shape()[i], voxel[0], voxel[1], voxel[2]);
+    }
+
+    // values are written by rows of at most 6 values, each row along the
+    // last direction starting on a new line
+    size_t in_line = 0;
+    for_each_voxel(grid, scale, [&](double value, bool end_of_row) {
+        fmt::format_to(std::back_inserter(file.buffer()), " {:12.5e}", value);
+        in_line++;
+        if (in_line == 6 || end_of_row) {
+            file.buffer().push_back('\n');
+            in_line = 0;
+            file.maybe_flush();
+        }
+    });
+    file.close();
+}
+
+static void write_dx(const std::string& path, const std::vector<std::string>& comments, const GridGeometry& geometry, const CountGrid& grid, double scale) {
+    BufferedFile file(path);
+    auto out = std::back_inserter(file.buffer());
+    for (auto& comment: comments) {
+        fmt::format_to(out, "# {}\n", comment);
+    }
+
+    const auto& shape = grid.shape();
+    fmt::format_to(out, "object 1 class gridpositions counts {} {} {}\n", shape[0], shape[1], shape[2]);
+    fmt::format_to(out, "origin {:.8g} {:.8g} {:.8g}\n", geometry.origin[0], geometry.origin[1], geometry.origin[2]);
+    for (size_t i=0; i<3; i++) {
+        const auto& voxel = geometry.voxels[i];
+        fmt::format_to(out, "delta {:.8g} {:.8g} {:.8g}\n", voxel[0], voxel[1], voxel[2]);
+    }
+    fmt::format_to(out, "object 2 class gridconnections counts {} {} {}\n", shape[0], shape[1], shape[2]);
+    fmt::format_to(out, "object 3 class array type double rank 0 items {} data follows\n", shape[0] * shape[1] * shape[2]);
+
+    size_t in_line = 0;
+    for_each_voxel(grid, scale, [&](double value, bool) {
+        fmt::format_to(std::back_inserter(file.buffer()), in_line == 0 ? "{:.8g}" : " {:.8g}", value);
+        in_line++;
+        if (in_line == 3) {
+            file.buffer().push_back('\n');
+            in_line = 0;
+            file.maybe_flush();
+        }
+    });
+    if (in_line != 0) {
+        file.buffer().push_back('\n');
+    }
+
+    file.write(
+        "attribute \"dependency\" string \"positions\"\n"
+        "object \"density\" class field\n"
+        "component \"positions\" value 1\n"
+        "component \"connections\" value 2\n"
+        "component \"data\" value 3\n"
+    );
+    file.close();
+}
+
+void Density::write_grid(size_t selection) {
+    auto& grids = grids_[selection];
+    if (grids.empty()) {
+        grids.push_back(ThreadGrid{CountGrid(options_.grid[0], options_.grid[1], options_.grid[2]), 0});
+    }
+    auto counts = std::move(grids[0].counts);
+    size_t out_of_bounds = grids[0].out_of_bounds;
+    for (size_t i=1; i<grids.size(); i++) {
+        counts.merge(grids[i].counts);
+        out_of_bounds += grids[i].out_of_bounds;
+    }
+    grids.clear();
+
+    if (out_of_bounds != 0) {
+        warn(std::to_string(out_of_bounds) + " particles were outside of the grid and have been ignored");
+    }
+
+    auto geometry = GridGeometry();
+    if (options_.fractional) {
+        // use the average unit cell for the voxels
+        geometry.origin = options_.origin;
+        for (size_t i=0; i<3; i++) {
+            for (size_t j=0; j<3; j++) {
+                geometry.voxels[i][j] = cell_sum_[j][i] / static_cast<double>(nsteps_ * options_.grid[i]);
+            }
+        }
+    } else {
+        geometry.origin = options_.origin + Vector3D(options_.min[0], options_.min[1], options_.min[2]);
+        for (size_t i=0; i<3; i++) {
+            geometry.voxels[i] = Vector3D(0, 0, 0);
+            geometry.voxels[i][i] = (options_.max[i] - options_.min[i]) / static_cast<double>(options_.grid[i]);
+        }
+    }
+
+    auto comments = std::vector<std::string>{
+        "Density in trajectory " + AveCommand::options().trajectory,
+        "Selection: " + options_.selections[selection],
+    };
+    auto scale = nsteps_ == 0 ? 0.0 : 1.0 / static_cast<double>(nsteps_);
+    auto path = output_path(options_.outfile, selection);
+
+    if (AveCommand::options().output_format == OutputFormat::Numpy) {
+        const auto& shape = counts.shape();
+        auto density = std::vector<float>();
+        density.reserve(shape[0] * shape[1] * shape[2]);
+        for_each_voxel(counts, scale, [&](double value, bool) {
+            density.push_back(static_cast<float>(value));
+        });
+
+        auto origin = std::vector<double>{geometry.origin[0], geometry.origin[1], geometry.origin[2]};
+        auto voxels = std::vector<double>(9);
+        for (size_t i=0; i<3; i++) {
+            for (size_t j=0; j<3; j++) {
+                voxels[3 * i + j] = geometry.voxels[i][j];
+            }
+        }
+
+        auto writer = NpzWriter(path);
+        writer.add("metadata", comments[0] + "\n" + comments[1] + "\n");
+        writer.add("density", {shape[0], shape[1], shape[2]}, density);
+        writer.add("origin", {3}, origin);
+        writer.add("voxels", {3, 3}, voxels);
+        writer.write();
+    } else if (options_.grid_format == GridFormat::Cube) {
+        write_cube(path, comments, geometry, counts, scale);
     } else {
-        throw CFilesError("Could not open the '" + options_.outfile + "' file.");
+        assert(options_.grid_format == GridFormat::DX);
+        write_dx(path, comments, geometry, counts, scale);
     }
 }
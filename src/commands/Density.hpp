@@ -4,44 +4,105 @@
 #ifndef CFILES_DENSITY_HPP
 #define CFILES_DENSITY_HPP
 
+#include <memory>
+
 #include <chemfiles.hpp>
 
 #include "AveCommand.hpp"
 #include "Axis.hpp"
+#include "Grid.hpp"
 #include "utils.hpp"
+#include "warnings.hpp"
 
 class Density final: public AveCommand {
 public:
+    /// File format for 3D grids
+    enum class GridFormat {
+        /// Gaussian cube file
+        Cube,
+        /// OpenDX file
+        DX,
+    };
+
     struct Options {
     /// Output
     std::string outfile;
-    /// Selection for the donor-acceptor
-    std::string selection;
+    /// Selections for the particles
+    std::vector<std::string> selections;
     /// Coordinate of origin
     Vector3D origin;
     /// Number of points in the profile
     size_t npoints[2];
     /// Maximum in the profile
-    double max[2] = {0, 0};
+    double max[3] = {0, 0, 0};
     /// Minimum in the profile
-    double min[2] = {0, 0};
+    double min[3] = {0, 0, 0};
     /// Should fractional cooordinates be used
     bool fractional = false;
+    /// Number of points in each direction for 3D grids, or zeros when
+    /// computing 1D or 2D profiles
+    size_t grid[3] = {0, 0, 0};
+    /// Output format for 3D grids
+    GridFormat grid_format = GridFormat::Cube;
+    /// Number of threads to use for 3D grids
+    size_t threads = 1;
     };
 
-    Density(): selection_("atoms: all"), axis_() {}
+    Density(): axis_() {}
     std::string description() const override;
 
-    Averager setup(int argc, const char* argv[]) override;
-    void accumulate(const chemfiles::Frame& frame, Histogram& histogram) override;
-    void finish(const Histogram& histogram) override;
+    size_t setup(int argc, const char* argv[]) override;
+    void accumulate(const chemfiles::Frame& frame, size_t selection) override;
+    void finish(size_t selection) override;
 
-    size_t dimensionality() { return axis_.size();}
+    size_t dimensionality() { return options_.grid[0] != 0 ? 3 : axis_.size();}
 
 private:
+    /// Get the list of atoms matching the selection at index `selection`
+    std::vector<size_t> select(const chemfiles::Frame& frame, size_t selection);
+    /// Get the scaling matrix to apply to the positions in the given `cell`
+    Matrix3D scaling(const UnitCell& cell) const;
+
+    /// Specialized kernels for all the combination of axis types
+    template <Axis::Type First>
+    void accumulate_1d(const chemfiles::Frame& frame, size_t selection);
+    template <Axis::Type First, Axis::Type Second>
+    void accumulate_2d(const chemfiles::Frame& frame, size_t selection);
+    void accumulate_3d(const chemfiles::Frame& frame, size_t selection);
+
+    /// Write the 3D grid for the selection at index `selection`
+    void write_grid(size_t selection);
+
+    /// Counts in a 3D grid, accumulated by a single thread
+    struct ThreadGrid {
+        CountGrid counts;
+        /// Number of particles outside of the grid
+        size_t out_of_bounds;
+    };
+
     Options options_;
-    chemfiles::Selection selection_;
+    std::vector<chemfiles::Selection> selections_;
     std::vector<Axis> axis_;
+    /// Kernel used for this run, selected in `setup`
+    void (Density::*kernel_)(const chemfiles::Frame&, size_t) = nullptr;
+    /// Density profiles for each selection, for 1D and 2D profiles
+    std::vector<Averager<1, uint32_t>> profiles_1d_;
+    std::vector<Averager<2, uint32_t>> profiles_2d_;
+    /// 3D grids for each selection, with one grid per thread. The grids are
+    /// only created when they are used.
+    std::vector<std::vector<ThreadGrid>> grids_;
+    /// Maximal number of grids for each selection
+    size_t max_grids_ = 1;
+    /// Sum of the unit cell matrices over all steps, and number of steps. This
+    /// is used to get the voxels of 3D grids in fractional coordinates.
+    Matrix3D cell_sum_ = Matrix3D::zero();
+    size_t nsteps_ = 0;
+    /// Per-frame buffers for the coordinates along the first and second axis,
+    /// inserted in the histogram all at once
+    std::vector<double> first_values_;
+    std::vector<double> second_values_;
+    /// Warning emitted when no atom matches each selection
+    std::vector<std::unique_ptr<WarningSite>> no_atoms_;
 };
 
 #endif
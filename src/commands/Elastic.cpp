@@ -1,16 +1,14 @@
 // cfiles, an analysis frontend for the Chemfiles library
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
-#include <fstream>
-
 #include <docopt/docopt.h>
 #include <fmt/format.h>
-#include <fmt/ostream.h>
 #include <chemfiles.hpp>
 #include <Eigen/Dense>
 
 #include "Elastic.hpp"
 #include "Errors.hpp"
+#include "Parallel.hpp"
 
 using namespace chemfiles;
 
@@ -42,8 +40,12 @@ Options:
   --format=<format>                force the input file format to be <format>
   -t <temp>, --temperature=<temp>  temperature of the simulation, in kelvin
   -o <file>, --output=<file>       write result to <file>. This default to the
-                                   trajectory file name with the `.angles.dat`
-                                   extension.
+                                   trajectory file name with the `.elastic.dat`
+                                   extension, or `.elastic.npz` for NumPy
+                                   output.
+  --output-format=<fmt>            format of the output file, either `text` for
+                                   a plain text file or `npy` for a NumPy `.npz`
+                                   archive [default: text]
   --steps=<steps>                  steps to use from the input. <steps> format
                                    is <start>:<end>[:<stride>] with <start>,
                                    <end> and <stride> optional. The used steps
@@ -51,6 +53,9 @@ Options:
                                    steps of <stride>. The default values are 0
                                    for <start>, the number of steps for <end>
                                    and 1 for <stride>.
+  --threads=<n>                    number of threads to use when reading the
+                                   trajectory. This default to the number of
+                                   available cores.
 )";
 
 
@@ -73,10 +78,17 @@ static Elastic::Options parse_options(int argc, const char* argv[]) {
         options.steps = steps_range::parse(args.at("--steps").asString());
     }
 
+    if (args.at("--threads")) {
+        options.threads = parse_threads(args.at("--threads").asString());
+    } else {
+        options.threads = default_threads();
+    }
+
+    options.output_format = parse_output_format(args.at("--output-format").asString());
     if (args["--output"]) {
         options.outfile = args.at("--output").asString();
     } else {
-        options.outfile = options.trajectory + ".elastic.dat";
+        options.outfile = options.trajectory + ".elastic" + output_extension(options.output_format);
     }
 
     return options;
@@ -88,16 +100,20 @@ std::string Elastic::description() const {
 
 int Elastic::run(int argc, const char* argv[]) {
     auto options = parse_options(argc, argv);
-    auto cells = std::vector<Matrix3D>();
 
     auto trajectory = Trajectory(options.trajectory, 'r', options.format);
-    for (auto step: options.steps) {
-        if (step >= trajectory.nsteps()) {
-            break;
+    auto steps = options.steps.list(trajectory.nsteps());
+    auto cells = std::vector<Matrix3D>(steps.size(), Matrix3D::zero());
+
+    // Each thread reads a contiguous block of steps
+    auto blocks = split_blocks(steps.size(), options.threads);
+    parallel_for(blocks.size(), options.threads, [&](size_t block) {
+        auto trajectory = Trajectory(options.trajectory, 'r', options.format);
+        for (auto step=blocks[block].begin; step<blocks[block].end; step++) {
+            auto frame = trajectory.read_step(steps[step]);
+            cells[step] = frame.cell().matrix();
         }
-        auto frame = trajectory.read_step(step);
-        cells.emplace_back(frame.cell().matrix());
-    }
+    });
 
     // Use the avrerage as the reference state
     auto reference = Matrix3D::zero();
@@ -165,40 +181,12 @@ int Elastic::run(int argc, const char* argv[]) {
     }
 
     auto CVoigt = SVoigt.inverse();
-    std::ofstream outfile(options.outfile, std::ios::out);
-    if (!outfile.is_open()) {
-        throw CFilesError("Could not open the '" + options.outfile + "' file.");
-    }
-
-    fmt::print(outfile, "# stiffness tensor in GPa from {}\n", options.trajectory);
-    for (size_t i=0; i<6; i++) {
-        for (size_t j=0; j<6; j++) {
-            if (j != 0) {
-                fmt::print(outfile, " ");
-            }
-            if (j >= i) {
-                fmt::print(outfile, "{:12.5f}", CVoigt(i, j));
-            } else {
-                fmt::print(outfile, "            ");
-            }
-        }
-        fmt::print(outfile, "\n");
-    }
 
     auto eigenvalues = CVoigt.eigenvalues();
     auto sorter = [](std::complex<double> i, std::complex<double> j) {
         return std::abs(i) < std::abs(j);
     };
     std::sort(eigenvalues.data(), eigenvalues.data() + eigenvalues.size(), sorter);
-    fmt::print(outfile, "# eigen values of the stiffness tensor (GPa)\n");
-    for (size_t i=0; i<6; i++) {
-        auto& value = eigenvalues(i);
-        if (value.imag() == 0) {
-            fmt::print(outfile, "{:12.5f}\n", value.real());
-        } else {
-            fmt::print(outfile, "{:12.5f} + {:12.5f}i\n", value.real(), value.imag());
-        }
-    }
 
     double A = (CVoigt(0, 0) + CVoigt(1, 1) + CVoigt(2, 2)) / 3.0;
     double B = (CVoigt(1, 2) + CVoigt(0, 2) + CVoigt(0, 1)) / 3.0;
@@ -223,13 +211,76 @@ int Elastic::run(int argc, const char* argv[]) {
     double YH = 1.0 / (1.0 / (3.0 * GH) + 1.0 / (9.0 * KH));
     double PH = (1.0 - 3.0 * GH / (3.0 * KH + GH)) / 2.0;
 
-    fmt::print(outfile, "# Bulk modulus (GPa) | Young's modulus (GPa) | Shear modulus (GPa) | Poisson's ratio\n");
-    fmt::print(outfile, "# Voigt averaging\n");
-    fmt::print(outfile, "{:12.5f} {:12.5f} {:12.5f} {:12.5f}\n", KV, YV, GV, PV);
-    fmt::print(outfile, "# Reuss averaging\n");
-    fmt::print(outfile, "{:12.5f} {:12.5f} {:12.5f} {:12.5f}\n", KR, YR, GR, PR);
-    fmt::print(outfile, "# Hill averaging\n");
-    fmt::print(outfile, "{:12.5f} {:12.5f} {:12.5f} {:12.5f}\n", KH, YH, GH, PH);
+    auto moduli = std::vector<double>{
+        KV, YV, GV, PV,
+        KR, YR, GR, PR,
+        KH, YH, GH, PH,
+    };
+
+    if (options.output_format == OutputFormat::Numpy) {
+        auto output = NpzWriter(options.outfile);
+        output.add("metadata", "stiffness tensor in GPa from " + options.trajectory + "\n");
+
+        auto stiffness = std::vector<double>(36);
+        for (size_t i=0; i<6; i++) {
+            for (size_t j=0; j<6; j++) {
+                stiffness[6 * i + j] = CVoigt(i, j);
+            }
+        }
+        output.add("stiffness", {6, 6}, stiffness);
+
+        auto eigenvalues_real = std::vector<double>(6);
+        auto eigenvalues_imag = std::vector<double>(6);
+        for (size_t i=0; i<6; i++) {
+            eigenvalues_real[i] = eigenvalues(i).real();
+            eigenvalues_imag[i] = eigenvalues(i).imag();
+        }
+        output.add("eigenvalues_real", {6}, eigenvalues_real);
+        output.add("eigenvalues_imag", {6}, eigenvalues_imag);
+
+        // One row for each of the Voigt, Reuss and Hill averaging, containing
+        // bulk, Young's and shear modulus and the Poisson's ratio
+        output.add("moduli", {3, 4}, moduli);
+        output.write();
+        return 0;
+    }
+
+    TextWriter output(options.outfile);
+    output.comment("stiffness tensor in GPa from " + options.trajectory);
+    for (size_t i=0; i<6; i++) {
+        for (size_t j=0; j<6; j++) {
+            if (j != 0) {
+                output.write(" ");
+            }
+            if (j >= i) {
+                output.write(fmt::format("{:12.5f}", CVoigt(i, j)));
+            } else {
+                output.write("            ");
+            }
+        }
+        output.write("\n");
+    }
+
+    output.comment("eigen values of the stiffness tensor (GPa)");
+    for (size_t i=0; i<6; i++) {
+        auto& value = eigenvalues(i);
+        if (value.imag() == 0) {
+            output.write(fmt::format("{:12.5f}\n", value.real()));
+        } else {
+            output.write(fmt::format("{:12.5f} + {:12.5f}i\n", value.real(), value.imag()));
+        }
+    }
+
+    output.comment("Bulk modulus (GPa) | Young's modulus (GPa) | Shear modulus (GPa) | Poisson's ratio");
+    const char* averaging[] = {"Voigt", "Reuss", "Hill"};
+    for (size_t i=0; i<3; i++) {
+        output.comment(std::string(averaging[i]) + " averaging");
+        output.write(fmt::format(
+            "{:12.5f} {:12.5f} {:12.5f} {:12.5f}\n",
+            moduli[4 * i], moduli[4 * i + 1], moduli[4 * i + 2], moduli[4 * i + 3]
+        ));
+    }
+    output.close();
 
     return 0;
 }
@@ -5,6 +5,7 @@
 #define CFILES_ELASTIC_HPP
 
 #include "Command.hpp"
+#include "Output.hpp"
 #include "utils.hpp"
 
 namespace chemfiles {
@@ -24,6 +25,11 @@ public:
         std::string outfile;
         /// Temperature of the simulation
         double temperature;
+        /// Number of threads to use when reading the trajectory, 0 to use all
+        /// available cores
+        size_t threads = 0;
+        /// Format to use for the output files
+        OutputFormat output_format = OutputFormat::Text;
     };
 
     Elastic() {}
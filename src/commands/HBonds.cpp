@@ -2,16 +2,20 @@
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
 #include <docopt/docopt.h>
-#include <sstream>
-#include <fstream>
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <unordered_set>
 
 #include <fmt/format.h>
-#include <fmt/ostream.h>
 
 #include "HBonds.hpp"
 #include "Autocorrelation.hpp"
+#include "CellList.hpp"
+#include "MultiTau.hpp"
+#include "Parallel.hpp"
 #include "Histogram.hpp"
 #include "Errors.hpp"
 #include "utils.hpp"
@@ -47,7 +51,15 @@ Options:
   -h --help                     show this help
   -o <file>, --output=<file>    write result to <file>. This default to the
                                 trajectory file name with the `.hbonds.dat`
-                                extension.
+                                extension, or `.hbonds.npz` for NumPy output.
+  --bonds-output=<file>         write the hydrogen bonds at each step to <file>
+                                in a compact binary format, using delta-encoded
+                                variable-length integers. When using this
+                                option, the main output is only written if
+                                --output is also given.
+  --output-format=<fmt>         format of the output files, either `text` for
+                                plain text files or `npy` for NumPy `.npz`
+                                archives [default: text]
   --format=<format>             force the input file format to be <format>
   -t <path>, --topology=<path>  alternative topology file for the input
   --topology-format=<format>    use <format> as format for the topology file
@@ -63,6 +75,21 @@ Options:
                                 <stride>. The default values are 0 for <start>,
                                 the number of steps for <end> and 1 for
                                 <stride>.
+  --threads=<n>                 number of threads to use when reading the
+                                trajectory and computing the correlations.
+                                This default to the number of available
+                                cores.
+  --max-lag=<lag>               maximal time lag, in steps of the trajectory,
+                                for which to compute the correlations. This
+                                default to half of the used steps. Computing
+                                only short time lags is faster and uses less
+                                memory.
+  --correlator=<algo>           algorithm used to compute the correlations.
+                                `fft` computes all the time lags exactly, from
+                                the intervals of time during which each bond
+                                exists, `multitau` computes logarithmically
+                                spaced time lags while reading the trajectory.
+                                [default: fft]
   --donors=<sel>                selection to use for the donors. This must be a
                                 selection of size 2, with the hydrogen atom as
                                 second atom. [default: bonds: type(#2) == H]
@@ -83,6 +110,12 @@ Options:
                                 autocorrelation and output it to the given
                                 <ouput> file. This can be used to retrieve the
                                 lifetime of hydrogen bonds.
+  --lifetimes=<output>          compute the survival probability of hydrogen
+                                bonds (the probability for a bond to exist
+                                continuously during a given time) and the
+                                distribution of continuous lifetimes of the
+                                bonds, and output them to the given <output>
+                                file.
 )";
 
 struct hbond {
@@ -111,6 +144,152 @@ namespace std {
     };
 }
 
+/// Hydrogen bond passing the distance and angle criteria, before sorting
+struct candidate {
+    /// Index of the donor-hydrogen pair in the donor selection matches
+    size_t match;
+    size_t acceptor;
+    double distance;
+    double theta;
+};
+
+/// Writer for the `--bonds-output` binary stream.
+///
+/// The file starts with the 8 bytes `CFHBOND1`, followed by one record per
+/// step. All integers are unsigned LEB128 variable-length integers, signed
+/// integers being zigzag-encoded first. A record contains the difference
+/// between its step and the step of the previous record (the step itself for
+/// the first record), the number of bonds, and the bonds sorted by donor,
+/// hydrogen and acceptor. Each bond is stored as the difference between its
+/// donor and the donor of the previous bond in the record (the donor itself
+/// for the first bond), followed by the signed differences between the
+/// hydrogen and the donor, and between the acceptor and the donor.
+class BondsStream {
+public:
+    explicit BondsStream(std::string path): file_(std::move(path)) {
+        file_.write("CFHBOND1", 8);
+    }
+
+    /// Write the record for the `bonds` at the given `step`
+    void add(uint64_t step, const std::vector<hbond>& bonds) {
+        sorted_.assign(bonds.begin(), bonds.end());
+        std::sort(sorted_.begin(), sorted_.end(), [](const hbond& lhs, const hbond& rhs) {
+            if (lhs.donor != rhs.donor) {
+                return lhs.donor < rhs.donor;
+            } else if (lhs.hydrogen != rhs.hydrogen) {
+                return lhs.hydrogen < rhs.hydrogen;
+            } else {
+                return lhs.acceptor < rhs.acceptor;
+            }
+        });
+
+        write_unsigned(step - previous_step_);
+        previous_step_ = step;
+        write_unsigned(sorted_.size());
+        size_t previous_donor = 0;
+        for (auto& bond: sorted_) {
+            write_unsigned(bond.donor - previous_donor);
+            write_signed(static_cast<int64_t>(bond.hydrogen) - static_cast<int64_t>(bond.donor));
+            write_signed(static_cast<int64_t>(bond.acceptor) - static_cast<int64_t>(bond.donor));
+            previous_donor = bond.donor;
+        }
+        file_.maybe_flush();
+    }
+
+    /// Flush all the data and close the file
+    void close() {
+        file_.close();
+    }
+
+private:
+    void write_unsigned(uint64_t value) {
+        auto& buffer = file_.buffer();
+        while (value >= 0x80) {
+            buffer.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back(static_cast<char>(value));
+    }
+
+    void write_signed(int64_t value) {
+        write_unsigned((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+    }
+
+    BufferedFile file_;
+    uint64_t previous_step_ = 0;
+    std::vector<hbond> sorted_;
+};
+
+/// Interval of used steps during which a bond exists, from `start` to `end`
+/// (excluded)
+struct interval {
+    size_t start;
+    size_t end;
+};
+
+/// Add the existence of a bond at `step` to its existence `intervals`. The
+/// steps must be given in increasing order.
+static void add_existence(std::vector<interval>& intervals, size_t step) {
+    if (!intervals.empty() && intervals.back().end == step) {
+        intervals.back().end += 1;
+    } else {
+        intervals.push_back(interval{step, step + 1});
+    }
+}
+
+/// Compute the sum over all bonds and all time origins `t` of `h(t) h(t + lag)`
+/// for the first `lags` values of `lag`, where `h(t)` is 1 if the bond exists
+/// at step `t` and 0 otherwise.
+///
+/// For two intervals, this sum is the correlation of two box functions, a
+/// trapezoid in `lag`. Its second difference is made of four +/-1 peaks,
+/// which are accumulated for all pairs of intervals of the same bond and then
+/// integrated twice.
+static std::vector<double> existence_correlation(const std::unordered_map<hbond, std::vector<interval>>& all_intervals, size_t lags) {
+    auto second_difference = std::vector<int64_t>(lags + 1, 0);
+    auto add_peak = [&](int64_t position, int64_t weight) {
+        if (position <= 0) {
+            // only the part of the peak contribution after `lag = 0` is
+            // used: weight * (lag + 1 - position)
+            second_difference[0] += weight * (1 - position);
+            if (lags >= 1) {
+                second_difference[1] += weight * position;
+            }
+        } else if (static_cast<size_t>(position) < lags) {
+            second_difference[static_cast<size_t>(position)] += weight;
+        }
+    };
+
+    for (auto& it: all_intervals) {
+        auto& intervals = it.second;
+        for (size_t i=0; i<intervals.size(); i++) {
+            auto start_i = static_cast<int64_t>(intervals[i].start);
+            auto end_i = static_cast<int64_t>(intervals[i].end);
+            // the intervals are sorted and disjoint, only the intervals
+            // starting less than `lags` steps after the end of this one
+            // contribute
+            for (size_t j=i; j<intervals.size() && intervals[j].start < intervals[i].end + lags; j++) {
+                auto start_j = static_cast<int64_t>(intervals[j].start);
+                auto end_j = static_cast<int64_t>(intervals[j].end);
+                add_peak(start_j - end_i + 1, 1);
+                add_peak(start_j - start_i + 1, -1);
+                add_peak(end_j - end_i + 1, -1);
+                add_peak(end_j - start_i + 1, 1);
+            }
+        }
+    }
+
+    auto correlation = std::vector<double>(lags);
+    int64_t difference = 0;
+    int64_t value = 0;
+    for (size_t lag=0; lag<lags; lag++) {
+        difference += second_difference[lag];
+        value += difference;
+        correlation[lag] = static_cast<double>(value);
+    }
+    return correlation;
+}
+
 static HBonds::Options parse_options(int argc, const char* argv[]) {
     auto options_str = command_header("hbonds", HBonds().description()) + "\n";
     options_str += "Laura Scalfi <laura.scalfi@ens.fr>\n";
@@ -125,13 +304,24 @@ static HBonds::Options parse_options(int argc, const char* argv[]) {
     options.donor_selection = args.at("--donors").asString();
 
     options.distance = string2double(args.at("--distance").asString());
+    if (options.distance <= 0) {
+        throw CFilesError("the distance criterion must be positive");
+    }
     options.angle = string2double(args.at("--angle").asString()) * PI / 180;
     options.npoints = string2long(args["--points"].asString());
 
+    options.output_format = parse_output_format(args.at("--output-format").asString());
+    if (args.at("--bonds-output")) {
+        options.bonds_output = args.at("--bonds-output").asString();
+    }
+
     if (args.at("--output")) {
         options.outfile = args.at("--output").asString();
+    } else if (!options.bonds_output.empty()) {
+        // only write the binary stream
+        options.outfile = "";
     } else {
-        options.outfile = options.trajectory + ".hbonds.dat";
+        options.outfile = options.trajectory + ".hbonds" + output_extension(options.output_format);
     }
 
     if (args.at("--autocorrelation")) {
@@ -141,6 +331,10 @@ static HBonds::Options parse_options(int argc, const char* argv[]) {
         options.autocorrelation = false;
     }
 
+    if (args.at("--lifetimes")) {
+        options.lifetimes_output = args.at("--lifetimes").asString();
+    }
+
     if (args.at("--histogram")) {
         options.histogram_output = args.at("--histogram").asString();
         options.histogram = true;
@@ -148,6 +342,18 @@ static HBonds::Options parse_options(int argc, const char* argv[]) {
         options.histogram = false;
     }
 
+    if (args.at("--threads")) {
+        options.threads = parse_threads(args.at("--threads").asString());
+    } else {
+        options.threads = default_threads();
+    }
+
+    if (args.at("--max-lag")) {
+        options.max_lag = parse_max_lag(args.at("--max-lag").asString());
+    }
+
+    options.correlator = parse_correlator(args.at("--correlator").asString());
+
     if (args.at("--steps")) {
         options.steps = steps_range::parse(args.at("--steps").asString());
     }
@@ -178,6 +384,48 @@ static HBonds::Options parse_options(int argc, const char* argv[]) {
     return options;
 }
 
+static Trajectory open_trajectory(const HBonds::Options& options) {
+    auto trajectory = Trajectory(options.trajectory, 'r', options.format);
+    if (options.custom_cell) {
+        trajectory.set_cell(options.cell);
+    }
+
+    if (options.topology != "") {
+        trajectory.set_topology(options.topology, options.topology_format);
+    }
+
+    return trajectory;
+}
+
+/// Number of steps in the chunks processed by the reader threads
+static const size_t CHUNK_STEPS = 256;
+
+/// Trajectory, selections and buffers used by a thread to find the hydrogen
+/// bonds in successive chunks of steps
+struct bonds_reader {
+    explicit bonds_reader(const HBonds::Options& options):
+        infile(open_trajectory(options)),
+        donors(options.donor_selection),
+        acceptors(options.acceptor_selection),
+        histogram(options.npoints, 0, options.distance, options.npoints, 0, options.angle * 180 / PI)
+    {}
+
+    Trajectory infile;
+    Selection donors;
+    Selection acceptors;
+    /// Histogram of the bonds found by this reader
+    Histogram<2, uint32_t> histogram;
+    // Buffers reused for all the steps
+    std::vector<double> distances;
+    std::vector<double> angles;
+    std::vector<bool> is_hydrogen;
+    std::vector<size_t> acceptors_list;
+    std::vector<size_t> donors_list;
+    std::vector<size_t> start;
+    std::vector<size_t> by_donor;
+    std::vector<candidate> candidates;
+};
+
 std::string HBonds::description() const {
     return "compute hydrogen bonds using distance/angle criteria";
 }
@@ -195,148 +443,474 @@ int HBonds::run(int argc, const char* argv[]) {
         throw CFilesError("Can not use a selection for acceptors with size larger than 1.");
     }
 
-    std::ofstream outfile(options.outfile, std::ios::out);
-    if (!outfile.is_open()) {
-        throw CFilesError("Could not open the '" + options.outfile + "' file.");
-    }
-    fmt::print(outfile, "# Hydrogen bonds in {}\n", options.trajectory);
-    fmt::print(outfile, "# Between '{}' and '{}'\n", options.acceptor_selection, options.donor_selection);
+    auto infile = open_trajectory(options);
+    auto steps = options.steps.list(infile.nsteps());
 
-    auto infile = Trajectory(options.trajectory, 'r', options.format);
-    if (options.custom_cell) {
-        infile.set_cell(options.cell);
-    }
+    auto header = std::vector<std::string>{
+        "Hydrogen bonds in " + options.trajectory,
+        "Between '" + options.acceptor_selection + "' and '" + options.donor_selection + "'",
+    };
 
-    if (options.topology != "") {
-        infile.set_topology(options.topology, options.topology_format);
+    // The text output is written while iterating over the steps, the NumPy
+    // output is accumulated and written at the end
+    auto text = std::unique_ptr<TextWriter>();
+    auto npy_steps = std::vector<uint64_t>();
+    auto npy_counts = std::vector<uint64_t>();
+    auto npy_bonds = std::vector<uint64_t>();
+    auto stream = std::unique_ptr<BondsStream>();
+    if (!options.bonds_output.empty()) {
+        stream.reset(new BondsStream(options.bonds_output));
+    }
+    if (options.outfile.empty()) {
+        // only writing the binary stream
+    } else if (options.output_format == OutputFormat::Text) {
+        text.reset(new TextWriter(options.outfile));
+        for (auto& line: header) {
+            text->comment(line);
+        }
     }
 
-    auto histogram = Histogram(options.npoints, 0, options.distance, options.npoints, 0, options.angle * 180 / PI);
-    auto existing_bonds = std::unordered_map<hbond, std::vector<float>>();
-    size_t used_steps = 0;
-    for (auto step: options.steps) {
-        if (step >= infile.nsteps()) {
-            break;
+    // The list of bonds at each step is only needed by the outputs
+    bool keep_bonds = !options.outfile.empty() || stream;
+    // The autocorrelation and the lifetimes use the intervals of existence of
+    // each bond, using memory proportional to the number of times the bonds
+    // are formed instead of the number of steps
+    bool use_intervals = options.autocorrelation || !options.lifetimes_output.empty();
+    auto intervals = std::unordered_map<hbond, std::vector<interval>>();
+
+    // Find the hydrogen bonds at every step, with the threads reading small
+    // chunks of steps taken in order. A chunk is consumed as soon as all the
+    // previous chunks are done: its bonds are written to the outputs and
+    // released, and its intervals are merged with the ones from the previous
+    // chunks. A thread waits before starting a new chunk if too many chunks
+    // are already waiting to be consumed, to bound the memory used by the
+    // lists of bonds.
+    auto blocks = split_blocks(steps.size(), (steps.size() + CHUNK_STEPS - 1) / CHUNK_STEPS);
+    auto max_pending = 2 * options.threads;
+    auto block_bonds = std::vector<std::vector<std::vector<hbond>>>(blocks.size());
+    auto block_intervals = std::vector<std::unordered_map<hbond, std::vector<interval>>>(blocks.size());
+    auto block_done = std::vector<bool>(blocks.size(), false);
+    size_t next_block = 0;
+    bool failed = false;
+    std::mutex consume_mutex;
+    std::condition_variable consumed;
+    // Readers not currently used by a thread
+    auto idle_readers = std::vector<std::unique_ptr<bonds_reader>>();
+    auto consume = [&](size_t block) {
+        auto current = blocks[block].begin;
+        for (auto& bonds: block_bonds[block]) {
+            auto step = steps[current];
+            if (text) {
+                text->comment("step n_bonds");
+                text->row(step, bonds.size());
+                text->comment("Donnor Hydrogen Acceptor");
+                for (auto& bond: bonds) {
+                    text->row(bond.donor, bond.hydrogen, bond.acceptor);
+                }
+            } else if (!options.outfile.empty()) {
+                npy_steps.push_back(step);
+                npy_counts.push_back(bonds.size());
+                for (auto& bond: bonds) {
+                    npy_bonds.push_back(bond.donor);
+                    npy_bonds.push_back(bond.hydrogen);
+                    npy_bonds.push_back(bond.acceptor);
+                }
+            }
+            if (stream) {
+                stream->add(step, bonds);
+            }
+            current += 1;
         }
-        auto frame = infile.read_step(step);
-        if (options.guess_bonds) {
-            frame.guess_bonds();
+        block_bonds[block] = std::vector<std::vector<hbond>>();
+
+        for (auto& it: block_intervals[block]) {
+            auto& merged = intervals[it.first];
+            auto first = it.second.begin();
+            // join the intervals touching at the boundary between blocks
+            if (!merged.empty() && merged.back().end == first->start) {
+                merged.back().end = first->end;
+                ++first;
+            }
+            merged.insert(merged.end(), first, it.second.end());
         }
+        block_intervals[block] = std::unordered_map<hbond, std::vector<interval>>();
+    };
 
-        auto bonds = std::unordered_set<hbond>();
-        auto matched = donors.evaluate(frame);
-        if (matched.empty()) {
-            warn("no atom matching the donnor selection at step " + std::to_string(step));
-        }
+    auto find_bonds = [&](bonds_reader& reader, size_t block) {
+        auto& existence = block_intervals[block];
+        for (auto current=blocks[block].begin; current<blocks[block].end; current++) {
+            auto step = steps[current];
+            auto frame = reader.infile.read_step(step);
+            if (options.guess_bonds) {
+                frame.guess_bonds();
+            }
 
-        for (auto match: matched) {
-            assert(match.size() == 2);
+            auto bonds = std::vector<hbond>();
+            reader.distances.clear();
+            reader.angles.clear();
+            auto matched = reader.donors.evaluate(frame);
+            if (matched.empty()) {
+                static WarningSite NO_DONORS("no atom matching the donnor selection at step {}");
+                NO_DONORS.emit(step);
+            }
 
-            size_t donor = match[0];
-            size_t hydrogen = match[1];
+            auto& topology = frame.topology();
+            reader.is_hydrogen.resize(frame.size());
+            for (size_t i=0; i<frame.size(); i++) {
+                reader.is_hydrogen[i] = topology[i].type() == "H";
+            }
 
-            if (frame[hydrogen].type() != "H") {
-                warn_once(
-                    "the second atom in the donors selection might not be an "
-                    "hydrogen (expected type H, got type " + frame[hydrogen].type() + ")"
-                );
+            // Hydrogen atoms can not be acceptors
+            reader.acceptors_list = reader.acceptors.list(frame);
+            reader.acceptors_list.erase(std::remove_if(reader.acceptors_list.begin(), reader.acceptors_list.end(), [&](size_t i) {
+                return reader.is_hydrogen[i];
+            }), reader.acceptors_list.end());
+            if (reader.acceptors_list.empty()) {
+                static WarningSite NO_ACCEPTORS("no atom matching the acceptor selection at step {}");
+                NO_ACCEPTORS.emit(step);
             }
 
-            auto acceptors_list = acceptors.list(frame);
-            if (acceptors_list.empty()) {
-                warn("no atom matching the acceptor selection at step " + std::to_string(step));
+            // Group the matches by donor atom: the matches for the donor `i`
+            // are `by_donor[start[i]]` to `by_donor[start[i + 1]]` (excluded)
+            reader.start.assign(frame.size() + 1, 0);
+            for (auto& match: matched) {
+                assert(match.size() == 2);
+                reader.start[match[0] + 1] += 1;
+                if (!reader.is_hydrogen[match[1]]) {
+                    static WarningSite NOT_HYDROGEN(
+                        "the second atom in the donors selection might not be an "
+                        "hydrogen (expected type H, got type {})"
+                    );
+                    NOT_HYDROGEN.emit(topology[match[1]].type());
+                }
+            }
+            reader.donors_list.clear();
+            for (size_t i=0; i<frame.size(); i++) {
+                if (reader.start[i + 1] != 0) {
+                    reader.donors_list.push_back(i);
+                }
+                reader.start[i + 1] += reader.start[i];
+            }
+            reader.by_donor.resize(matched.size());
+            auto next = std::vector<size_t>(reader.start.begin(), reader.start.end() - 1);
+            for (size_t i=0; i<matched.size(); i++) {
+                reader.by_donor[next[matched[i][0]]++] = i;
             }
 
-            for (auto acceptor: acceptors_list) {
-                if (acceptor != donor && frame.topology()[acceptor].type() != "H") {
-                    auto distance = frame.distance(acceptor, donor);
+            // Only check the angle for the donor-acceptor pairs closer than
+            // the distance criterion, found with a cell list
+            reader.candidates.clear();
+            // the const overload of `positions` gives a vector instead of a span
+            const auto& positions = static_cast<const Frame&>(frame).positions();
+            auto neighbors = CellList(frame.cell(), positions, options.distance);
+            auto sorted_acceptors = neighbors.sort(reader.acceptors_list);
+            neighbors.foreach_pair(neighbors.sort(reader.donors_list), sorted_acceptors, [&](size_t donor, size_t acceptor, double distance) {
+                for (auto i=reader.start[donor]; i<reader.start[donor + 1]; i++) {
+                    auto hydrogen = matched[reader.by_donor[i]][1];
                     auto theta = frame.angle(acceptor, donor, hydrogen);
-                    if (distance < options.distance && theta < options.angle) {
-                        bonds.emplace(hbond{donor, hydrogen, acceptor});
-                        if (options.histogram) {
-                            histogram.insert(distance, theta * 180 / PI);
-                        }
+                    if (theta < options.angle) {
+                        reader.candidates.push_back(candidate{reader.by_donor[i], acceptor, distance, theta});
                     }
                 }
+            });
+
+            // Sort the bonds by donor selection match and then by acceptor,
+            // to get the same output regardless of the cell list order
+            std::sort(reader.candidates.begin(), reader.candidates.end(), [](const candidate& lhs, const candidate& rhs) {
+                return lhs.match < rhs.match || (lhs.match == rhs.match && lhs.acceptor < rhs.acceptor);
+            });
+            for (auto& bond: reader.candidates) {
+                auto& match = matched[bond.match];
+                bonds.emplace_back(hbond{match[0], match[1], bond.acceptor});
+                if (options.histogram) {
+                    reader.distances.push_back(bond.distance);
+                    reader.angles.push_back(bond.theta * 180 / PI);
+                }
+            }
+
+            if (options.histogram) {
+                reader.histogram.insert_many(reader.distances, reader.angles);
+            }
+
+            if (use_intervals) {
+                for (auto& bond: bonds) {
+                    add_existence(existence[bond], current);
+                }
+            }
+            if (keep_bonds) {
+                block_bonds[block].emplace_back(std::move(bonds));
             }
         }
+    };
 
-        fmt::print(outfile, "# step n_bonds\n");
-        fmt::print(outfile, "{} {}\n", step, bonds.size());
-        fmt::print(outfile, "# Donnor Hydrogen Acceptor\n", step);
-        for (auto& bond: bonds) {
-            fmt::print(outfile, "{} {} {}\n", bond.donor, bond.hydrogen, bond.acceptor);
+    parallel_for(blocks.size(), options.threads, [&](size_t block) {
+        auto reader = std::unique_ptr<bonds_reader>();
+        std::unique_lock<std::mutex> lock(consume_mutex);
+        consumed.wait(lock, [&]() {
+            return failed || block < next_block + max_pending;
+        });
+        if (failed) {
+            return;
         }
+        if (!idle_readers.empty()) {
+            reader = std::move(idle_readers.back());
+            idle_readers.pop_back();
+        }
+        lock.unlock();
 
-        if (options.histogram) {
-            auto max = *std::max_element(histogram.begin(), histogram.end());
-            histogram.normalize([max](size_t, double value) {
-                return value / max;
-            });
+        try {
+            if (!reader) {
+                reader.reset(new bonds_reader(options));
+            }
+            find_bonds(*reader, block);
+
+            lock.lock();
+            idle_readers.emplace_back(std::move(reader));
+            block_done[block] = true;
+            while (next_block < blocks.size() && block_done[next_block]) {
+                consume(next_block);
+                next_block += 1;
+            }
+        } catch (...) {
+            // wake up the threads waiting for this chunk to be consumed
+            if (!lock.owns_lock()) {
+                lock.lock();
+            }
+            failed = true;
+            consumed.notify_all();
+            throw;
+        }
+        consumed.notify_all();
+    });
+    auto used_steps = steps.size();
+
+    auto histograms = std::vector<Histogram<2, uint32_t>>();
+    for (auto& reader: idle_readers) {
+        histograms.emplace_back(std::move(reader->histogram));
+    }
+    idle_readers.clear();
+
+    if (stream) {
+        stream->close();
+    }
+
+    if (text) {
+        text->close();
+    } else if (!options.outfile.empty()) {
+        auto output = NpzWriter(options.outfile);
+        auto metadata = std::string();
+        for (auto& line: header) {
+            metadata += line + "\n";
+        }
+        output.add("metadata", metadata);
+        output.add("step", {npy_steps.size()}, npy_steps);
+        output.add("n_bonds", {npy_counts.size()}, npy_counts);
+        output.add("bonds", {npy_bonds.size() / 3, 3}, npy_bonds);
+        output.write();
+    }
+
+    if (options.histogram && !histograms.empty()) {
+        auto& histogram = histograms[0];
+        size_t out_of_bounds = histogram.out_of_bounds();
+        for (size_t block=1; block<histograms.size(); block++) {
+            for (size_t i=0; i<histogram.size(); i++) {
+                histogram[i] += histograms[block][i];
+            }
+            out_of_bounds += histograms[block].out_of_bounds();
+        }
+        if (out_of_bounds != 0) {
+            warn(fmt::format(
+                "{} hydrogen bonds were outside of the histogram boundaries and have been ignored",
+                out_of_bounds
+            ));
+        }
 
-            std::ofstream outhist(options.histogram_output, std::ios::out);
-            if (!outhist.is_open()) {
-                throw CFilesError("Could not open the '" + options.histogram_output + "' file.");
+        auto density = std::vector<double>(histogram.begin(), histogram.end());
+        auto max = *std::max_element(density.begin(), density.end());
+        if (max != 0) {
+            for (auto& value: density) {
+                value /= max;
             }
+        }
 
-            fmt::print(outhist, "# Hydrogen bonds density histogram in {}\n", options.trajectory);
-            fmt::print(outhist, "# Between '{}' and '{}'\n", options.acceptor_selection, options.donor_selection);
-            fmt::print(outhist, "# r theta density\n", options.acceptor_selection, options.donor_selection);
-
-            for (size_t i = 0; i < histogram.first().nbins; i++){
-                for (size_t j = 0; j < histogram.second().nbins; j++){
-                    fmt::print(
-                        outhist,
-                        "{} {} {}\n",
-                        histogram.first().coord(i),
-                        histogram.second().coord(j),
-                        histogram(i, j)
-                    );
+        auto r = std::vector<double>(histogram.first().nbins);
+        for (size_t i = 0; i < histogram.first().nbins; i++){
+            r[i] = histogram.first().coord(i);
+        }
+        auto theta = std::vector<double>(histogram.second().nbins);
+        for (size_t j = 0; j < histogram.second().nbins; j++){
+            theta[j] = histogram.second().coord(j);
+        }
+
+        auto output = ResultWriter(options.histogram_output, options.output_format);
+        output.comment("Hydrogen bonds density histogram in " + options.trajectory);
+        output.comment("Between '" + options.acceptor_selection + "' and '" + options.donor_selection + "'");
+        output.comment("r theta density");
+        output.grid("density", "r", std::move(r), "theta", std::move(theta), std::move(density));
+        output.write();
+    }
+
+    if (use_intervals && used_steps != 0 && intervals.empty()) {
+        warn("no hydrogen bond found in the trajectory");
+    }
+
+    if (options.autocorrelation && used_steps != 0 && options.correlator == Correlator::MultiTau) {
+        // Feed the existence of the bonds step by step to the correlator,
+        // adding a new series the first time a bond is formed
+        auto events = std::vector<std::pair<size_t, size_t>>();
+        auto first_start = std::vector<std::pair<size_t, const std::vector<interval>*>>();
+        for (auto& it: intervals) {
+            first_start.emplace_back(it.second.front().start, &it.second);
+        }
+        std::sort(first_start.begin(), first_start.end(), [](
+            const std::pair<size_t, const std::vector<interval>*>& lhs,
+            const std::pair<size_t, const std::vector<interval>*>& rhs
+        ) {
+            return lhs.first < rhs.first;
+        });
+        // events are (step, 2 * index) when a bond is formed, and
+        // (step, 2 * index + 1) when it is broken
+        for (size_t index=0; index<first_start.size(); index++) {
+            for (auto& existence: *first_start[index].second) {
+                events.emplace_back(existence.start, 2 * index);
+                events.emplace_back(existence.end, 2 * index + 1);
+            }
+        }
+        std::sort(events.begin(), events.end());
+
+        auto multitau = MultiTauCorrelator(0, 1, MultiTauCorrelator::Product);
+        auto existence = std::vector<double>();
+        auto event = events.begin();
+        for (size_t current=0; current<used_steps; current++) {
+            for (; event != events.end() && event->first == current; ++event) {
+                auto index = event->second / 2;
+                if (index >= multitau.nseries()) {
+                    // New bond, which did not exist in the previous steps
+                    multitau.add_series(index + 1 - multitau.nseries());
+                    existence.resize(multitau.nseries(), 0.0);
                 }
+                existence[index] = event->second % 2 == 0 ? 1.0 : 0.0;
             }
+            multitau.add(existence);
         }
+        events = std::vector<std::pair<size_t, size_t>>();
 
-        if (options.autocorrelation) {
-            for (auto& bond: bonds) {
-                auto it = existing_bonds.find(bond);
-                if (it == existing_bonds.end()) {
-                    // New bond. Insert it and pad with zeros
-                    auto pair = existing_bonds.emplace(bond, std::vector<float>(used_steps, 0.0));
-                    pair.first->second.push_back(1.0);
-                } else {
-                    // Already seen this bond, add a single 1
-                    it->second.push_back(1.0);
-                }
+        auto lags = multitau.lags();
+        auto correlation = multitau.correlation();
+
+        auto times = std::vector<uint64_t>();
+        auto values = std::vector<double>();
+        auto norm = correlation[0];
+        for (size_t i=0; i<lags.size(); i++) {
+            auto time = lags[i] * options.steps.stride();
+            if (options.max_lag != 0 && time > options.max_lag) {
+                break;
             }
-            // Add 0 to all bonds we did not see in this frame
-            for (auto& it: existing_bonds) {
-                if (it.second.size() != used_steps + 1) {
-                    it.second.push_back(0.0);
+            times.push_back(time);
+            values.push_back(norm == 0 ? 0.0 : correlation[i] / norm);
+        }
+
+        auto output = ResultWriter(options.autocorr_output, options.output_format);
+        output.comment("Auto correlation between H-bonds existence");
+        output.comment("step value");
+        output.column("step", std::move(times));
+        output.column("autocorrelation", std::move(values));
+        output.write();
+    } else if (options.autocorrelation && used_steps != 0) {
+        auto lags = correlation_lags(used_steps, options.steps.stride(), options.max_lag);
+        if (lags == 0) {
+            warn("not enough steps to compute the autocorrelation of hydrogen bonds");
+        } else {
+            auto correlation = existence_correlation(intervals, lags);
+
+            // Average over all time origins, and normalize by the value at 0
+            auto times = std::vector<uint64_t>(lags);
+            auto values = std::vector<double>(lags, 0.0);
+            auto norm = correlation[0] / static_cast<double>(used_steps);
+            for (size_t i=0; i<lags; i++) {
+                times[i] = i * options.steps.stride();
+                if (norm != 0) {
+                    values[i] = correlation[i] / static_cast<double>(used_steps - i) / norm;
                 }
             }
+
+            auto output = ResultWriter(options.autocorr_output, options.output_format);
+            output.comment("Auto correlation between H-bonds existence");
+            output.comment("step value");
+            output.column("step", std::move(times));
+            output.column("autocorrelation", std::move(values));
+            output.write();
         }
-        used_steps += 1;
     }
 
-    if (options.autocorrelation && used_steps != 0) {
-        // Compute the autocorrelation for all bonds and average them
-        auto correlator = Autocorrelation(used_steps);
-        for (auto&& it: std::move(existing_bonds)) {
-            correlator.add_timeserie(std::move(it.second));
-        }
-        correlator.normalize();
-        auto& correlation = correlator.get_result();
+    if (!options.lifetimes_output.empty() && used_steps != 0) {
+        auto lags = correlation_lags(used_steps, options.steps.stride(), options.max_lag);
+        if (lags == 0) {
+            warn("not enough steps to compute the lifetimes of hydrogen bonds");
+        } else {
+            // Number of intervals with a given length, and lengths of the
+            // intervals fully inside the trajectory
+            auto lengths = std::vector<uint64_t>(used_steps + 1, 0);
+            auto complete = std::vector<uint64_t>(lags, 0);
+            uint64_t n_complete = 0;
+            uint64_t complete_sum = 0;
+            for (auto& it: intervals) {
+                for (auto& existence: it.second) {
+                    auto length = existence.end - existence.start;
+                    lengths[length] += 1;
+                    if (existence.start != 0 && existence.end != used_steps) {
+                        n_complete += 1;
+                        complete_sum += length;
+                        if (length < lags) {
+                            complete[length] += 1;
+                        }
+                    }
+                }
+            }
 
-        std::ofstream outcorr(options.autocorr_output, std::ios::out);
-        if (!outcorr.is_open()) {
-            throw CFilesError("Could not open the '" + options.autocorr_output + "' file.");
-        }
-        fmt::print(outcorr, "# Auto correlation between H-bonds existence\n");
-        fmt::print(outcorr, "# step value\n");
+            // The survival probability is the continuous correlation of the
+            // existence: for each lag, the number of time origins where a bond
+            // exists and continues to exist until `origin + lag`, i.e. the sum of
+            // `length - lag` over all intervals longer than `lag`
+            auto survival = std::vector<double>(lags);
+            uint64_t longer_count = 0;
+            uint64_t longer_sum = 0;
+            for (size_t length=used_steps; length>0; length--) {
+                longer_count += lengths[length];
+                longer_sum += length * lengths[length];
+                // all the intervals longer than `lag` are counted
+                auto lag = length - 1;
+                if (lag < lags) {
+                    auto origins = longer_sum - lag * longer_count;
+                    survival[lag] = static_cast<double>(origins) / static_cast<double>(used_steps - lag);
+                }
+            }
 
-        auto norm = correlation[0];
-        for (size_t i=0; i<correlation.size() / 2; i++) {
-            fmt::print(outcorr, "{} {}\n", i * options.steps.stride(), correlation[i] / norm);
+            auto times = std::vector<uint64_t>(lags);
+            auto lifetimes = std::vector<double>(lags, 0.0);
+            auto norm = survival[0];
+            for (size_t i=0; i<lags; i++) {
+                times[i] = i * options.steps.stride();
+                if (norm != 0) {
+                    survival[i] /= norm;
+                }
+                if (n_complete != 0) {
+                    lifetimes[i] = static_cast<double>(complete[i]) / static_cast<double>(n_complete);
+                }
+            }
+
+            auto output = ResultWriter(options.lifetimes_output, options.output_format);
+            output.comment("Survival probability and continuous lifetimes of H-bonds");
+            output.comment("lifetimes is the fraction of the bonds formed and broken during the trajectory which existed for step");
+            if (n_complete != 0) {
+                auto mean = static_cast<double>(complete_sum * options.steps.stride()) / static_cast<double>(n_complete);
+                output.comment(fmt::format("Mean lifetime: {:.8g} steps, from {} bonds", mean, n_complete));
+            }
+            output.comment("step survival lifetimes");
+            output.column("step", std::move(times));
+            output.column("survival", std::move(survival));
+            output.column("lifetimes", std::move(lifetimes));
+            output.write();
         }
     }
 
@@ -6,7 +6,9 @@
 
 #include <chemfiles.hpp>
 
+#include "Autocorrelation.hpp"
 #include "Command.hpp"
+#include "Output.hpp"
 #include "utils.hpp"
 
 class HBonds final: public Command {
@@ -28,12 +30,18 @@ public:
         std::string topology_format;
         /// Should we try to guess the topology?
         bool guess_bonds = false;
-        /// HBonds output
+        /// HBonds output, empty when only writing the binary stream
         std::string outfile;
+        /// Binary stream of the hydrogen bonds at each step, empty if not
+        /// writing it
+        std::string bonds_output;
         /// Should we compute the autocorrelation
         bool autocorrelation = false;
         /// Autocorrelation output
         std::string autocorr_output;
+        /// Survival probability and lifetimes output, empty if not computing
+        /// them
+        std::string lifetimes_output;
         /// Should we compute the hydrogen bonds histogram
         bool histogram = false;
         /// Autocorrelation output
@@ -48,6 +56,16 @@ public:
         double angle;
         /// If computing the histogram, how many points should it have
         size_t npoints;
+        /// Number of threads to use when reading the trajectory and computing
+        /// correlations, 0 to use all available cores
+        size_t threads = 0;
+        /// Maximal time lag for correlations, in steps of the trajectory. 0
+        /// to use half of the steps
+        size_t max_lag = 0;
+        /// Algorithm used to compute correlations
+        Correlator correlator = Correlator::FFT;
+        /// Format to use for the output files
+        OutputFormat output_format = OutputFormat::Text;
     };
 
     HBonds() {}
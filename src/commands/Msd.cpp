@@ -2,14 +2,19 @@
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
 #include <docopt/docopt.h>
-#include <fstream>
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <numeric>
 
 #include <fmt/format.h>
-#include <fmt/ostream.h>
 
 #include "Msd.hpp"
 #include "Autocorrelation.hpp"
+#include "MultiTau.hpp"
+#include "Parallel.hpp"
+#include "ScratchStore.hpp"
 #include "Errors.hpp"
 #include "utils.hpp"
 #include "warnings.hpp"
@@ -23,19 +28,23 @@ can be used to extract diffusion coefficient D for movement in d dimensions:
     <[r(t) - r(0)]^2> = 2 * d * D * t
 
 Usage:
-  cfiles msd [options] <trajectory>
+  cfiles msd [options] <trajectory> [--selection=<sel>...]
   cfiles msd (-h | --help)
 
 Examples:
   cfiles msd file.pdb -o msd.dat
   cfiles msd water.xyz --cell 15:15:25 --unwrap
   cfiles msd trajectory.nc --topology topol.pdb --selection "name Li"
+  cfiles msd electrolyte.nc --selection "type Li" --selection "type P"
 
 Options:
   -h --help                     show this help
   -o <file>, --output=<file>    write result to <file>. This default to the
                                 trajectory file name with the `.msd.dat`
-                                extension.
+                                extension, or `.msd.npz` for NumPy output.
+  --output-format=<fmt>         format of the output file, either `text` for a
+                                plain text file or `npy` for a NumPy `.npz`
+                                archive [default: text]
   --format=<format>             force the input file format to be <format>
   -t <path>, --topology=<path>  alternative topology file for the input
   --topology-format=<format>    use <format> as format for the topology file
@@ -51,10 +60,42 @@ Options:
                                 <stride>. The default values are 0 for <start>,
                                 the number of steps for <end> and 1 for
                                 <stride>.
+  --threads=<n>                 number of threads to use when reading the
+                                trajectory and computing the correlations.
+                                This default to the number of available
+                                cores.
+  --scratch=<dir>               store the time series used for correlations
+                                in a temporary file inside <dir> instead of
+                                memory. This allows to analyse trajectories
+                                larger than the available memory.
+  --max-lag=<lag>               maximal time lag, in steps of the trajectory,
+                                for which to compute the correlations. This
+                                default to half of the used steps. Computing
+                                only short time lags is faster and uses less
+                                memory.
+  --correlator=<algo>           algorithm used to compute the correlations.
+                                `fft` computes all the time lags from the full
+                                time series, `multitau` computes
+                                logarithmically spaced time lags while reading
+                                the trajectory, using much less memory.
+                                [default: fft]
+  --fft-planning=<mode>         how much time to spend optimizing the FFT
+                                used for correlations, one of `estimate`,
+                                `measure` or `patient`. This is only used when
+                                cfiles is built with FFTW. [default: estimate]
+  --fft-wisdom=<path>           load FFTW wisdom (previously optimized FFT
+                                plans) from <path> before computing the
+                                correlations, and save the updated wisdom to
+                                <path> afterward. This is only used when cfiles
+                                is built with FFTW.
   --selection=<sel>             selection of atoms to use when computing the
                                 mean square distance. The selection should
                                 always return the same atoms in the same order.
-                                [default: all]
+                                This option can be repeated to compute the
+                                mean square distance of multiple groups of
+                                atoms from a single pass over the trajectory,
+                                the index of the selection is then added to the
+                                output file name. The default is "all".
   --unwrap                      undo periodic boundary condition wrapping,
                                 placing atoms back outside of the box
 )";
@@ -69,12 +110,36 @@ static MSD::Options parse_options(int argc, const char* argv[]) {
     options.trajectory = args.at("<trajectory>").asString();
     options.guess_bonds = args.at("--guess-bonds").asBool();
 
-    options.selection = args.at("--selection").asString();
+    options.selections = args.at("--selection").asStringList();
+    if (options.selections.empty()) {
+        options.selections.emplace_back("all");
+    }
 
+    options.output_format = parse_output_format(args.at("--output-format").asString());
     if (args.at("--output")) {
         options.outfile = args.at("--output").asString();
     } else {
-        options.outfile = options.trajectory + ".msd.dat";
+        options.outfile = options.trajectory + ".msd" + output_extension(options.output_format);
+    }
+
+    if (args.at("--threads")) {
+        options.threads = parse_threads(args.at("--threads").asString());
+    } else {
+        options.threads = default_threads();
+    }
+
+    if (args.at("--scratch")) {
+        options.scratch = args.at("--scratch").asString();
+    }
+
+    if (args.at("--max-lag")) {
+        options.max_lag = parse_max_lag(args.at("--max-lag").asString());
+    }
+
+    options.correlator = parse_correlator(args.at("--correlator").asString());
+    options.fft_planning = parse_fft_planning(args.at("--fft-planning").asString());
+    if (args.at("--fft-wisdom")) {
+        options.fft_wisdom = args.at("--fft-wisdom").asString();
     }
 
     if (args.at("--steps")) {
@@ -109,25 +174,7 @@ static MSD::Options parse_options(int argc, const char* argv[]) {
     return options;
 }
 
-std::string MSD::description() const {
-    return "compute average mean square distance for a group of atoms";
-}
-
-int MSD::run(int argc, const char* argv[]) {
-    auto options = parse_options(argc, argv);
-
-    auto selection = Selection(options.selection);
-    if (selection.size() != 1) {
-        throw CFilesError("Can not use a selection with size larger than 1.");
-    }
-
-    std::ofstream outfile(options.outfile, std::ios::out);
-    if (!outfile.is_open()) {
-        throw CFilesError("Could not open the '" + options.outfile + "' file.");
-    }
-    fmt::print(outfile, "# Mean Square Deviation in {}\n", options.trajectory);
-    fmt::print(outfile, "# For atoms '{}'\n", options.selection);
-
+static Trajectory open_trajectory(const MSD::Options& options) {
     auto trajectory = Trajectory(options.trajectory, 'r', options.format);
     if (options.custom_cell) {
         trajectory.set_cell(options.cell);
@@ -137,142 +184,437 @@ int MSD::run(int argc, const char* argv[]) {
         trajectory.set_topology(options.topology, options.topology_format);
     }
 
-    // Pre-allocate memory to store the positions of each atom at each time step
-    auto frame = trajectory.read_step(options.steps.first());
+    return trajectory;
+}
+
+/// Create the selections for all the groups of atoms
+static std::vector<Selection> create_selections(const MSD::Options& options) {
+    auto selections = std::vector<Selection>();
+    for (auto& string: options.selections) {
+        auto selection = Selection(string);
+        if (selection.size() != 1) {
+            throw CFilesError("Can not use a selection with size larger than 1.");
+        }
+        selections.emplace_back(std::move(selection));
+    }
+    return selections;
+}
+
+/// Maximal number of steps in the chunks read by the threads
+static const size_t CHUNK_STEPS = 256;
+/// Maximal memory used to buffer the positions in a chunk of steps
+static const size_t CHUNK_MEMORY = 64 * 1024 * 1024;
+
+/// Trajectory, selections and buffers used by a thread to read the positions
+/// in successive chunks of steps
+struct positions_reader {
+    explicit positions_reader(const MSD::Options& options, size_t natoms):
+        trajectory(open_trajectory(options)),
+        selections(create_selections(options)),
+        first(natoms),
+        fractional(natoms),
+        current(natoms),
+        shifts(natoms)
+    {}
+
+    Trajectory trajectory;
+    std::vector<Selection> selections;
+    /// Unwrapped fractional coordinates at the first and at the last step of
+    /// the current chunk
+    std::vector<Vector3D> first;
+    std::vector<Vector3D> fractional;
+    /// Positions at the current step
+    std::vector<Vector3D> current;
+    /// Positions at all the steps of the current chunk, indexed by
+    /// `step * natoms + atom`
+    std::vector<Vector3D> positions;
+    /// Unit cell at all the steps of the current chunk
+    std::vector<Matrix3D> cells;
+    /// Integer number of cells to add to the fractional coordinates of the
+    /// atoms in the current chunk
+    std::vector<Vector3D> shifts;
+};
+
+/// Read the positions of the atoms matching all the `selections` at the given
+/// `step` in `positions`, one selection after the other. The number of atoms
+/// matched by the selection `i` must be `natoms[i]`, and the total number of
+/// matched atoms `positions.size()`.
+///
+/// When unwrapping, the positions are unwrapped with respect to the previous
+/// fractional positions stored in `fractional`, unless this is the `first`
+/// step. `fractional` is then updated with the current fractional positions.
+///
+/// This function returns the unit cell matrix of the frame.
+static Matrix3D read_positions(const MSD::Options& options, Trajectory& trajectory, size_t step, std::vector<Selection>& selections, const std::vector<size_t>& natoms, bool first, std::vector<Vector3D>& fractional, std::vector<Vector3D>& positions) {
+    auto frame = trajectory.read_step(step);
     if (options.guess_bonds) {
         frame.guess_bonds();
     }
-    auto natoms = selection.list(frame).size();
-    auto nsteps = options.steps.count(trajectory.nsteps());
-
-    auto positions = std::vector<std::array<std::vector<float>, 3>>(natoms);
-    for (size_t atom=0; atom<natoms; atom++) {
-        positions[atom][0] = std::vector<float>(nsteps, 0.0);
-        positions[atom][1] = std::vector<float>(nsteps, 0.0);
-        positions[atom][2] = std::vector<float>(nsteps, 0.0);
-    }
-
-    // First, extract all the positions we need
-    size_t current_step = 0;
-    auto previous_frame = std::move(frame);
-    for (auto step: options.steps) {
-        if (step >= trajectory.nsteps()) {
-            break;
-        }
-        auto frame = trajectory.read_step(step);
-        if (options.guess_bonds) {
-            frame.guess_bonds();
-        }
 
-        auto matched = selection.list(frame);
-        if (matched.size() != natoms) {
+    auto matched = std::vector<size_t>();
+    matched.reserve(positions.size());
+    for (size_t i=0; i<selections.size(); i++) {
+        auto group = selections[i].list(frame);
+        if (group.size() != natoms[i]) {
             throw CFilesError(fmt::format(
                 "the number of atoms matched by '{}' changed from {} to {} since the first step",
-                options.selection, natoms, matched.size()
+                options.selections[i], natoms[i], group.size()
             ));
         }
+        matched.insert(matched.end(), group.begin(), group.end());
+    }
 
-        auto current_positions = frame.positions();
-        auto previous_positions = previous_frame.positions();
+    auto cell = frame.cell().matrix();
+    auto cell_inv = Matrix3D::unit();
+    if (options.unwrap) {
+        if (frame.cell().shape() == UnitCell::INFINITE) {
+            throw CFilesError("can not unwrap in infinite unit cell");
+        }
+        cell_inv = cell.invert();
+    } else {
+        if (frame.cell().shape() != UnitCell::INFINITE) {
+            static WarningSite NO_UNWRAP(
+                "Periodic Boundary Conditions seems to be used, but --unwrap was not given. "
+                "If you get strange results, try again with --unwrap."
+            );
+            NO_UNWRAP.emit();
+        }
+    }
 
-        auto cell = frame.cell().matrix();
-        auto prev_cell = previous_frame.cell().matrix();
-        auto cell_inv = cell;
-        auto prev_cell_inv = prev_cell;
+    auto current_positions = frame.positions();
+    for (size_t atom=0; atom<positions.size(); atom++) {
+        auto current = current_positions[matched[atom]];
 
         if (options.unwrap) {
-            if (frame.cell().shape() == UnitCell::INFINITE) {
-                throw CFilesError("can not unwrap in infinite unit cell");
-            }
-            cell_inv = cell.invert();
-            prev_cell_inv = prev_cell.invert();
-        } else {
-            if (frame.cell().shape() != UnitCell::INFINITE) {
-                warn_once(
-                    "Periodic Boundary Conditions seems to be used, but --unwrap was not given. "
-                    "If you get strange results, try again with --unwrap."
-                );
+            auto curr_frac = cell_inv * current;
+            if (!first) {
+                auto delta = curr_frac - fractional[atom];
+
+                delta[0] -= round(delta[0]);
+                delta[1] -= round(delta[1]);
+                delta[2] -= round(delta[2]);
+
+                curr_frac = fractional[atom] + delta;
             }
+            fractional[atom] = curr_frac;
+            current = cell * curr_frac;
         }
 
-        for (size_t atom=0; atom<natoms; atom++) {
-            auto& current = current_positions[matched[atom]];
+        positions[atom] = current;
+    }
+
+    return cell;
+}
 
-            if (options.unwrap) {
-                auto curr_frac = cell_inv * current;
-                auto prev_frac = prev_cell_inv * previous_positions[matched[atom]];
-                auto delta = curr_frac - prev_frac;
+/// Number of atoms in the chunks used by `squared_positions_term`
+static const size_t ATOMS_CHUNK = 64;
+
+/// Compute the <r(t)^2 + r(0)^2> term of the MSD, averaged over time origins
+/// and summed over the `natoms` atoms starting at `first_atom` in `positions`,
+/// for the first `lags` lags. The atoms are processed
+/// in chunks of `ATOMS_CHUNK` atoms, using up to `nthreads` threads. The
+/// contributions of the chunks are added to the result in order, so the
+/// result does not depend on the number of threads.
+static std::vector<double> squared_positions_term(const ScratchStore& positions, size_t first_atom, size_t natoms, size_t lags, size_t nthreads) {
+    auto nsteps = positions.length();
+    auto nchunks = (natoms + ATOMS_CHUNK - 1) / ATOMS_CHUNK;
+    if (nthreads == 0) {
+        nthreads = default_threads();
+    }
+    nthreads = std::max<size_t>(std::min(nthreads, nchunks), 1);
 
-                delta[0] -= round(delta[0]);
-                delta[1] -= round(delta[1]);
-                delta[2] -= round(delta[2]);
+    auto result = std::vector<double>(lags, 0.0);
+    if (lags == 0) {
+        return result;
+    }
 
-                current = cell * (prev_frac + delta);
+    // Sum of the contributions of one chunk, and squared positions of one
+    // atom for each thread
+    auto partials = std::vector<std::vector<double>>(nthreads, std::vector<double>(lags));
+    auto rsqs = std::vector<std::vector<double>>(nthreads, std::vector<double>(nsteps));
+    for (size_t round=0; round<nchunks; round+=nthreads) {
+        auto nworkers = std::min(nthreads, nchunks - round);
+        parallel_for(nworkers, nworkers, [&](size_t worker) {
+            auto& partial = partials[worker];
+            auto& rsq = rsqs[worker];
+            std::fill(partial.begin(), partial.end(), 0.0);
+
+            auto first = first_atom + (round + worker) * ATOMS_CHUNK;
+            auto last = std::min(first + ATOMS_CHUNK, first_atom + natoms);
+            for (auto atom=first; atom<last; atom++) {
+                auto x = positions.serie(3 * atom + 0);
+                auto y = positions.serie(3 * atom + 1);
+                auto z = positions.serie(3 * atom + 2);
+                for (size_t step=0; step<nsteps; step++) {
+                    auto xx = x[step] * x[step];
+                    auto yy = y[step] * y[step];
+                    auto zz = z[step] * z[step];
+
+                    rsq[step] = xx + yy + zz;
+                }
+
+                auto sum_rsq = 2 * std::accumulate(rsq.begin(), rsq.end(), 0.0);
+                partial[0] += sum_rsq;
+
+                double cum_sum = 0;
+                double cum_sum_reverse = 0;
+                for (size_t step=1; step<lags; step++) {
+                    cum_sum += rsq[step - 1];
+                    cum_sum_reverse += rsq[nsteps - step];
+                    partial[step] += (sum_rsq - cum_sum - cum_sum_reverse) / (nsteps - step);
+                }
             }
+        });
 
-            positions[atom][0][current_step] = current[0];
-            positions[atom][1][current_step] = current[1];
-            positions[atom][2][current_step] = current[2];
+        for (size_t worker=0; worker<nworkers; worker++) {
+            auto& partial = partials[worker];
+            for (size_t step=0; step<lags; step++) {
+                result[step] += partial[step];
+            }
         }
+    }
+    return result;
+}
+
+static void write_msd(const MSD::Options& options, size_t selection, std::vector<uint64_t> times, std::vector<double> values) {
+    auto path = selection_output_path(options.outfile, selection, options.selections.size());
+    auto output = ResultWriter(path, options.output_format);
+    output.comment("Mean Square Deviation in " + options.trajectory);
+    output.comment("For atoms '" + options.selections[selection] + "'");
+    output.column("step", std::move(times));
+    output.column("msd", std::move(values));
+    output.write();
+}
+
+std::string MSD::description() const {
+    return "compute average mean square distance for a group of atoms";
+}
+
+int MSD::run(int argc, const char* argv[]) {
+    auto options = parse_options(argc, argv);
 
-        current_step++;
-        previous_frame = std::move(frame);
+    auto selections = create_selections(options);
+    auto trajectory = open_trajectory(options);
+
+    // Pre-allocate memory to store the positions of each atom at each time
+    // step. The atoms of all the selections are stored one selection after
+    // the other, the atoms of the selection `i` starting at `first_atoms[i]`.
+    auto frame = trajectory.read_step(options.steps.first());
+    if (options.guess_bonds) {
+        frame.guess_bonds();
+    }
+    auto natoms = std::vector<size_t>();
+    auto first_atoms = std::vector<size_t>();
+    size_t total_atoms = 0;
+    for (auto& selection: selections) {
+        first_atoms.push_back(total_atoms);
+        natoms.push_back(selection.list(frame).size());
+        total_atoms += natoms.back();
+    }
+    auto steps = options.steps.list(trajectory.nsteps());
+    auto nsteps = steps.size();
+    if (nsteps == 0) {
+        warn("no step to use in the trajectory");
+        for (size_t group=0; group<selections.size(); group++) {
+            write_msd(options, group, {}, {});
+        }
+        return 0;
     }
 
+    if (options.correlator == Correlator::MultiTau) {
+        // Compute the MSD while reading the trajectory, without storing the
+        // positions. The multiple-tau correlator averages the positions over
+        // increasingly long blocks of steps, which is a good approximation of
+        // the MSD at long times.
+        auto correlators = std::vector<MultiTauCorrelator>();
+        for (auto count: natoms) {
+            correlators.emplace_back(count, 3, MultiTauCorrelator::SquaredDifference);
+        }
+        auto fractional = std::vector<Vector3D>(total_atoms);
+        auto current = std::vector<Vector3D>(total_atoms);
+        auto values = std::vector<double>();
+        for (size_t step=0; step<nsteps; step++) {
+            read_positions(options, trajectory, steps[step], selections, natoms, step == 0, fractional, current);
+            for (size_t group=0; group<selections.size(); group++) {
+                values.resize(3 * natoms[group]);
+                for (size_t atom=0; atom<natoms[group]; atom++) {
+                    auto& position = current[first_atoms[group] + atom];
+                    values[3 * atom + 0] = position[0];
+                    values[3 * atom + 1] = position[1];
+                    values[3 * atom + 2] = position[2];
+                }
+                correlators[group].add(values);
+            }
+        }
+
+        for (size_t group=0; group<selections.size(); group++) {
+            auto lags = correlators[group].lags();
+            auto msd = correlators[group].correlation();
+            auto times = std::vector<uint64_t>();
+            auto values_out = std::vector<double>();
+            for (size_t i=0; i<lags.size(); i++) {
+                if (options.max_lag != 0 && lags[i] * options.steps.stride() > options.max_lag) {
+                    break;
+                }
+                // the MSD at lag 0 is always zero
+                if (lags[i] != 0) {
+                    times.push_back(lags[i] * options.steps.stride());
+                    values_out.push_back(msd[i]);
+                }
+            }
+            write_msd(options, group, std::move(times), std::move(values_out));
+        }
+        return 0;
+    }
+
+    // The positions are stored with one time serie for each atom and
+    // dimension, at index `3 * atom + dimension`
+    auto positions = ScratchStore(3 * total_atoms, nsteps, options.scratch);
+
+    // First, extract all the positions we need. The threads read small chunks
+    // of steps taken in order, and unwrap the positions inside a chunk starting
+    // from the wrapped positions. The unwrapped fractional coordinates of an
+    // atom in a chunk are then shifted by a constant integer vector with
+    // respect to the ones we would get by unwrapping the whole trajectory at
+    // once. This shift is found from the last step of the previous chunk when
+    // it is known, and added to the positions before storing them. The
+    // chunks do not depend on the number of threads, and neither do the
+    // results.
+    auto chunk_steps = CHUNK_MEMORY / (std::max<size_t>(total_atoms, 1) * sizeof(Vector3D));
+    chunk_steps = std::max<size_t>(std::min(chunk_steps, CHUNK_STEPS), 1);
+    auto blocks = split_blocks(nsteps, (nsteps + chunk_steps - 1) / chunk_steps);
+    // Unwrapped fractional coordinates at the last step of the chunk before
+    // `next_block`
+    auto previous = std::vector<Vector3D>(total_atoms);
+    size_t next_block = 0;
+    bool failed = false;
+    std::mutex shift_mutex;
+    std::condition_variable shifted;
+    // Readers not currently used by a thread
+    auto idle_readers = std::vector<std::unique_ptr<positions_reader>>();
+    parallel_for(blocks.size(), options.threads, [&](size_t block) {
+        auto reader = std::unique_ptr<positions_reader>();
+        std::unique_lock<std::mutex> lock(shift_mutex);
+        if (!idle_readers.empty()) {
+            reader = std::move(idle_readers.back());
+            idle_readers.pop_back();
+        }
+        lock.unlock();
+
+        try {
+            if (!reader) {
+                reader.reset(new positions_reader(options, total_atoms));
+            }
+
+            auto size = blocks[block].size();
+            reader->positions.resize(size * total_atoms);
+            reader->cells.resize(size, Matrix3D::zero());
+            for (size_t i=0; i<size; i++) {
+                auto step = steps[blocks[block].begin + i];
+                reader->cells[i] = read_positions(options, reader->trajectory, step, reader->selections, natoms, i == 0, reader->fractional, reader->current);
+                std::copy(reader->current.begin(), reader->current.end(), reader->positions.begin() + static_cast<std::ptrdiff_t>(i * total_atoms));
+                if (i == 0) {
+                    reader->first = reader->fractional;
+                }
+            }
+
+            // wait for the previous chunk to find the shifts of this one
+            lock.lock();
+            shifted.wait(lock, [&]() {
+                return failed || next_block == block;
+            });
+            if (failed) {
+                return;
+            }
+            for (size_t atom=0; atom<total_atoms; atom++) {
+                auto shift = Vector3D(0, 0, 0);
+                if (options.unwrap && block != 0) {
+                    auto delta = reader->first[atom] - previous[atom];
+                    delta[0] -= round(delta[0]);
+                    delta[1] -= round(delta[1]);
+                    delta[2] -= round(delta[2]);
+
+                    shift = previous[atom] + delta - reader->first[atom];
+                    shift[0] = round(shift[0]);
+                    shift[1] = round(shift[1]);
+                    shift[2] = round(shift[2]);
+                }
+                reader->shifts[atom] = shift;
+                previous[atom] = reader->fractional[atom] + shift;
+            }
+            next_block += 1;
+            lock.unlock();
+            shifted.notify_all();
+
+            ScratchStore::Writer writer(positions, blocks[block].begin);
+            for (size_t i=0; i<size; i++) {
+                auto values = writer.next();
+                for (size_t atom=0; atom<total_atoms; atom++) {
+                    auto position = reader->positions[i * total_atoms + atom];
+                    if (options.unwrap) {
+                        position = position + reader->cells[i] * reader->shifts[atom];
+                    }
+                    values[3 * atom + 0] = static_cast<float>(position[0]);
+                    values[3 * atom + 1] = static_cast<float>(position[1]);
+                    values[3 * atom + 2] = static_cast<float>(position[2]);
+                }
+            }
+            writer.flush();
+
+            lock.lock();
+            idle_readers.emplace_back(std::move(reader));
+        } catch (...) {
+            // wake up the threads waiting for this chunk
+            if (!lock.owns_lock()) {
+                lock.lock();
+            }
+            failed = true;
+            shifted.notify_all();
+            throw;
+        }
+    });
+    idle_readers.clear();
+
     // We want to compute <[r(t) - r(0)]^2> where <...> denotes average on the
     // time origins and on the atoms. To do so, we separate the above expression
     // into <r(t)^2 + r(0)^2> - 2 <r(t) * r(0)>. The two first terms can be
     // computed directly, and the last one through the autocorrelation
     // framework.
-    auto msd = std::vector<double>(nsteps, 0.0);
-
-    // Start with the <r(t)^2 + r(0)^2> term
-    for (size_t atom=0; atom<natoms; atom++) {
-        auto rsq = std::vector<double>(nsteps, 0.0);
-        for (size_t step=0; step<nsteps; step++) {
-            auto xx = positions[atom][0][step] * positions[atom][0][step];
-            auto yy = positions[atom][1][step] * positions[atom][1][step];
-            auto zz = positions[atom][2][step] * positions[atom][2][step];
-
-            rsq[step] = xx + yy + zz;
+    auto lags = correlation_lags(nsteps, options.steps.stride(), options.max_lag);
+    load_fft_wisdom(options.fft_wisdom);
+    for (size_t group=0; group<selections.size(); group++) {
+        // Start with the <r(t)^2 + r(0)^2> term
+        auto msd = squared_positions_term(positions, first_atoms[group], natoms[group], lags, options.threads);
+        for (size_t step=0; step<lags; step++) {
+            msd[step] /= natoms[group];
         }
 
-        auto sum_rsq = 2 * std::accumulate(rsq.begin(), rsq.end(), 0.0);
-        msd[0] += sum_rsq;
-
-        double cum_sum = 0;
-        double cum_sum_reverse = 0;
-        for (size_t step=1; step<nsteps; step++) {
-            cum_sum += rsq[step - 1];
-            cum_sum_reverse += rsq[nsteps - step];
-            msd[step] += (sum_rsq - cum_sum - cum_sum_reverse) / (nsteps - step);
+        // compute the autocorrelation part
+        auto correlation = Autocorrelation(nsteps, options.fft_planning, lags);
+        correlation.add_timeseries(3 * natoms[group], options.threads, [&](size_t i, float* data) {
+            auto serie = positions.serie(3 * first_atoms[group] + i);
+            std::copy(serie, serie + nsteps, data);
+        });
+        correlation.normalize();
+
+        auto& correlated = correlation.get_result();
+        for (size_t step=1; step<lags; step++) {
+            // the factor 3 is here because the correlation was normalized by
+            // 3 * natoms (the total number of time series it got), but we
+            // need it normalized by natoms only.
+            msd[step] += -2 * 3 * correlated[step];
         }
-    }
-
-    for (size_t step=0; step<nsteps; step++) {
-        msd[step] /= natoms;
-    }
 
-    // compute the autocorrelation part
-    auto correlation = Autocorrelation(nsteps);
-    for (size_t atom=0; atom<natoms; atom++) {
-        correlation.add_timeserie(std::move(positions[atom][0]));
-        correlation.add_timeserie(std::move(positions[atom][1]));
-        correlation.add_timeserie(std::move(positions[atom][2]));
-    }
-    correlation.normalize();
-
-    auto& correlated = correlation.get_result();
-    for (size_t step=1; step<nsteps; step++) {
-        // the factor 3 is here because the correlation was normalized by
-        // 3 * natoms (the total number of time series it got), but we need it
-        // normalized by natoms only.
-        msd[step] += -2 * 3 * correlated[step];
-    }
+        auto times = std::vector<uint64_t>();
+        auto values = std::vector<double>();
+        for (size_t step=1; step<lags; step++) {
+            times.push_back(step * options.steps.stride());
+            values.push_back(msd[step]);
+        }
 
-    for (size_t step=1; step<nsteps / 2; step++) {
-        fmt::print(outfile, "{} {}\n", step * options.steps.stride(), msd[step]);
+        write_msd(options, group, std::move(times), std::move(values));
     }
+    save_fft_wisdom(options.fft_wisdom);
 
     return 0;
 }
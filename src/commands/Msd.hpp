@@ -6,7 +6,9 @@
 
 #include <chemfiles.hpp>
 
+#include "Autocorrelation.hpp"
 #include "Command.hpp"
+#include "Output.hpp"
 #include "utils.hpp"
 
 class MSD final: public Command {
@@ -30,10 +32,28 @@ public:
         bool guess_bonds = false;
         /// msd output
         std::string outfile;
-        /// Selection of atoms to use when computing MSD
-        std::string selection;
+        /// Selections of atoms to use when computing MSD, one for each group
+        /// of atoms
+        std::vector<std::string> selections;
         /// Should we unwrap the positions?
         bool unwrap = false;
+        /// Number of threads to use when reading the trajectory and computing
+        /// correlations, 0 to use all available cores
+        size_t threads = 0;
+        /// Directory where to store the time series for correlations, empty
+        /// to store them in memory
+        std::string scratch;
+        /// Maximal time lag for correlations, in steps of the trajectory. 0
+        /// to use half of the steps
+        size_t max_lag = 0;
+        /// Algorithm used to compute correlations
+        Correlator correlator = Correlator::FFT;
+        /// Strategy used to plan the FFT for correlations
+        FFTPlanning fft_planning = FFTPlanning::Estimate;
+        /// Path to the FFTW wisdom file, empty if not using one
+        std::string fft_wisdom;
+        /// Format to use for the output files
+        OutputFormat output_format = OutputFormat::Text;
     };
 
     MSD() {}
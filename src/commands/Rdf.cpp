@@ -2,10 +2,11 @@
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
 #include <docopt/docopt.h>
-#include <unordered_set>
-#include <fstream>
+#include <algorithm>
+#include <cmath>
 
 #include "Rdf.hpp"
+#include "CellList.hpp"
 #include "Errors.hpp"
 #include "utils.hpp"
 #include "warnings.hpp"
@@ -16,6 +17,18 @@ constexpr double PI = 3.141592653589793238463;
 /// Get the radius of the biggest inscribed sphere in the unit cell
 static double biggest_sphere_radius(const UnitCell& cell);
 
+/// Count the atoms in `atoms` which form at least one pair with a different
+/// atom in `partners`
+static size_t count_paired(const std::vector<size_t>& atoms, const std::vector<size_t>& partners) {
+    if (partners.empty()) {
+        return 0;
+    } else if (partners.size() == 1 && std::find(atoms.begin(), atoms.end(), partners[0]) != atoms.end()) {
+        return atoms.size() - 1;
+    } else {
+        return atoms.size();
+    }
+}
+
 static const char OPTIONS[] =
 R"(Compute radial pair distribution function (often denoted g(r)) and running
 coordination number. The pair of particles to use can be specified using the
@@ -27,7 +40,7 @@ For more information about chemfiles selection language, please see
 http://chemfiles.github.io/chemfiles/latest/selections.html
 
 Usage:
-  cfiles rdf [options] <trajectory>
+  cfiles rdf [options] <trajectory> [--selection=<sel>...]
   cfiles rdf (-h | --help)
 
 Examples:
@@ -36,33 +49,53 @@ Examples:
   cfiles rdf methane.xyz --cell 15:15:25 --guess-bonds --points=150
   cfiles rdf result.xtc --topology=initial.mol --topology-format=PDB
   cfiles rdf simulation.pdb --steps=10000::100 -o partial-rdf.dat
+  cfiles rdf water.tng -s "name O" -s "pairs: name(#1) O and name(#2) H"
+  cfiles rdf molten-salt.xyz --partials=type -o partials.dat
 
 Options:
   -h --help                     show this help
   -o <file>, --output=<file>    write result to <file>. This default to the
                                 trajectory file name with the `.rdf.dat`
-                                extension.
+                                extension, or `.rdf.npz` for NumPy output.
   -s <sel>, --selection=<sel>   selection to use for the atoms. This can be a
                                 single selection ("name O") or a selection of
-                                two atoms ("pairs: name(#1) O and name(#2) H")
-                                [default: all]
+                                two atoms ("pairs: name(#1) O and name(#2) H").
+                                This option can be repeated to compute multiple
+                                rdf from a single pass over the trajectory, the
+                                index of the selection is then added to the
+                                output file name. The default is "all".
   --center=<sel/positions>      compute rdf with respect to a single center
                                 point instead of using pair distances. The
                                 center can either be a fixed position given as
                                 a 3D vector (0:2:0), or a selection. If a
                                 selection is used, the center of mass of
                                 selected atoms will be used as center point.
+  --partials=<property>         compute the partial rdf g_ab(r) between all
+                                the species a and b of the selected atoms in a
+                                single pass over the pairs, and the
+                                Faber-Ziman total rdf. Atoms are classified in
+                                species using <property>, which can be 'type'
+                                or 'name'. The total rdf uses equal scattering
+                                lengths for all species.
   --max=<max>                   maximal distance to use. If a custom unit cell
                                 is present (--cell option) and this option is
                                 not, the radius of the biggest inscribed sphere
                                 is used as maximal distance [default: 10]
-  -p <n>, --points=<n>          number of points in the histogram [default: 200])";
+  -p <n>, --points=<n>          number of points in the histogram [default: 200]
+  --skin=<skin>                 reuse the list of neighbors between frames,
+                                storing the pairs closer than the maximal
+                                distance plus <skin>, and only rebuilding the
+                                list after an atom moved by more than half of
+                                <skin>. This is faster for trajectories with
+                                small displacements between frames. A skin of
+                                0 rebuilds the neighbors at every frame
+                                [default: 0])";
 
 std::string Rdf::description() const {
     return "compute radial distribution functions";
 }
 
-Averager Rdf::setup(int argc, const char* argv[]) {
+size_t Rdf::setup(int argc, const char* argv[]) {
     auto options = command_header("rdf", Rdf().description());
     options += "Guillaume Fraux <guillaume@fraux.fr>\n\n";
     options += std::string(OPTIONS) + AveCommand::AVERAGE_OPTIONS;
@@ -72,16 +105,34 @@ Averager Rdf::setup(int argc, const char* argv[]) {
     if (args["--output"]){
         options_.outfile = args["--output"].asString();
     } else {
-        options_.outfile = AveCommand::options().trajectory + ".rdf.dat";
+        auto extension = output_extension(AveCommand::options().output_format);
+        options_.outfile = AveCommand::options().trajectory + ".rdf" + extension;
     }
 
     if (args["--center"]) {
         options_.center = args["--center"].asString();
     }
 
+    if (args["--partials"]) {
+        options_.partials = args["--partials"].asString();
+        if (options_.partials != "type" && options_.partials != "name") {
+            throw CFilesError("invalid property for --partials: expected 'type' or 'name', got '" + options_.partials + "'");
+        }
+        if (!options_.center.empty()) {
+            throw CFilesError("Can not use --partials with a center.");
+        }
+    }
+
     options_.rmax = string2double(args["--max"].asString());
     options_.npoints = string2long(args["--points"].asString());
-    options_.selection = args["--selection"].asString();
+    options_.skin = string2double(args["--skin"].asString());
+    if (options_.skin < 0) {
+        throw CFilesError("the skin must be positive");
+    }
+    options_.selections = args["--selection"].asStringList();
+    if (options_.selections.empty()) {
+        options_.selections.emplace_back("all");
+    }
 
     auto begin = argv;
     auto end = argv + argc;
@@ -92,9 +143,22 @@ Averager Rdf::setup(int argc, const char* argv[]) {
         options_.rmax = biggest_sphere_radius(AveCommand::options().cell);
     }
 
-    selection_ = Selection(options_.selection);
-    if (selection_.size() > 2) {
-        throw CFilesError("Can not use a selection with more than two atoms in RDF.");
+    for (auto& string: options_.selections) {
+        auto selection = Selection(string);
+        if (selection.size() > 2) {
+            throw CFilesError("Can not use a selection with more than two atoms in RDF.");
+        }
+
+        auto split = std::vector<Selection>();
+        if (selection.size() == 2) {
+            for (auto& single: split_pair_selection(string)) {
+                split.emplace_back(single);
+            }
+        }
+        split_selections_.emplace_back(std::move(split));
+        selections_.emplace_back(std::move(selection));
+        no_pairs_.emplace_back(new WarningSite("No pair corresponding to '{}' found."));
+        no_atoms_.emplace_back(new WarningSite("No atom corresponding to '{}' found."));
     }
 
     if (!options_.center.empty()) {
@@ -107,37 +171,80 @@ Averager Rdf::setup(int argc, const char* argv[]) {
             );
         } else {
             center_sel_ = Selection(options_.center);
-            if (selection_.size() != 1) {
-                throw CFilesError("Can not use a selection with more than one atoms with a center.");
+            for (auto& selection: selections_) {
+                if (selection.size() != 1) {
+                    throw CFilesError("Can not use a selection with more than one atoms with a center.");
+                }
             }
         }
     }
 
-    coord_ij_ = Averager(options_.npoints, 0, options_.rmax);
-    coord_ji_ = Averager(options_.npoints, 0, options_.rmax);
-    return Averager(options_.npoints, 0, options_.rmax);
-}
+    auto averager = Averager<1>(options_.npoints, 0, options_.rmax);
+    histograms_ = std::vector<Averager<1>>(selections_.size(), averager);
+    coord_ij_ = std::vector<Averager<1>>(selections_.size(), averager);
+    coord_ji_ = std::vector<Averager<1>>(selections_.size(), averager);
 
-void Rdf::finish(const Histogram& histogram) {
-    coord_ij_.average();
-    coord_ji_.average();
+    if (!options_.partials.empty()) {
+        for (auto& selection: selections_) {
+            if (selection.size() != 1) {
+                throw CFilesError("Can not use a selection with more than one atoms with --partials.");
+            }
+        }
+        partials_ = std::vector<Partials>(selections_.size());
+    }
 
-    std::ofstream outfile(options_.outfile, std::ios::out);
-    if(!outfile.is_open()) {
-        throw CFilesError("Could not open the '" + options_.outfile + "' file.");
+    if (options_.skin > 0) {
+        verlet_lists_ = std::vector<VerletList>(selections_.size(), VerletList(options_.rmax, options_.skin));
     }
+    return selections_.size();
+}
 
-    outfile << "# Radial distribution function in trajectory " << AveCommand::options().trajectory << std::endl;
-    outfile << "# Using selection: " << options_.selection << std::endl;
-    outfile << "# r   g(r)   N_ij(r)   N_ji(r)" << std::endl;
+void Rdf::finish(size_t selection) {
+    if (!options_.partials.empty()) {
+        finish_partials(selection);
+        return;
+    }
 
+    auto& histogram = histograms_[selection];
+    auto& coord_ij = coord_ij_[selection];
+    auto& coord_ji = coord_ji_[selection];
+    histogram.average();
+    coord_ij.average();
+    coord_ji.average();
+
+    auto r = std::vector<double>(histogram.size());
+    auto gr = std::vector<double>(histogram.size());
+    auto nij = std::vector<double>(histogram.size());
+    auto nji = std::vector<double>(histogram.size());
     for (size_t i=0; i<histogram.size(); i++){
-        outfile << histogram.first().coord(i) << " " << histogram[i] << " " << coord_ij_[i] << " " << coord_ji_[i] << "\n";
+        r[i] = histogram.first().coord(i);
+        gr[i] = histogram.averaged(i);
+        nij[i] = coord_ij.averaged(i);
+        nji[i] = coord_ji.averaged(i);
     }
+
+    auto output = ResultWriter(output_path(options_.outfile, selection), AveCommand::options().output_format);
+    output.comment("Radial distribution function in trajectory " + AveCommand::options().trajectory);
+    output.comment("Using selection: " + options_.selections[selection]);
+    output.comment("r   g(r)   N_ij(r)   N_ji(r)");
+    output.column("r", std::move(r));
+    output.column("rdf", std::move(gr));
+    output.column("N_ij", std::move(nij));
+    output.column("N_ji", std::move(nji));
+    output.write();
 }
 
-void Rdf::accumulate(const Frame& frame, Histogram& histogram) {
+void Rdf::accumulate(const Frame& frame, size_t selection) {
     check_rmax(frame);
+    if (!options_.partials.empty()) {
+        accumulate_partials(frame, selection);
+        return;
+    }
+
+    auto& current = selections_[selection];
+    auto& histogram = histograms_[selection];
+    auto& coord_ij = coord_ij_[selection];
+    auto& coord_ji = coord_ji_[selection];
 
     auto positions = frame.positions();
     auto cell = frame.cell();
@@ -165,9 +272,10 @@ void Rdf::accumulate(const Frame& frame, Histogram& histogram) {
     }
 
 
-    if (selection_.size() == 1) {
+    distances_.clear();
+    if (current.size() == 1) {
         // Use the same selection for both atoms in the pair
-        auto matched = selection_.list(frame);
+        auto matched = current.list(frame);
         n_first = matched.size();
 
         if (use_center) {
@@ -180,51 +288,96 @@ void Rdf::accumulate(const Frame& frame, Histogram& histogram) {
                 cell.wrap(rij);
                 auto d = rij.norm();
                 if (d < options_.rmax){
-                    histogram.insert(d);
+                    distances_.push_back(d);
                 }
             }
+        } else if (options_.skin > 0) {
+            // Use the same selection for both atoms in the pair, with a
+            // neighbor list reused from the previous frames
+            n_second = matched.size();
+            auto& neighbors = verlet_lists_[selection];
+            neighbors.update(frame.cell(), frame.positions(), matched);
+            neighbors.foreach_pair([&](size_t, size_t, double rij) {
+                // each pair is only visited once, but contributes to the rdf
+                // for both i->j and j->i
+                distances_.push_back(rij);
+                distances_.push_back(rij);
+            });
         } else {
             // Use the same selection for both atoms in the pair
             n_second = matched.size();
-            for (auto i: matched) {
-                for (auto j: matched) {
-                    if (i == j) continue;
-
-                    auto rij = frame.distance(i, j);
-                    if (rij < options_.rmax){
-                        histogram.insert(rij);
+            auto neighbors = CellList(frame.cell(), frame.positions(), options_.rmax);
+            auto atoms = neighbors.sort(matched);
+
+            const auto rmax2 = options_.rmax * options_.rmax;
+            const auto inverse = 1.0 / histogram.first().width;
+            const auto last = histogram.size() - 1;
+            pair_counts_.assign(histogram.size(), 0);
+            neighbors.foreach_squared_distance(atoms, [&](const double* distances2, size_t count) {
+                for (size_t k=0; k<count; k++) {
+                    // only take the square root for pairs inside the histogram
+                    if (distances2[k] < rmax2) {
+                        auto bin = static_cast<size_t>(std::sqrt(distances2[k]) * inverse);
+                        pair_counts_[std::min(bin, last)] += 1;
                     }
                 }
+            });
+            for (size_t bin=0; bin<pair_counts_.size(); bin++) {
+                // each pair is only visited once, but contributes to the rdf
+                // for both i->j and j->i
+                histogram.add(bin, 2.0 * static_cast<double>(pair_counts_[bin]));
             }
         }
+    } else if (!split_selections_[selection].empty()) {
+        // The pair selection is made of independent conditions on both atoms,
+        // use a cell list over the atoms matching each condition instead of
+        // evaluating all the pairs
+        auto& split = split_selections_[selection];
+        auto first = split[0].list(frame);
+        auto second = split[1].list(frame);
+        n_first = count_paired(first, second);
+        n_second = count_paired(second, first);
+
+        auto add_pair = [&](size_t, size_t, double rij) {
+            distances_.push_back(rij);
+        };
+        if (options_.skin > 0) {
+            auto& neighbors = verlet_lists_[selection];
+            neighbors.update(frame.cell(), frame.positions(), first, second);
+            neighbors.foreach_pair(add_pair);
+        } else {
+            auto neighbors = CellList(frame.cell(), frame.positions(), options_.rmax);
+            neighbors.foreach_pair(neighbors.sort(first), neighbors.sort(second), add_pair);
+        }
     } else {
         // If we have a pair selection, use it directly
-        assert(selection_.size() == 2);
-        auto matched = selection_.evaluate(frame);
-        std::unordered_set<size_t> first_particles;
-        std::unordered_set<size_t> second_particles;
+        assert(current.size() == 2);
+        auto matched = current.evaluate(frame);
+        auto first_particles = std::vector<bool>(frame.size(), false);
+        auto second_particles = std::vector<bool>(frame.size(), false);
 
         for (auto match: matched) {
             auto i = match[0];
             auto j = match[1];
 
-            first_particles.insert(i);
-            second_particles.insert(j);
+            first_particles[i] = true;
+            second_particles[j] = true;
 
             auto rij = frame.distance(i, j);
             if (rij < options_.rmax){
-                histogram.insert(rij);
+                distances_.push_back(rij);
             }
         }
 
-        n_first = first_particles.size();
-        n_second = second_particles.size();
+        n_first = static_cast<size_t>(std::count(first_particles.begin(), first_particles.end(), true));
+        n_second = static_cast<size_t>(std::count(second_particles.begin(), second_particles.end(), true));
     }
 
+    histogram.insert_many(distances_);
+
     if (n_first == 0 || n_second == 0) {
-        warn_once(
-            "No pair corresponding to '" + selection_.string() + "' found."
-        );
+        no_pairs_[selection]->emit(current.string());
+        histogram.step();
         return;
     }
 
@@ -250,7 +403,7 @@ void Rdf::accumulate(const Frame& frame, Histogram& histogram) {
     }
     for (size_t i=1; i<histogram.size(); i++){
         auto r = (i + 0.5) * dr;
-        coord_ij_[i] = coord_ij_[i - 1] + factor * histogram[i] * r * r * dr;
+        coord_ij[i] = coord_ij[i - 1] + factor * histogram[i] * r * r * dr;
     }
 
     // Normalize j->i neighbors count
@@ -263,21 +416,185 @@ void Rdf::accumulate(const Frame& frame, Histogram& histogram) {
     }
     for (size_t i=1; i<histogram.size(); i++){
         auto r = (i + 0.5) * dr;
-        coord_ji_[i] = coord_ji_[i - 1] + factor * histogram[i] * r * r * dr;
+        coord_ji[i] = coord_ji[i - 1] + factor * histogram[i] * r * r * dr;
     }
 
-    coord_ij_.step();
-    coord_ji_.step();
+    histogram.step();
+    coord_ij.step();
+    coord_ji.step();
+}
+
+void Rdf::accumulate_partials(const Frame& frame, size_t selection) {
+    auto& partials = partials_[selection];
+    auto matched = selections_[selection].list(frame);
+
+    // Classify the atoms in species
+    auto species = std::vector<size_t>(frame.size(), 0);
+    auto initialized = partials.total.size() != 0;
+    for (auto i: matched) {
+        auto& name = options_.partials == "type" ? frame[i].type() : frame[i].name();
+        auto it = std::find(partials.species.begin(), partials.species.end(), name);
+        if (it == partials.species.end()) {
+            if (initialized) {
+                throw CFilesError("the species '" + name + "' was not present in the first frame, can not compute partial rdf");
+            }
+            partials.species.push_back(name);
+            it = partials.species.end() - 1;
+        }
+        species[i] = static_cast<size_t>(it - partials.species.begin());
+    }
+
+    auto nspecies = partials.species.size();
+    if (!initialized) {
+        auto averager = Averager<1>(options_.npoints, 0, options_.rmax);
+        auto npairs = nspecies * (nspecies + 1) / 2;
+        partials.histograms = std::vector<Averager<1>>(npairs, averager);
+        partials.coord_ab = std::vector<Averager<1>>(npairs, averager);
+        partials.coord_ba = std::vector<Averager<1>>(npairs, averager);
+        partials.total = averager;
+    }
+
+    auto pair_index = [nspecies](size_t a, size_t b) {
+        return a * (2 * nspecies - a - 1) / 2 + b;
+    };
+
+    // Single pass over all the pairs, adding each pair to the histogram of
+    // the corresponding species
+    auto& total = partials.total;
+    const auto inverse = 1.0 / total.first().width;
+    const auto last = total.size() - 1;
+    auto add_pair = [&](size_t i, size_t j, double rij) {
+        auto a = species[i];
+        auto b = species[j];
+        if (a > b) {
+            std::swap(a, b);
+        }
+        auto bin = std::min(static_cast<size_t>(rij * inverse), last);
+        // a-a pairs contribute for both i->j and j->i
+        partials.histograms[pair_index(a, b)].add(bin, a == b ? 2.0 : 1.0);
+    };
+    if (options_.skin > 0) {
+        auto& neighbors = verlet_lists_[selection];
+        neighbors.update(frame.cell(), frame.positions(), matched);
+        neighbors.foreach_pair(add_pair);
+    } else {
+        auto neighbors = CellList(frame.cell(), frame.positions(), options_.rmax);
+        neighbors.foreach_pair(neighbors.sort(matched), add_pair);
+    }
+
+    auto counts = std::vector<double>(nspecies, 0.0);
+    for (auto i: matched) {
+        counts[species[i]] += 1;
+    }
+
+    double volume = frame.cell().volume();
+    if (volume <= 0) {volume = 1;}
+    double dr = total.first().width;
+    auto natoms = static_cast<double>(matched.size());
+
+    for (size_t a=0; a<nspecies; a++) {
+        for (size_t b=a; b<nspecies; b++) {
+            auto index = pair_index(a, b);
+            auto& histogram = partials.histograms[index];
+            auto& coord_ab = partials.coord_ab[index];
+            auto& coord_ba = partials.coord_ba[index];
+
+            if (counts[a] != 0 && counts[b] != 0) {
+                double factor = counts[a] * counts[b] / volume;
+                histogram.normalize([factor, dr](size_t i, double val){
+                    double r = (i + 0.5) * dr;
+                    return val / (4 * PI * factor * dr * r * r);
+                });
+
+                for (size_t i=1; i<histogram.size(); i++){
+                    auto r = (i + 0.5) * dr;
+                    coord_ab[i] = coord_ab[i - 1] + 4 * PI * counts[b] / volume * histogram[i] * r * r * dr;
+                    coord_ba[i] = coord_ba[i - 1] + 4 * PI * counts[a] / volume * histogram[i] * r * r * dr;
+                }
+
+                // Faber-Ziman weights c_a c_b, counting a-b and b-a pairs
+                auto weight = (a == b ? 1.0 : 2.0) * counts[a] * counts[b] / (natoms * natoms);
+                for (size_t i=0; i<histogram.size(); i++){
+                    total.add(i, weight * histogram[i]);
+                }
+            }
+
+            histogram.step();
+            coord_ab.step();
+            coord_ba.step();
+        }
+    }
+    total.step();
+}
+
+void Rdf::finish_partials(size_t selection) {
+    auto& partials = partials_[selection];
+    auto& total = partials.total;
+    auto nspecies = partials.species.size();
+    if (nspecies == 0) {
+        no_atoms_[selection]->emit(options_.selections[selection]);
+        return;
+    }
+
+    auto output = ResultWriter(output_path(options_.outfile, selection), AveCommand::options().output_format);
+    output.comment("Partial radial distribution functions in trajectory " + AveCommand::options().trajectory);
+    output.comment("Using selection: " + options_.selections[selection]);
+    output.comment("Species from atomic " + options_.partials + ": g_a_b(r) is the rdf between a and b, N_a_b(r) the number of b around a");
+
+    auto r = std::vector<double>(total.size());
+    for (size_t i=0; i<total.size(); i++){
+        r[i] = total.first().coord(i);
+    }
+    output.column("r", std::move(r));
+
+    auto names = std::string("r");
+    size_t index = 0;
+    for (size_t a=0; a<nspecies; a++) {
+        for (size_t b=a; b<nspecies; b++) {
+            auto& histogram = partials.histograms[index];
+            auto& coord_ab = partials.coord_ab[index];
+            auto& coord_ba = partials.coord_ba[index];
+            histogram.average();
+            coord_ab.average();
+            coord_ba.average();
+
+            auto gr = std::vector<double>(histogram.size());
+            auto nab = std::vector<double>(histogram.size());
+            auto nba = std::vector<double>(histogram.size());
+            for (size_t i=0; i<histogram.size(); i++){
+                gr[i] = histogram.averaged(i);
+                nab[i] = coord_ab.averaged(i);
+                nba[i] = coord_ba.averaged(i);
+            }
+
+            auto& name_a = partials.species[a];
+            auto& name_b = partials.species[b];
+            output.column("g_" + name_a + "_" + name_b, std::move(gr));
+            output.column("N_" + name_a + "_" + name_b, std::move(nab));
+            output.column("N_" + name_b + "_" + name_a, std::move(nba));
+            names += "   g_" + name_a + "_" + name_b + "(r)   N_" + name_a + "_" + name_b + "(r)   N_" + name_b + "_" + name_a + "(r)";
+            index++;
+        }
+    }
+
+    total.average();
+    auto gr = std::vector<double>(total.size());
+    for (size_t i=0; i<total.size(); i++){
+        gr[i] = total.averaged(i);
+    }
+    output.column("g_total", std::move(gr));
+    output.comment(names + "   g_total(r)");
+    output.write();
 }
 
 void Rdf::check_rmax(const chemfiles::Frame& frame) const {
     auto r_sphere = biggest_sphere_radius(frame.cell());
     if (r_sphere < options_.rmax) {
-        warn_once(fmt::format(
+        static WarningSite RMAX_TOO_BIG(
             "The maximal distance (--max option) is too big for this cell.\n"
-            "The cell contains values up to {:.2f} and the max distance is {}.",
-            r_sphere, options_.rmax
-        ));
+            "The cell contains values up to {:.2f} and the max distance is {}."
+        );
+        RMAX_TOO_BIG.emit(r_sphere, options_.rmax);
     }
 }
 
@@ -4,47 +4,100 @@
 #ifndef CFILES_RDF_HPP
 #define CFILES_RDF_HPP
 
+#include <memory>
+
 #include "AveCommand.hpp"
+#include "VerletList.hpp"
+#include "warnings.hpp"
 
 class Rdf final: public AveCommand {
 public:
     struct Options {
         /// Output data file
         std::string outfile;
-        /// Selection for the atoms in radial distribution
-        std::string selection;
+        /// Selections for the atoms in radial distribution
+        std::vector<std::string> selections;
         /// Selection/3D vector description for the optional center point
         std::string center;
         /// Number of points in the histogram
         size_t npoints = 0;
         /// Maximum distance for the histogram
         double rmax = 0;
+        /// Skin of the neighbor lists reused between frames, or 0 to find the
+        /// neighbors at every frame
+        double skin = 0;
+        /// Atomic property used to classify atoms in species when computing
+        /// all the partial rdf at once, or empty
+        std::string partials;
     };
 
-    Rdf(): selection_("all") {}
+    Rdf() {}
     std::string description() const override;
 
-    Averager setup(int argc, const char* argv[]) override;
-    void accumulate(const chemfiles::Frame& frame, Histogram& histogram) override;
-    void finish(const Histogram& histogram) override;
+    size_t setup(int argc, const char* argv[]) override;
+    void accumulate(const chemfiles::Frame& frame, size_t selection) override;
+    void finish(size_t selection) override;
 
 private:
     /// Check if the maximal distance is larger than the biggest inscribed
     /// sphere in the frame unit cell
     void check_rmax(const chemfiles::Frame& frame) const;
 
+    /// Accumulate all the partial rdf between the species of the atoms in
+    /// `selection`
+    void accumulate_partials(const chemfiles::Frame& frame, size_t selection);
+    /// Average and write all the partial rdf for `selection`
+    void finish_partials(size_t selection);
+
+    /// Partial radial distribution functions between all the species of the
+    /// atoms in a selection. The data for the species `a <= b` is stored at
+    /// index `a * (2 * n - a - 1) / 2 + b`, with n the number of species.
+    struct Partials {
+        /// Name of the species, in order of first appearance. The species are
+        /// all found in the first frame.
+        std::vector<std::string> species;
+        /// Partial rdf for each pair of species
+        std::vector<Averager<1>> histograms;
+        /// Coordination numbers of b atoms around a atoms for each pair
+        std::vector<Averager<1>> coord_ab;
+        /// Coordination numbers of a atoms around b atoms for each pair
+        std::vector<Averager<1>> coord_ba;
+        /// Faber-Ziman total rdf
+        Averager<1> total;
+    };
+
     /// Options for this instance of RDF
     Options options_;
-    /// Selection for the atoms in the pair
-    chemfiles::Selection selection_;
+    /// Selections for the atoms in the pair
+    std::vector<chemfiles::Selection> selections_;
+    /// For each pair selection which can be split in independent conditions
+    /// on the first and second atom, the two corresponding single atom
+    /// selections. This is empty for the other selections.
+    std::vector<std::vector<chemfiles::Selection>> split_selections_;
     /// Selection for the center point
     chemfiles::optional<chemfiles::Selection> center_sel_ = chemfiles::nullopt;
     /// Fixed center point
     chemfiles::optional<chemfiles::Vector3D> center_ = chemfiles::nullopt;
+    /// Radial distribution function for each selection. The histograms are
+    /// normalized in place at each step, so they use floating point bins.
+    std::vector<Averager<1>> histograms_;
     /// Also compute and average coordination numbers, for both i->j pairs and
-    /// j->i pairs
-    Averager coord_ij_;
-    Averager coord_ji_;
+    /// j->i pairs, for each selection
+    std::vector<Averager<1>> coord_ij_;
+    std::vector<Averager<1>> coord_ji_;
+    /// Per-frame buffer for the pair distances, inserted in the histogram all
+    /// at once
+    std::vector<double> distances_;
+    /// Per-frame buffer for the number of pairs in each bin, when all the
+    /// pairs are found with a cell list
+    std::vector<uint64_t> pair_counts_;
+    /// Partial rdf for each selection, when using the `--partials` option
+    std::vector<Partials> partials_;
+    /// Neighbor list for each selection, when using the `--skin` option
+    std::vector<VerletList> verlet_lists_;
+    /// Warnings emitted when no pair or no atom matches each selection
+    std::vector<std::unique_ptr<WarningSite>> no_pairs_;
+    std::vector<std::unique_ptr<WarningSite>> no_atoms_;
 };
 
 #endif
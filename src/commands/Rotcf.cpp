@@ -1,14 +1,16 @@
 // cfiles, an analysis frontend for the Chemfiles library
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
-#include <fstream>
 
 #include <docopt/docopt.h>
 #include <fmt/format.h>
-#include <fmt/ostream.h>
 
 #include "Rotcf.hpp"
 #include "Autocorrelation.hpp"
+#include "MultiTau.hpp"
+#include "Parallel.hpp"
+#include "ScratchStore.hpp"
+#include "SphericalHarmonics.hpp"
 #include "warnings.hpp"
 
 using namespace chemfiles;
@@ -17,7 +19,9 @@ static const char OPTIONS[] =
 R"(Compute rotation correlation dynamic for arbitrary bonds and molecules. The
 bonds and molecules to use are specified using chemfiles selection language.
 This analysis does not support changes in the topology or the matched atoms
-during the simulation.
+during the simulation. The rotation correlation of order l is the average of
+P_l(u(0) ⋅ u(t)), where P_l is the Legendre polynomial of degree l and u the
+normalized bond vector.
 
 For more information about chemfiles selection language, please see
 http://chemfiles.org/chemfiles/latest/selections.html
@@ -29,12 +33,16 @@ Usage:
 Examples:
   cfiles rotcf water.xyz --cell 15:15:25
   cfiles rotcf input.pdb -s "bonds: type(#1) O and type(#2) H"
+  cfiles rotcf water.xyz --cell 15:15:25 --order 1,2
 
 Options:
   -h --help                     show this help
   -o <file>, --output=<file>    write result to <file>. This default to the
                                 trajectory file name with the `.rotcf.dat`
-                                extension.
+                                extension, or `.rotcf.npz` for NumPy output.
+  --output-format=<fmt>         format of the output file, either `text` for a
+                                plain text file or `npy` for a NumPy `.npz`
+                                archive [default: text]
   --format=<format>             force the input file format to be <format>
   -t <path>, --topology=<path>  alternative topology file for the input
   --topology-format=<format>    use <format> as format for the topology file
@@ -50,8 +58,41 @@ Options:
                                 <stride>. The default values are 0 for <start>,
                                 the number of steps for <end> and 1 for
                                 <stride>.
+  --threads=<n>                 number of threads to use when reading the
+                                trajectory and computing the correlations.
+                                This default to the number of available
+                                cores.
+  --scratch=<dir>               store the time series used for correlations
+                                in a temporary file inside <dir> instead of
+                                memory. This allows to analyse trajectories
+                                larger than the available memory.
+  --max-lag=<lag>               maximal time lag, in steps of the trajectory,
+                                for which to compute the correlations. This
+                                default to half of the used steps. Computing
+                                only short time lags is faster and uses less
+                                memory.
+  --correlator=<algo>           algorithm used to compute the correlations.
+                                `fft` computes all the time lags from the full
+                                time series, `multitau` computes
+                                logarithmically spaced time lags while reading
+                                the trajectory, using much less memory.
+                                [default: fft]
+  --fft-planning=<mode>         how much time to spend optimizing the FFT
+                                used for correlations, one of `estimate`,
+                                `measure` or `patient`. This is only used when
+                                cfiles is built with FFTW. [default: estimate]
+  --fft-wisdom=<path>           load FFTW wisdom (previously optimized FFT
+                                plans) from <path> before computing the
+                                correlations, and save the updated wisdom to
+                                <path> afterward. This is only used when cfiles
+                                is built with FFTW.
   --selection=<sel>, -s <sel>   selection to use for the donors. This must be a
                                 selection of size 2 [default: bonds: all]
+  --order=<l>                   order of the Legendre polynomial used in the
+                                rotation correlation. Multiple comma-separated
+                                orders (1,2,3) can be computed from a single
+                                pass over the trajectory, and are written as
+                                separate columns of the output. [default: 2]
 )";
 
 static Rotcf::Options parse_options(int argc, const char* argv[]) {
@@ -66,10 +107,39 @@ static Rotcf::Options parse_options(int argc, const char* argv[]) {
 
     options.selection = args.at("--selection").asString();
 
+    for (auto& order: split(args.at("--order").asString(), ',')) {
+        auto l = string2long(order);
+        if (l < 1) {
+            throw CFilesError("the order of the rotation correlation must be at least 1");
+        }
+        options.orders.push_back(static_cast<size_t>(l));
+    }
+
+    options.output_format = parse_output_format(args.at("--output-format").asString());
     if (args.at("--output")) {
         options.outfile = args.at("--output").asString();
     } else {
-        options.outfile = options.trajectory + ".rotcf.dat";
+        options.outfile = options.trajectory + ".rotcf" + output_extension(options.output_format);
+    }
+
+    if (args.at("--threads")) {
+        options.threads = parse_threads(args.at("--threads").asString());
+    } else {
+        options.threads = default_threads();
+    }
+
+    if (args.at("--scratch")) {
+        options.scratch = args.at("--scratch").asString();
+    }
+
+    if (args.at("--max-lag")) {
+        options.max_lag = parse_max_lag(args.at("--max-lag").asString());
+    }
+
+    options.correlator = parse_correlator(args.at("--correlator").asString());
+    options.fft_planning = parse_fft_planning(args.at("--fft-planning").asString());
+    if (args.at("--fft-wisdom")) {
+        options.fft_wisdom = args.at("--fft-wisdom").asString();
     }
 
     if (args.at("--steps")) {
@@ -102,6 +172,92 @@ static Rotcf::Options parse_options(int argc, const char* argv[]) {
     return options;
 }
 
+static Trajectory open_trajectory(const Rotcf::Options& options) {
+    auto trajectory = Trajectory(options.trajectory, 'r', options.format);
+    if (options.custom_cell) {
+        trajectory.set_cell(options.cell);
+    }
+
+    if (options.topology != "") {
+        trajectory.set_topology(options.topology, options.topology_format);
+    }
+
+    return trajectory;
+}
+
+static void write_rotcf(const Rotcf::Options& options, std::vector<uint64_t> times, std::vector<std::vector<double>> values) {
+    auto output = ResultWriter(options.outfile, options.output_format);
+    output.comment("rotation correlation for \"" + options.selection + "\" in " + options.trajectory);
+    output.column("step", std::move(times));
+    if (options.orders.size() == 1) {
+        output.comment("step value");
+        output.column("rotcf", std::move(values[0]));
+    } else {
+        auto names = std::string("step");
+        for (size_t i=0; i<options.orders.size(); i++) {
+            auto name = "P" + std::to_string(options.orders[i]);
+            names += " " + name;
+            output.column(std::move(name), std::move(values[i]));
+        }
+        output.comment(names);
+    }
+    output.write();
+}
+
+/// Get the normalized vector between the two atoms in `match`
+static Vector3D bond_vector(const Frame& frame, const Match& match) {
+    assert(match.size() == 2);
+    auto& positions = frame.positions();
+    auto rij = frame.cell().wrap(positions[match[0]] - positions[match[1]]);
+    return rij / rij.norm();
+}
+
+/// Compute the rotation correlation with a multiple-tau correlator, reading
+/// the trajectory one step at the time
+static int run_multitau(const Rotcf::Options& options, Trajectory& trajectory, const std::vector<size_t>& steps, const std::vector<Match>& matched) {
+    // The Legendre polynomials are decomposed on spherical harmonics, which
+    // are correlated as the components of a vector for each bond
+    auto harmonics = std::vector<SphericalHarmonics>();
+    auto correlators = std::vector<MultiTauCorrelator>();
+    for (auto l: options.orders) {
+        harmonics.emplace_back(l);
+        correlators.emplace_back(matched.size(), harmonics.back().size(), MultiTauCorrelator::Product);
+    }
+
+    auto values = std::vector<double>();
+    for (auto step: steps) {
+        auto frame = trajectory.read_step(step);
+        for (size_t order=0; order<harmonics.size(); order++) {
+            auto size = harmonics[order].size();
+            values.resize(size * matched.size());
+            for (size_t i=0; i<matched.size(); i++) {
+                harmonics[order].compute(bond_vector(frame, matched[i]), values.data() + size * i);
+            }
+            correlators[order].add(values);
+        }
+    }
+
+    auto lags = correlators[0].lags();
+    auto times = std::vector<uint64_t>();
+    for (size_t i=0; i<lags.size(); i++) {
+        auto time = lags[i] * options.steps.stride();
+        if (options.max_lag != 0 && time > options.max_lag) {
+            break;
+        }
+        times.push_back(time);
+    }
+
+    auto results = std::vector<std::vector<double>>();
+    for (auto& correlator: correlators) {
+        auto correlation = correlator.correlation();
+        correlation.resize(times.size());
+        results.emplace_back(std::move(correlation));
+    }
+
+    write_rotcf(options, std::move(times), std::move(results));
+    return 0;
+}
+
 std::string Rotcf::description() const {
     return "rotation correlation dynamic for arbitrary bonds and molecules";
 }
@@ -114,15 +270,7 @@ int Rotcf::run(int argc, const char* argv[]) {
         throw CFilesError("Selection must have a size of 2 (either bonds: or pairs:)");
     }
 
-    auto trajectory = Trajectory(options.trajectory, 'r', options.format);
-    if (options.custom_cell) {
-        trajectory.set_cell(options.cell);
-    }
-
-    if (options.topology != "") {
-        trajectory.set_topology(options.topology, options.topology_format);
-    }
-
+    auto trajectory = open_trajectory(options);
     auto frame = trajectory.read_step(options.steps.first());
     if (options.guess_bonds) {
         frame.guess_bonds();
@@ -134,74 +282,78 @@ int Rotcf::run(int argc, const char* argv[]) {
         return 0;
     }
 
-    auto vectors = std::vector<std::vector<Vector3D>>(matched.size());
-    for (auto step: options.steps) {
-        if (step >= trajectory.nsteps()) {
-            break;
-        }
-        auto frame = trajectory.read_step(step);
-        auto positions = frame.positions();
-        for (size_t i=0; i<matched.size(); i++) {
-            auto& match = matched[i];
-            assert(match.size() == 2);
-
-            auto rij = frame.cell().wrap(positions[match[0]] - positions[match[1]]);
-            rij /= rij.norm();
-            vectors[i].push_back(rij);
-        }
+    auto steps = options.steps.list(trajectory.nsteps());
+    if (options.correlator == Correlator::MultiTau) {
+        return run_multitau(options, trajectory, steps, matched);
     }
 
-    // Following GROMACS, we compute the P2 autocorrelation using 6 different
-    // FFT:
+    // The components of the normalized vectors are stored with one time serie
+    // for each match and dimension, at index `3 * match + dimension`
+    auto vectors = ScratchStore(3 * matched.size(), steps.size(), options.scratch);
+
+    // Extract the normalized vectors, each thread reading a contiguous block
+    // of steps
+    auto blocks = split_blocks(steps.size(), options.threads);
+    parallel_for(blocks.size(), options.threads, [&](size_t block) {
+        auto trajectory = open_trajectory(options);
+        ScratchStore::Writer writer(vectors, blocks[block].begin);
+        for (auto step=blocks[block].begin; step<blocks[block].end; step++) {
+            auto frame = trajectory.read_step(steps[step]);
+            auto values = writer.next();
+            for (size_t i=0; i<matched.size(); i++) {
+                auto rij = bond_vector(frame, matched[i]);
+                values[3 * i + 0] = static_cast<float>(rij[0]);
+                values[3 * i + 1] = static_cast<float>(rij[1]);
+                values[3 * i + 2] = static_cast<float>(rij[2]);
+            }
+        }
+        writer.flush();
+    });
+
+    // The Legendre polynomial of order l is decomposed on the 2l + 1 real
+    // spherical harmonics Y_m (addition theorem):
+    //
+    // C_l(t) = <P_l(u(0) ⋅ u(t))> = sum_m <Y_m(u(0)) Y_m(u(t))>
     //
-    // C2(t) = <P2(u(0) ⋅ u(t))>
-    //       = <1/2 (3 * (u(0) ⋅ u(t))^2 - 1)>
-    //       = <1/2 (3 * cos^2(θ) - 1)>
-    //       = 3/2 (<x^2> + <y^2> + <z^2> + 2<xy> + 2<xz> + 2<yz>) - 1/2
-
-    // Accessing vectors[0] is fine, as we already exited if no atoms matched
-    // the selection.
-    auto used_steps = vectors[0].size();
-    auto result = std::vector<float>(used_steps / 2, 0.0);
-
-    auto do_correlation = [&](size_t i, size_t j) {
-        auto correlator = Autocorrelation(used_steps);
-        for (auto& vector: vectors) {
-            auto squares = std::vector<float>(vector.size());
+    // The autocorrelations of all the harmonics of all the bonds are computed
+    // together, as (2l + 1) * nbonds time series. The harmonics are computed
+    // from the stored vectors when filling the time series.
+    auto used_steps = steps.size();
+    auto lags = correlation_lags(used_steps, options.steps.stride(), options.max_lag);
+    auto results = std::vector<std::vector<double>>();
+
+    load_fft_wisdom(options.fft_wisdom);
+    for (auto l: options.orders) {
+        auto harmonics = SphericalHarmonics(l);
+        auto size = harmonics.size();
+        auto correlator = Autocorrelation(used_steps, options.fft_planning, lags);
+        correlator.add_timeseries(size * matched.size(), options.threads, [&](size_t serie, float* data) {
+            auto bond = serie / size;
+            auto m = serie % size;
+            auto x = vectors.serie(3 * bond + 0);
+            auto y = vectors.serie(3 * bond + 1);
+            auto z = vectors.serie(3 * bond + 2);
             for (size_t step=0; step<used_steps; step++) {
-                squares[step] = vector[step][i] * vector[step][j];
+                data[step] = static_cast<float>(harmonics.value(Vector3D(x[step], y[step], z[step]), m));
             }
-            correlator.add_timeserie(std::move(squares));
-        }
+        });
         correlator.normalize();
-        auto& correlation = correlator.get_result();
-        auto factor = i == j ? 1.5 : 3.0;
-        for (size_t step=0; step<result.size(); step++) {
-            result[step] += factor * correlation[step];
-        }
-    };
 
-    do_correlation(0, 0);
-    do_correlation(1, 1);
-    do_correlation(2, 2);
-    do_correlation(0, 1);
-    do_correlation(0, 2);
-    do_correlation(1, 2);
-
-    for (size_t i=0; i<result.size(); i++) {
-        result[i] -= 0.5;
-    }
-
-    std::ofstream output(options.outfile, std::ios::out);
-    if (!output.is_open()) {
-        throw CFilesError("Could not open the '" + options.outfile + "' file.");
+        // the correlation is averaged over all the time series, but we need
+        // the sum over harmonics averaged over the bonds
+        auto result = correlator.get_result();
+        for (auto& value: result) {
+            value *= static_cast<double>(size);
+        }
+        results.emplace_back(std::move(result));
     }
-    fmt::print(output, "# rotation correlation for \"{}\" in {}\n", options.selection, options.trajectory);
-    fmt::print(output, "# step value\n");
+    save_fft_wisdom(options.fft_wisdom);
 
-    for (size_t i=0; i<result.size(); i++) {
-        fmt::print(output, "{} {}\n", i * options.steps.stride(), result[i]);
+    auto times = std::vector<uint64_t>(lags);
+    for (size_t i=0; i<lags; i++) {
+        times[i] = i * options.steps.stride();
     }
 
+    write_rotcf(options, std::move(times), std::move(results));
     return 0;
 }
@@ -6,7 +6,9 @@
 
 #include <chemfiles.hpp>
 
+#include "Autocorrelation.hpp"
 #include "Command.hpp"
+#include "Output.hpp"
 #include "utils.hpp"
 
 class Rotcf final: public Command {
@@ -32,6 +34,25 @@ public:
         std::string outfile;
         /// Selection for the orientation vector
         std::string selection;
+        /// Orders of the Legendre polynomials used in the correlations
+        std::vector<size_t> orders;
+        /// Number of threads to use when reading the trajectory and computing
+        /// correlations, 0 to use all available cores
+        size_t threads = 0;
+        /// Directory where to store the time series for correlations, empty
+        /// to store them in memory
+        std::string scratch;
+        /// Maximal time lag for correlations, in steps of the trajectory. 0
+        /// to use half of the steps
+        size_t max_lag = 0;
+        /// Algorithm used to compute correlations
+        Correlator correlator = Correlator::FFT;
+        /// Strategy used to plan the FFT for correlations
+        FFTPlanning fft_planning = FFTPlanning::Estimate;
+        /// Path to the FFTW wisdom file, empty if not using one
+        std::string fft_wisdom;
+        /// Format to use for the output files
+        OutputFormat output_format = OutputFormat::Text;
     };
 
     Rotcf() {}
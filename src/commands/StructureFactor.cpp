@@ -0,0 +1,318 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <docopt/docopt.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "StructureFactor.hpp"
+#include "Errors.hpp"
+#include "utils.hpp"
+
+using namespace chemfiles;
+constexpr double PI = 3.141592653589793238463;
+
+/// Ratio between the Nyquist frequency of the grid and the maximal q. Larger
+/// values reduce the aliasing errors, at the cost of a larger grid.
+static const double OVERSAMPLING = 2.0;
+
+/// Parse the value of the `--weights` option
+static std::map<std::string, double> parse_weights(const std::string& string);
+
+static const char OPTIONS[] =
+R"(Compute the static structure factor S(q) of a system, averaged over all
+the directions of the wave vector q. The structure factor is computed from the
+Fourier transform of the atomic density, which is spread on a 3D grid. It can
+be compared with scattering experiments, using the scattering length of the
+different atoms as weights. This requires a periodic unit cell, and only the
+wave vectors compatible with the unit cell are used. When the unit cell
+changes, each q shell is averaged over the frames where it contains at least
+one wave vector.
+
+For more information about chemfiles selection language, please see
+http://chemfiles.github.io/chemfiles/latest/selections.html
+
+Usage:
+  cfiles sq [options] <trajectory>
+  cfiles sq (-h | --help)
+
+Examples:
+  cfiles sq water.xyz --cell 15 --max=12
+  cfiles sq nacl.dcd -t nacl.pdb --weights=Na:3.63,Cl:9.577
+  cfiles sq silica.xyz -s "type Si" --points=300
+
+Options:
+  -h --help                     show this help
+  -o <file>, --output=<file>    write result to <file>. This default to the
+                                trajectory file name with the `.sq.dat`
+                                extension, or `.sq.npz` for NumPy output.
+  -s <sel>, --selection=<sel>   selection to use for the atoms [default: all]
+  --max=<max>                   maximal value of q, in inverse angstroms. The
+                                size of the grid used for the Fourier transform
+                                grows with this value [default: 10]
+  -p <n>, --points=<n>          number of points in the histogram [default: 200]
+  --weights=<weights>           scattering lengths of the atoms, by atomic
+                                type. <weights> format is
+                                <type>:<value>,<type>:<value>,... All the atoms
+                                have the same scattering length by default.
+  --fft-planning=<mode>         how much time to spend optimizing the FFT, one
+                                of `estimate`, `measure` or `patient`. This is
+                                only used when cfiles is built with FFTW.
+                                [default: estimate]
+  --fft-wisdom=<path>           load FFTW wisdom (previously optimized FFT
+                                plans) from <path> before computing the
+                                structure factor, and save the updated wisdom
+                                to <path> afterward. This is only used when
+                                cfiles is built with FFTW.)";
+
+std::string StructureFactor::description() const {
+    return "compute static structure factor";
+}
+
+size_t StructureFactor::setup(int argc, const char* argv[]) {
+    auto options = command_header("sq", StructureFactor().description());
+    options += "Guillaume Fraux <guillaume@fraux.fr>\n\n";
+    options += std::string(OPTIONS) + AveCommand::AVERAGE_OPTIONS;
+    auto args = docopt::docopt(options, {argv, argv + argc}, true, "");
+    AveCommand::parse_options(args);
+
+    if (args["--output"]){
+        options_.outfile = args["--output"].asString();
+    } else {
+        auto extension = output_extension(AveCommand::options().output_format);
+        options_.outfile = AveCommand::options().trajectory + ".sq" + extension;
+    }
+
+    options_.selection = args["--selection"].asString();
+    options_.qmax = string2double(args["--max"].asString());
+    options_.npoints = string2long(args["--points"].asString());
+    if (options_.qmax <= 0) {
+        throw CFilesError("the maximal value of q must be positive");
+    }
+
+    if (args["--weights"]) {
+        options_.weights = parse_weights(args["--weights"].asString());
+    }
+
+    options_.fft_planning = parse_fft_planning(args["--fft-planning"].asString());
+    if (args["--fft-wisdom"]) {
+        options_.fft_wisdom = args["--fft-wisdom"].asString();
+    }
+
+    selection_ = Selection(options_.selection);
+    if (selection_.size() != 1) {
+        throw CFilesError("Can not use a selection with more than one atom in structure factor.");
+    }
+
+    load_fft_wisdom(options_.fft_wisdom);
+
+    structure_factor_ = Averager<1>(options_.npoints, 0, options_.qmax);
+    frames_ = Averager<1>(options_.npoints, 0, options_.qmax);
+    sums_.resize(options_.npoints);
+    counts_.resize(options_.npoints);
+    return 1;
+}
+
+void StructureFactor::accumulate(const Frame& frame, size_t) {
+    auto& cell = frame.cell();
+    if (cell.shape() == UnitCell::INFINITE) {
+        throw CFilesError("Can not compute the structure factor with an infinite unit cell.");
+    }
+    auto matrix = cell.matrix();
+    auto inverse = matrix.invert();
+
+    // The wave vectors are q = 2π inverse^T m, for integer m. The grid must
+    // contain all the m with |q| < qmax, i.e. |m_k| <= qmax |a_k| / 2π where
+    // a_k are the cell vectors, with some oversampling to reduce aliasing.
+    auto needed = std::array<size_t, 3>();
+    auto max_m = std::array<long, 3>();
+    for (size_t k=0; k<3; k++) {
+        auto length = Vector3D(matrix[0][k], matrix[1][k], matrix[2][k]).norm();
+        auto max = options_.qmax * length / (2 * PI);
+        max_m[k] = static_cast<long>(max);
+        needed[k] = RealFFT3D::fast_size(static_cast<size_t>(std::ceil(2 * OVERSAMPLING * max)) + 4);
+    }
+
+    // A grid larger than needed only increases the oversampling, so the FFT
+    // is only created again when the cell grows past the current grid. The
+    // new grid is then made a bit larger than needed, to avoid creating it
+    // again at every step when the cell fluctuates.
+    if (!fft_ || needed[0] > fft_->shape()[0] || needed[1] > fft_->shape()[1] || needed[2] > fft_->shape()[2]) {
+        if (fft_) {
+            for (size_t k=0; k<3; k++) {
+                needed[k] = RealFFT3D::fast_size(std::max(needed[k] + needed[k] / 8, fft_->shape()[k]));
+            }
+        }
+        fft_ = std::unique_ptr<RealFFT3D>(new RealFFT3D(needed, options_.fft_planning));
+    }
+    const auto& shape = fft_->shape();
+
+    auto matched = selection_.list(frame);
+    if (matched.empty()) {
+        no_atoms_.emit(options_.selection);
+        return;
+    }
+
+    weights_.resize(matched.size());
+    double norm = 0;
+    for (size_t i=0; i<matched.size(); i++) {
+        weights_[i] = 1.0;
+        if (!options_.weights.empty()) {
+            auto& type = frame[matched[i]].type();
+            auto it = options_.weights.find(type);
+            if (it == options_.weights.end()) {
+                throw CFilesError("missing weight for atoms with type '" + type + "'");
+            }
+            weights_[i] = it->second;
+        }
+        norm += weights_[i] * weights_[i];
+    }
+
+    spread(frame, matched, inverse);
+    fft_->execute();
+
+    // The spreading kernel is a product of cubic B-splines, with a Fourier
+    // transform of sinc(π m / n)^4 along each axis. Its effect on |ρ(q)|^2 is
+    // removed by dividing by sinc(π m / n)^8.
+    auto deconvolution = std::array<std::vector<double>, 3>();
+    for (size_t k=0; k<3; k++) {
+        deconvolution[k].resize(static_cast<size_t>(max_m[k]) + 1);
+        for (long m=0; m<=max_m[k]; m++) {
+            auto x = PI * static_cast<double>(m) / static_cast<double>(shape[k]);
+            auto sinc = m == 0 ? 1.0 : std::sin(x) / x;
+            deconvolution[k][static_cast<size_t>(m)] = 1.0 / std::pow(sinc, 8);
+        }
+    }
+
+    std::fill(sums_.begin(), sums_.end(), 0.0);
+    std::fill(counts_.begin(), counts_.end(), 0.0);
+    const auto inverse_dq = 1.0 / structure_factor_.first().width;
+    const auto last = shape[2] / 2;
+    for (long m0=-max_m[0]; m0<=max_m[0]; m0++) {
+        auto i0 = static_cast<size_t>(m0 < 0 ? m0 + static_cast<long>(shape[0]) : m0);
+        for (long m1=-max_m[1]; m1<=max_m[1]; m1++) {
+            auto i1 = static_cast<size_t>(m1 < 0 ? m1 + static_cast<long>(shape[1]) : m1);
+            // only the non-negative m2 are stored in the spectrum, the
+            // negative ones are given by symmetry and have the same norm
+            for (long m2=0; m2<=max_m[2]; m2++) {
+                if (m2 == 0 && (m1 < 0 || (m1 == 0 && m0 <= 0))) {
+                    // skip q = 0, and count the symmetric vectors only once
+                    continue;
+                }
+                auto m = Vector3D(static_cast<double>(m0), static_cast<double>(m1), static_cast<double>(m2));
+                auto q_vector = Vector3D(
+                    inverse[0][0] * m[0] + inverse[1][0] * m[1] + inverse[2][0] * m[2],
+                    inverse[0][1] * m[0] + inverse[1][1] * m[1] + inverse[2][1] * m[2],
+                    inverse[0][2] * m[0] + inverse[1][2] * m[1] + inverse[2][2] * m[2]
+                );
+                auto q = 2 * PI * q_vector.norm();
+                if (q >= options_.qmax) {
+                    continue;
+                }
+
+                auto i2 = static_cast<size_t>(m2);
+                auto index = (i0 * shape[1] + i1) * (last + 1) + i2;
+                auto value = fft_->norm2(index) / norm;
+                value *= deconvolution[0][static_cast<size_t>(std::abs(m0))];
+                value *= deconvolution[1][static_cast<size_t>(std::abs(m1))];
+                value *= deconvolution[2][i2];
+
+                auto bin = static_cast<size_t>(q * inverse_dq);
+                if (bin < sums_.size()) {
+                    sums_[bin] += value;
+                    counts_[bin] += 1;
+                }
+            }
+        }
+    }
+
+    // Only the frames with at least one wave vector in a shell contribute to
+    // the average of this shell
+    for (size_t bin=0; bin<sums_.size(); bin++) {
+        if (counts_[bin] != 0) {
+            structure_factor_.add(bin, sums_[bin] / counts_[bin]);
+            frames_.add(bin, 1.0);
+        }
+    }
+    structure_factor_.step();
+    frames_.step();
+}
+
+void StructureFactor::spread(const Frame& frame, const std::vector<size_t>& matched, const Matrix3D& inverse) {
+    auto& shape = fft_->shape();
+    auto grid = fft_->grid();
+    std::fill(grid, grid + shape[0] * shape[1] * shape[2], 0.0f);
+
+    auto& positions = frame.positions();
+    for (size_t i=0; i<matched.size(); i++) {
+        auto weight = weights_[i];
+
+        // Cubic B-spline weights on the 4 closest grid points along each axis
+        auto fractional = inverse * positions[matched[i]];
+        std::array<std::array<double, 4>, 3> spline;
+        std::array<long, 3> first;
+        for (size_t k=0; k<3; k++) {
+            auto n = static_cast<double>(shape[k]);
+            auto u = fractional[k] * n;
+            u -= std::floor(u / n) * n;
+            auto base = std::floor(u);
+            auto t = u - base;
+            spline[k][0] = (1 - t) * (1 - t) * (1 - t) / 6;
+            spline[k][1] = (3 * t * t * t - 6 * t * t + 4) / 6;
+            spline[k][2] = (-3 * t * t * t + 3 * t * t + 3 * t + 1) / 6;
+            spline[k][3] = t * t * t / 6;
+            first[k] = static_cast<long>(base) - 1;
+        }
+
+        for (long a=0; a<4; a++) {
+            auto i0 = static_cast<size_t>((first[0] + a + static_cast<long>(shape[0])) % static_cast<long>(shape[0]));
+            for (long b=0; b<4; b++) {
+                auto i1 = static_cast<size_t>((first[1] + b + static_cast<long>(shape[1])) % static_cast<long>(shape[1]));
+                auto w01 = weight * spline[0][static_cast<size_t>(a)] * spline[1][static_cast<size_t>(b)];
+                auto row = grid + (i0 * shape[1] + i1) * shape[2];
+                for (long c=0; c<4; c++) {
+                    auto i2 = static_cast<size_t>((first[2] + c + static_cast<long>(shape[2])) % static_cast<long>(shape[2]));
+                    row[i2] += static_cast<float>(w01 * spline[2][static_cast<size_t>(c)]);
+                }
+            }
+        }
+    }
+}
+
+void StructureFactor::finish(size_t) {
+    save_fft_wisdom(options_.fft_wisdom);
+    structure_factor_.average();
+    frames_.average();
+
+    auto q = std::vector<double>(structure_factor_.size());
+    auto sq = std::vector<double>(structure_factor_.size(), 0.0);
+    for (size_t i=0; i<structure_factor_.size(); i++){
+        q[i] = structure_factor_.first().coord(i);
+        // both values are divided by the total number of frames
+        if (frames_.averaged(i) != 0) {
+            sq[i] = structure_factor_.averaged(i) / frames_.averaged(i);
+        }
+    }
+
+    auto output = ResultWriter(options_.outfile, AveCommand::options().output_format);
+    output.comment("Static structure factor in trajectory " + AveCommand::options().trajectory);
+    output.comment("Using selection: " + options_.selection);
+    output.comment("Shells are averaged over the frames where they contain wave vectors compatible with the unit cell, and set to 0 otherwise");
+    output.comment("q   S(q)");
+    output.column("q", std::move(q));
+    output.column("S(q)", std::move(sq));
+    output.write();
+}
+
+std::map<std::string, double> parse_weights(const std::string& string) {
+    auto weights = std::map<std::string, double>();
+    for (auto& item: split(string, ',')) {
+        auto splitted = split(item, ':');
+        if (splitted.size() != 2 || trim(splitted[0]).empty()) {
+            throw CFilesError("invalid weight '" + item + "', expected <type>:<value>");
+        }
+        weights[trim(splitted[0])] = string2double(trim(splitted[1]));
+    }
+    return weights;
+}
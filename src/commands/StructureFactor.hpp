@@ -0,0 +1,69 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_STRUCTURE_FACTOR_HPP
+#define CFILES_STRUCTURE_FACTOR_HPP
+
+#include <map>
+#include <memory>
+
+#include "AveCommand.hpp"
+#include "Autocorrelation.hpp"
+#include "FFT3D.hpp"
+#include "warnings.hpp"
+
+class StructureFactor final: public AveCommand {
+public:
+    struct Options {
+        /// Output data file
+        std::string outfile;
+        /// Selection for the atoms
+        std::string selection;
+        /// Number of points in the histogram
+        size_t npoints = 0;
+        /// Maximal value of q for the histogram
+        double qmax = 0;
+        /// Scattering lengths of the atoms by atomic type, or empty to use
+        /// the same scattering length for all atoms
+        std::map<std::string, double> weights;
+        /// Planning strategy for the FFT
+        FFTPlanning fft_planning = FFTPlanning::Estimate;
+        /// Path to the FFTW wisdom file, or empty
+        std::string fft_wisdom;
+    };
+
+    StructureFactor(): selection_("all"), no_atoms_("No atom corresponding to '{}' found.") {}
+    std::string description() const override;
+
+    size_t setup(int argc, const char* argv[]) override;
+    void accumulate(const chemfiles::Frame& frame, size_t selection) override;
+    void finish(size_t selection) override;
+
+private:
+    /// Spread the `matched` atoms on the FFT grid with the weights in
+    /// `weights_`, using fractional coordinates computed with the `inverse`
+    /// of the cell matrix
+    void spread(const chemfiles::Frame& frame, const std::vector<size_t>& matched, const chemfiles::Matrix3D& inverse);
+
+    /// Options for this instance of StructureFactor
+    Options options_;
+    /// Selection for the atoms
+    chemfiles::Selection selection_;
+    /// FFT used to get the Fourier transform of the density. It is created
+    /// again with a larger grid when the cell grows past the current one.
+    std::unique_ptr<RealFFT3D> fft_;
+    /// Structure factor, averaged over q shells and over frames
+    Averager<1> structure_factor_;
+    /// Fraction of the frames with at least one wave vector in each q shell
+    Averager<1> frames_;
+    /// Per-frame buffer for the scattering length of the selected atoms
+    std::vector<double> weights_;
+    /// Per-frame buffers for the sum of S(q) and the number of q vectors in
+    /// each shell
+    std::vector<double> sums_;
+    std::vector<double> counts_;
+    /// Warning emitted when no atom matches the selection
+    WarningSite no_atoms_;
+};
+
+#endif
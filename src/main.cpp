@@ -5,6 +5,7 @@
 
 #include "CommandFactory.hpp"
 #include "utils.hpp"
+#include "warnings.hpp"
 
 static void list_commands();
 static void print_usage();
@@ -38,7 +39,9 @@ int main(int argc, const char* argv[]) {
 
     try {
         auto command = get_command(argv[1]);
-        return command->run(argc - 1, &argv[1]);
+        auto status = command->run(argc - 1, &argv[1]);
+        print_warnings_summary();
+        return status;
     } catch (const std::exception& e){
         std::cout << "Error: " << e.what() << std::endl;
         return 2;
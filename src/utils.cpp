@@ -1,6 +1,7 @@
 // cfiles, an analysis frontend for the Chemfiles library
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
+#include <cctype>
 #include <sstream>
 
 #include <chemfiles.hpp>
@@ -68,6 +69,92 @@ std::string trim(const std::string& str) {
     return (back <= front ? std::string() : std::string(front, back));
 }
 
+/// Check if `c` can be part of a word in a selection
+static bool is_word_char(char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+std::vector<std::string> split_pair_selection(const std::string& selection) {
+    auto colon = selection.find(':');
+    if (colon == std::string::npos || trim(selection.substr(0, colon)) != "pairs") {
+        return {};
+    }
+    auto expression = selection.substr(colon + 1);
+    if (expression.find_first_of("\"'&|") != std::string::npos) {
+        // quoted strings and symbolic operators are not handled here
+        return {};
+    }
+
+    // split the expression on the `and` outside of any parenthesis
+    auto clauses = std::vector<std::string>();
+    size_t depth = 0;
+    size_t start = 0;
+    for (size_t i=0; i<expression.size(); i++) {
+        auto c = expression[i];
+        if (c == '(') {
+            depth += 1;
+        } else if (c == ')') {
+            if (depth == 0) {
+                return {};
+            }
+            depth -= 1;
+        } else if (depth == 0 && is_word_char(c) && (i == 0 || !is_word_char(expression[i - 1]))) {
+            auto end = i;
+            while (end < expression.size() && is_word_char(expression[end])) {
+                end += 1;
+            }
+            auto word = expression.substr(i, end - i);
+            if (word == "or") {
+                return {};
+            } else if (word == "and") {
+                clauses.push_back(expression.substr(start, i - start));
+                start = end;
+            }
+            i = end - 1;
+        }
+    }
+    clauses.push_back(expression.substr(start));
+
+    std::string first;
+    std::string second;
+    for (auto& clause: clauses) {
+        clause = trim(clause);
+        if (clause.empty()) {
+            return {};
+        }
+
+        bool uses_first = false;
+        bool uses_second = false;
+        for (auto position = clause.find('#'); position != std::string::npos; position = clause.find('#', position + 1)) {
+            auto variable = position + 1 < clause.size() ? clause[position + 1] : '\0';
+            if (variable == '1') {
+                uses_first = true;
+            } else if (variable == '2') {
+                uses_second = true;
+            } else {
+                return {};
+            }
+        }
+
+        if (uses_first && uses_second) {
+            return {};
+        } else if (uses_second) {
+            // use the condition on the second atom as a single atom selection
+            for (auto position = clause.find("#2"); position != std::string::npos; position = clause.find("#2", position)) {
+                clause[position + 1] = '1';
+            }
+            second += (second.empty() ? "" : " and ") + clause;
+        } else {
+            // conditions without variable apply to the first atom
+            first += (first.empty() ? "" : " and ") + clause;
+        }
+    }
+
+    return {
+        "atoms: " + (first.empty() ? std::string("all") : first),
+        "atoms: " + (second.empty() ? std::string("all") : second),
+    };
+}
 
 chemfiles::UnitCell parse_cell(const std::string& string) {
     auto splitted = split(string, ':');
@@ -106,6 +193,17 @@ chemfiles::UnitCell parse_cell(const std::string& string) {
     }
 }
 
+std::vector<size_t> steps_range::list(size_t max) const {
+    auto steps = std::vector<size_t>();
+    for (auto step: *this) {
+        if (step >= max) {
+            break;
+        }
+        steps.push_back(step);
+    }
+    return steps;
+}
+
 steps_range steps_range::parse(const std::string& string) {
     steps_range range;
     auto splitted = split(string, ':');
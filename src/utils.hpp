@@ -32,6 +32,18 @@ std::string trim(const std::string& str);
 /// Parse an unit cell string
 chemfiles::UnitCell parse_cell(const std::string& string);
 
+/// Try to split a `pairs:` selection into two independent single atom
+/// selections, one for the first atom and one for the second atom of the
+/// pair. This is possible when the selection is a conjunction (`and`) of
+/// conditions which each only use one of the atoms, like in
+/// `pairs: name(#1) O and name(#2) H`. The pairs matching the selection are
+/// then all the pairs of different atoms `i` and `j`, with `i` matching the
+/// first selection and `j` matching the second.
+///
+/// The two selections are returned in a vector, which is empty if the
+/// selection can not be split.
+std::vector<std::string> split_pair_selection(const std::string& selection);
+
 /// Range of steps to use from a trajectory
 class steps_range {
 public:
@@ -70,6 +82,10 @@ public:
         }
     }
 
+    /// Get the list of all steps in this range, given the maximal step of a
+    /// trajectory
+    std::vector<size_t> list(size_t max) const;
+
     size_t first() const {
         return first_;
     }
@@ -2,17 +2,46 @@
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
 #include <iostream>
-#include <set>
+#include <mutex>
+#include <vector>
 #include "warnings.hpp"
 
+static std::mutex WARNINGS_MUTEX;
+
+/// All the warning sites that have been emitted at least once, in the order
+/// of their first emission
+static std::vector<const WarningSite*> EMITTED_WARNINGS;
+
 void warn(std::string message) {
+    std::lock_guard<std::mutex> lock(WARNINGS_MUTEX);
     std::cerr << "[cfiles] " << message << std::endl;
 }
 
-void warn_once(std::string message) {
-    static std::set<std::string> ALREADY_SEEN;
-    auto not_seen = ALREADY_SEEN.insert(message).second;
-    if (not_seen) {
-        warn(message);
+void WarningSite::first(std::string message) {
+    {
+        std::lock_guard<std::mutex> lock(WARNINGS_MUTEX);
+        message_ = message;
+        EMITTED_WARNINGS.push_back(this);
+    }
+    warn(std::move(message));
+}
+
+void print_warnings_summary() {
+    std::lock_guard<std::mutex> lock(WARNINGS_MUTEX);
+    bool repeated = false;
+    for (auto site: EMITTED_WARNINGS) {
+        if (site->count() > 1) {
+            repeated = true;
+            break;
+        }
+    }
+
+    if (!repeated) {
+        return;
+    }
+
+    std::cerr << "[cfiles] warnings summary:" << std::endl;
+    for (auto site: EMITTED_WARNINGS) {
+        std::cerr << "[cfiles]   " << site->count() << "x " << site->message() << std::endl;
     }
 }
@@ -4,12 +4,68 @@
 #ifndef CFILES_WARNINGS_HPP
 #define CFILES_WARNINGS_HPP
 
+#include <atomic>
 #include <string>
 
-/// Print a warning to the standard error stream
+#include <fmt/format.h>
+
+/// Print a warning to the standard error stream. This function can be called
+/// from multiple threads.
 void warn(std::string message);
 
-/// Print a warning once to the standard error stream
-void warn_once(std::string message);
+/// A single place in the code emitting a warning. Warning sites should be
+/// declared as `static` variables, or as members of an object living until
+/// `print_warnings_summary` is called, and can then be used from multiple
+/// threads:
+///
+///     static WarningSite OUT_OF_BOUNDS("point {} is out of bounds");
+///     OUT_OF_BOUNDS.emit(x);
+///
+/// The message is only formatted and printed the first time the warning is
+/// emitted. Later calls only increment an atomic counter, and the number of
+/// occurrences of every warning is printed by `print_warnings_summary`.
+class WarningSite {
+public:
+    /// Create a new warning site, using the given fmt-style `format` string
+    /// for the message. The string must outlive the warning site.
+    explicit WarningSite(const char* format): format_(format), count_(0) {}
+
+    WarningSite(const WarningSite&) = delete;
+    WarningSite& operator=(const WarningSite&) = delete;
+
+    /// Emit this warning, using `args` to format the message the first time
+    template <typename... Args>
+    void emit(const Args&... args) {
+        if (count_.fetch_add(1, std::memory_order_relaxed) == 0) {
+            first(fmt::vformat(format_, fmt::make_format_args(args...)));
+        }
+    }
+
+    /// Get the number of time this warning was emitted
+    size_t count() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    /// Get the message used the first time this warning was emitted
+    const std::string& message() const {
+        return message_;
+    }
+
+private:
+    /// Register this warning site and print the `message`
+    void first(std::string message);
+
+    /// Format string for the message
+    const char* format_;
+    /// Message used the first time this warning was emitted
+    std::string message_;
+    /// Number of time this warning was emitted
+    std::atomic<size_t> count_;
+};
+
+/// Print a summary of all warnings emitted more than once, with the number of
+/// occurrences of each one. This should be called at the end of the run, once
+/// all the threads are done.
+void print_warnings_summary();
 
 #endif
@@ -0,0 +1,134 @@
+#include <catch.hpp>
+
+#include <cmath>
+
+#include "Autocorrelation.hpp"
+#include "Errors.hpp"
+
+static std::vector<float> generate_series(size_t count, size_t size) {
+    auto series = std::vector<float>(count * size);
+    for (size_t i=0; i<series.size(); i++) {
+        series[i] = static_cast<float>(std::sin(0.1 * static_cast<double>(i)) + 0.01 * static_cast<double>(i % 7));
+    }
+    return series;
+}
+
+static std::vector<double> direct_autocorrelation(const std::vector<float>& series, size_t count, size_t size, size_t lags) {
+    auto result = std::vector<double>(lags, 0.0);
+    for (size_t serie=0; serie<count; serie++) {
+        auto data = series.data() + serie * size;
+        for (size_t lag=0; lag<lags; lag++) {
+            double sum = 0;
+            for (size_t i=0; i<size - lag; i++) {
+                sum += static_cast<double>(data[i]) * static_cast<double>(data[i + lag]);
+            }
+            result[lag] += sum / static_cast<double>(size - lag);
+        }
+    }
+    for (auto& value: result) {
+        value /= static_cast<double>(count);
+    }
+    return result;
+}
+
+TEST_CASE("Autocorrelation") {
+    SECTION("Single series") {
+        auto series = generate_series(1, 50);
+        auto correlator = Autocorrelation(50);
+        correlator.add_timeserie(series);
+        correlator.normalize();
+
+        auto expected = direct_autocorrelation(series, 1, 50, 50);
+        auto& result = correlator.get_result();
+        for (size_t i=0; i<50; i++) {
+            CHECK(std::abs(result[i] - expected[i]) < 1e-4);
+        }
+    }
+
+    SECTION("Batched series") {
+        // more series than a single chunk, with both the direct and FFT
+        // algorithms
+        for (size_t size: {64, 1024}) {
+            auto series = generate_series(37, size);
+            auto correlator = Autocorrelation(size);
+            CHECK(correlator.direct() == (size == 64));
+            correlator.add_timeseries(series, 1);
+            correlator.normalize();
+
+            auto expected = direct_autocorrelation(series, 37, size, size);
+            auto& result = correlator.get_result();
+            for (size_t i=0; i<size; i++) {
+                CHECK(std::abs(result[i] - expected[i]) < 1e-4);
+            }
+
+            // the results do not depend on the number of threads
+            auto parallel = Autocorrelation(size);
+            parallel.add_timeseries(series, 4);
+            parallel.normalize();
+            CHECK(parallel.get_result() == result);
+        }
+    }
+
+    SECTION("Maximal lag") {
+        auto series = generate_series(20, 2000);
+        for (size_t lags: {20, 1500}) {
+            auto correlator = Autocorrelation(2000, FFTPlanning::Estimate, lags);
+            // the direct algorithm is only used for short lags
+            CHECK(correlator.direct() == (lags == 20));
+            correlator.add_timeseries(series, 2);
+            correlator.normalize();
+
+            auto expected = direct_autocorrelation(series, 20, 2000, lags);
+            auto& result = correlator.get_result();
+            REQUIRE(result.size() == lags);
+            for (size_t i=0; i<lags; i++) {
+                CHECK(std::abs(result[i] - expected[i]) < 1e-4);
+            }
+        }
+
+        CHECK(correlation_lags(100, 1, 0) == 50);
+        CHECK(correlation_lags(100, 1, 10) == 11);
+        CHECK(correlation_lags(100, 5, 10) == 3);
+        CHECK(correlation_lags(100, 1, 1000) == 100);
+        CHECK_THROWS_AS(parse_max_lag("0"), CFilesError);
+    }
+
+    SECTION("Long series") {
+        // long series are transformed in smaller chunks to limit the memory
+        // used by the workspaces
+        size_t size = 1 << 20;
+        auto series = generate_series(6, size);
+        auto correlator = Autocorrelation(size);
+        CHECK_FALSE(correlator.direct());
+        correlator.add_timeseries(series, 1);
+        correlator.normalize();
+
+        auto expected = direct_autocorrelation(series, 6, size, 5);
+        auto& result = correlator.get_result();
+        for (size_t i=0; i<5; i++) {
+            CHECK(std::abs(result[i] - expected[i]) < 1e-3);
+        }
+
+        auto parallel = Autocorrelation(size);
+        parallel.add_timeseries(series, 4);
+        parallel.normalize();
+        CHECK(parallel.get_result() == result);
+    }
+
+    SECTION("FFT planning") {
+        CHECK(parse_fft_planning("estimate") == FFTPlanning::Estimate);
+        CHECK(parse_fft_planning("measure") == FFTPlanning::Measure);
+        CHECK(parse_fft_planning("patient") == FFTPlanning::Patient);
+        CHECK_THROWS_AS(parse_fft_planning("exhaustive"), CFilesError);
+
+        // planning does not change the results
+        auto series = generate_series(20, 512);
+        auto estimate = Autocorrelation(512, FFTPlanning::Estimate);
+        estimate.add_timeseries(series, 1);
+        auto measure = Autocorrelation(512, FFTPlanning::Measure);
+        measure.add_timeseries(series, 1);
+        for (size_t i=0; i<512; i++) {
+            CHECK(std::abs(estimate.get_result()[i] - measure.get_result()[i]) < 1e-3);
+        }
+    }
+}
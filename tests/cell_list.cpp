@@ -0,0 +1,109 @@
+#include <catch.hpp>
+
+#include <algorithm>
+#include <random>
+
+#include "CellList.hpp"
+
+using namespace chemfiles;
+
+using pair_list = std::vector<std::pair<size_t, size_t>>;
+
+static std::vector<Vector3D> random_positions(size_t count, double size) {
+    auto generator = std::mt19937(42);
+    auto distribution = std::uniform_real_distribution<double>(-0.5 * size, 1.5 * size);
+    auto positions = std::vector<Vector3D>(count);
+    for (auto& position: positions) {
+        position = Vector3D(distribution(generator), distribution(generator), distribution(generator));
+    }
+    return positions;
+}
+
+static pair_list brute_force(const UnitCell& cell, const std::vector<Vector3D>& positions, const std::vector<size_t>& first, const std::vector<size_t>& second, double cutoff) {
+    auto pairs = pair_list();
+    for (auto i: first) {
+        for (auto j: second) {
+            if (i != j && cell.wrap(positions[j] - positions[i]).norm() < cutoff) {
+                pairs.emplace_back(i, j);
+            }
+        }
+    }
+    std::sort(pairs.begin(), pairs.end());
+    return pairs;
+}
+
+static void check_cell(const UnitCell& cell, double size, double cutoff) {
+    auto positions = random_positions(500, size);
+    auto all = std::vector<size_t>(positions.size());
+    for (size_t i=0; i<all.size(); i++) {
+        all[i] = i;
+    }
+    auto first = std::vector<size_t>(all.begin(), all.begin() + 200);
+    auto second = std::vector<size_t>(all.begin() + 150, all.end());
+
+    auto neighbors = CellList(cell, positions, cutoff);
+
+    // single set of atoms, each pair is visited once
+    auto pairs = pair_list();
+    neighbors.foreach_pair(neighbors.sort(all), [&](size_t i, size_t j, double distance) {
+        CHECK(distance < cutoff);
+        pairs.emplace_back(i, j);
+        pairs.emplace_back(j, i);
+    });
+    std::sort(pairs.begin(), pairs.end());
+    auto expected = brute_force(cell, positions, all, all, cutoff);
+    CHECK(pairs == expected);
+
+    // batched squared distances, each pair is visited once
+    auto distances2 = std::vector<double>();
+    neighbors.foreach_squared_distance(neighbors.sort(all), [&](const double* values, size_t count) {
+        for (size_t k=0; k<count; k++) {
+            if (values[k] < cutoff * cutoff) {
+                distances2.push_back(values[k]);
+            }
+        }
+    });
+    auto expected_distances2 = std::vector<double>();
+    for (auto& pair: expected) {
+        if (pair.first < pair.second) {
+            auto rij = cell.wrap(positions[pair.second] - positions[pair.first]);
+            expected_distances2.push_back(dot(rij, rij));
+        }
+    }
+    std::sort(distances2.begin(), distances2.end());
+    std::sort(expected_distances2.begin(), expected_distances2.end());
+    REQUIRE(distances2.size() == expected_distances2.size());
+    for (size_t i=0; i<distances2.size(); i++) {
+        CHECK(distances2[i] == Approx(expected_distances2[i]));
+    }
+
+    // two different sets of atoms
+    pairs.clear();
+    neighbors.foreach_pair(neighbors.sort(first), neighbors.sort(second), [&](size_t i, size_t j, double) {
+        pairs.emplace_back(i, j);
+    });
+    std::sort(pairs.begin(), pairs.end());
+    CHECK(pairs == brute_force(cell, positions, first, second, cutoff));
+}
+
+TEST_CASE("CellList") {
+    SECTION("Orthorhombic cell") {
+        auto cell = UnitCell(Vector3D(20, 22, 25));
+        check_cell(cell, 20, 4.5);
+        auto positions = random_positions(1000, 20);
+        CHECK(CellList(cell, positions, 4.5).shape() == (std::array<size_t, 3>{{4, 4, 5}}));
+
+        // cutoff larger than half of the cell, with less than 3 cells
+        check_cell(cell, 20, 9.0);
+    }
+
+    SECTION("Triclinic cell") {
+        auto cell = UnitCell(Vector3D(20, 22, 25), Vector3D(80, 95, 110));
+        check_cell(cell, 20, 4.5);
+        check_cell(cell, 20, 7.5);
+    }
+
+    SECTION("Infinite cell") {
+        check_cell(UnitCell(), 20, 4.5);
+    }
+}
@@ -56,6 +56,32 @@ def density(selection, output):
     return data
 
 
+def multiple_selections(output, expected):
+    out, err = cfiles(
+        "density",
+        "-c",
+        "24:24:25.458:90:90:120",
+        "--max=20",
+        "--points=200",
+        "--radial=Z",
+        "-s",
+        "atoms: type Al",
+        "-s",
+        "atoms: type Si",
+        TRAJECTORY,
+        "-o",
+        output + ".dat",
+    )
+    assert out == ""
+    assert err == ""
+
+    for i, reference in enumerate(expected):
+        path = output + ".{}.dat".format(i)
+        data = read_data(path)
+        os.unlink(path)
+        assert data == reference
+
+
 if __name__ == "__main__":
     with tempfile.NamedTemporaryFile() as file:
         tot = density("atoms: all", file.name)
@@ -68,3 +94,5 @@ if __name__ == "__main__":
         for radius in range(200):
             sum = al[radius][1] + si[radius][1] + o[radius][1] + h[radius][1]
             assert abs(tot[radius][1] - sum) < 1e-3
+
+        multiple_selections(file.name, [al, si])
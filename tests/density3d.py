@@ -0,0 +1,71 @@
+import os
+import tempfile
+
+from testrun import cfiles
+
+TRAJECTORY = os.path.join(os.path.dirname(__file__), "data", "nt.xyz")
+NATOMS = 1008
+
+
+def read_cube(path):
+    with open(path) as fd:
+        lines = fd.readlines()
+
+    natoms = int(lines[2].split()[0])
+    shape = [int(lines[3 + i].split()[0]) for i in range(3)]
+    values = []
+    for line in lines[6 + natoms :]:
+        values.extend(map(float, line.split()))
+    assert len(values) == shape[0] * shape[1] * shape[2]
+    return shape, values
+
+
+def read_dx(path):
+    shape = None
+    values = []
+    with open(path) as fd:
+        data = False
+        for line in fd:
+            if line.startswith("#"):
+                continue
+            if line.startswith("object 1"):
+                shape = list(map(int, line.split()[-3:]))
+            elif "data follows" in line:
+                data = True
+            elif line.startswith("attribute"):
+                data = False
+            elif data:
+                values.extend(map(float, line.split()))
+    assert len(values) == shape[0] * shape[1] * shape[2]
+    return shape, values
+
+
+def density(output, *args):
+    out, err = cfiles(
+        "density",
+        "-c",
+        "24:24:25.458:90:90:120",
+        "--grid=10:12:14",
+        "--fractional",
+        TRAJECTORY,
+        "-o",
+        output,
+        *args
+    )
+    assert out == ""
+    assert err == ""
+
+
+if __name__ == "__main__":
+    with tempfile.NamedTemporaryFile() as file:
+        density(file.name)
+        shape, cube = read_cube(file.name)
+        assert shape == [10, 12, 14]
+        # All the atoms are inside the grid when using fractional coordinates
+        assert abs(sum(cube) - NATOMS) < 1e-2
+
+        density(file.name, "--grid-format=dx", "--threads=3")
+        shape, dx = read_dx(file.name)
+        assert shape == [10, 12, 14]
+        for (a, b) in zip(cube, dx):
+            assert abs(a - b) < 1e-4
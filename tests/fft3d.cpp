@@ -0,0 +1,46 @@
+#include <catch.hpp>
+
+#include <cmath>
+
+#include "FFT3D.hpp"
+
+TEST_CASE("3D real FFT") {
+    SECTION("Fast sizes") {
+        for (size_t size: {1, 2, 7, 31, 97, 250, 1001}) {
+            auto fast = RealFFT3D::fast_size(size);
+            CHECK(fast >= size);
+            CHECK((fast % 2) == 0);
+            CHECK(fast < 2 * size + 2);
+        }
+    }
+
+    SECTION("Plane wave") {
+        auto shape = std::array<size_t, 3>{{6, 10, 8}};
+        RealFFT3D fft(shape);
+        CHECK(fft.shape() == shape);
+        CHECK(fft.spectrum_size() == 6 * 10 * 5);
+
+        // cos(2π (m·x / n)) for m = (1, 2, 3)
+        auto grid = fft.grid();
+        for (size_t i=0; i<shape[0]; i++) {
+            for (size_t j=0; j<shape[1]; j++) {
+                for (size_t k=0; k<shape[2]; k++) {
+                    auto phase = 2 * 3.141592653589793 * (1.0 * i / 6.0 + 2.0 * j / 10.0 + 3.0 * k / 8.0);
+                    grid[(i * shape[1] + j) * shape[2] + k] = static_cast<float>(std::cos(phase));
+                }
+            }
+        }
+        fft.execute();
+
+        // all the values are zero, except for m = (1, 2, 3), with a norm of
+        // (N / 2)^2 where N is the total size of the grid
+        auto expected_index = (1 * shape[1] + 2) * 5 + 3;
+        for (size_t index=0; index<fft.spectrum_size(); index++) {
+            if (index == expected_index) {
+                CHECK(fft.norm2(index) == Approx(240.0 * 240.0).epsilon(1e-4));
+            } else {
+                CHECK(fft.norm2(index) < 1e-3);
+            }
+        }
+    }
+}
@@ -0,0 +1,49 @@
+#include <catch.hpp>
+
+#include "Grid.hpp"
+
+TEST_CASE("CountGrid") {
+    SECTION("Increment") {
+        auto grid = CountGrid(10, 20, 3);
+        CHECK(grid.shape()[0] == 10);
+        CHECK(grid.shape()[1] == 20);
+        CHECK(grid.shape()[2] == 3);
+        CHECK(grid.memory() == 0);
+
+        grid.increment(0, 0, 0);
+        grid.increment(9, 19, 2);
+        grid.increment(9, 19, 2);
+
+        CHECK(grid(0, 0, 0) == 1);
+        CHECK(grid(9, 19, 2) == 2);
+        CHECK(grid(5, 5, 1) == 0);
+        CHECK(grid(9, 19, 1) == 0);
+
+        // only the two bricks containing values are allocated
+        CHECK(grid.memory() == 2 * 8 * 8 * 8 * sizeof(uint16_t));
+    }
+
+    SECTION("Overflow") {
+        auto grid = CountGrid(2, 2, 2);
+        for (size_t i=0; i<70000; i++) {
+            grid.increment(1, 0, 1);
+        }
+        CHECK(grid(1, 0, 1) == 70000);
+        CHECK(grid(0, 0, 1) == 0);
+    }
+
+    SECTION("Merge") {
+        auto first = CountGrid(16, 16, 16);
+        auto second = CountGrid(16, 16, 16);
+        for (size_t i=0; i<40000; i++) {
+            first.increment(3, 4, 5);
+            second.increment(3, 4, 5);
+        }
+        second.increment(15, 15, 15);
+
+        first.merge(second);
+        CHECK(first(3, 4, 5) == 80000);
+        CHECK(first(15, 15, 15) == 1);
+        CHECK(first(0, 0, 0) == 0);
+    }
+}
@@ -47,6 +47,89 @@ def hbonds(output):
     check_hbonds(indexes)
 
 
+def read_varint(content, position):
+    value = 0
+    shift = 0
+    while True:
+        byte = content[position]
+        position += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if byte < 0x80:
+            return value, position
+
+
+def read_signed_varint(content, position):
+    value, position = read_varint(content, position)
+    return (value >> 1) ^ -(value & 1), position
+
+
+def read_bonds_stream(path):
+    with open(path, "rb") as fd:
+        content = fd.read()
+    assert content[:8] == b"CFHBOND1"
+
+    frames = []
+    position = 8
+    step = 0
+    while position < len(content):
+        delta, position = read_varint(content, position)
+        step += delta
+        count, position = read_varint(content, position)
+        bonds = []
+        donor = 0
+        for _ in range(count):
+            delta, position = read_varint(content, position)
+            donor += delta
+            hydrogen, position = read_signed_varint(content, position)
+            acceptor, position = read_signed_varint(content, position)
+            bonds.append((donor, donor + hydrogen, donor + acceptor))
+        frames.append((step, bonds))
+    return frames
+
+
+def read_text_frames(path):
+    frames = []
+    with open(path) as fd:
+        for line in fd:
+            if line.startswith("#"):
+                continue
+            values = list(map(int, line.split()))
+            if len(values) == 2:
+                frames.append((values[0], []))
+            else:
+                frames[-1][1].append(tuple(values))
+    return frames
+
+
+def bonds_stream(output):
+    stream = output + ".bin"
+    out, err = cfiles(
+        "hbonds",
+        "--guess-bonds",
+        "-c",
+        "15",
+        "--steps",
+        "::3",
+        TRAJECTORY,
+        "-o",
+        output,
+        "--bonds-output",
+        stream,
+    )
+    assert out == ""
+    assert err == ""
+
+    expected = read_text_frames(output)
+    frames = read_bonds_stream(stream)
+    assert len(frames) == len(expected)
+    for (step, bonds), (exp_step, exp_bonds) in zip(frames, expected):
+        assert step == exp_step
+        assert bonds == sorted(exp_bonds)
+
+    os.unlink(stream)
+
+
 def correlations(output):
     output_corr = output + ".autocorr"
     out, err = cfiles(
@@ -83,7 +166,91 @@ def correlations(output):
     os.unlink(output_corr)
 
 
+def read_columns(path):
+    with open(path) as fd:
+        return [list(map(float, line.split())) for line in fd if not line.startswith("#")]
+
+
+def lifetimes(output):
+    output_corr = output + ".autocorr"
+    output_lifetimes = output + ".lifetimes"
+    out, err = cfiles(
+        "hbonds",
+        "--guess-bonds",
+        "-c",
+        "15",
+        TRAJECTORY,
+        "-o",
+        output,
+        "--autocorrelation",
+        output_corr,
+        "--lifetimes",
+        output_lifetimes,
+    )
+    assert out == ""
+    assert err == ""
+
+    # Compute the survival probability directly from the bonds
+    frames = read_text_frames(output)
+    nsteps = len(frames)
+    existence = {}
+    for i, (_, bonds) in enumerate(frames):
+        for bond in bonds:
+            existence.setdefault(bond, [False] * nsteps)[i] = True
+
+    data = read_columns(output_lifetimes)
+    correlation = read_columns(output_corr)
+    assert len(data) == len(correlation)
+
+    expected = []
+    for lag in range(len(data)):
+        count = 0
+        for exists in existence.values():
+            for origin in range(nsteps - lag):
+                if all(exists[origin : origin + lag + 1]):
+                    count += 1
+        expected.append(count / (nsteps - lag))
+
+    for (step, survival, _), value, (_, intermittent) in zip(data, expected, correlation):
+        assert abs(survival - value / expected[0]) < 1e-6
+        # the bonds must exist continuously to contribute to the survival
+        assert survival <= intermittent + 1e-6
+
+    assert data[0][2] == 0
+    assert sum(u[2] for u in data) <= 1 + 1e-6
+
+    os.unlink(output_corr)
+    os.unlink(output_lifetimes)
+
+
+def single_step(output):
+    output_corr = output + ".autocorr"
+    output_lifetimes = output + ".lifetimes"
+    out, err = cfiles(
+        "hbonds",
+        "--guess-bonds",
+        "-c",
+        "15",
+        "--steps",
+        ":1",
+        TRAJECTORY,
+        "-o",
+        output,
+        "--autocorrelation",
+        output_corr,
+        "--lifetimes",
+        output_lifetimes,
+    )
+    assert out == ""
+    assert "not enough steps to compute the autocorrelation" in err
+    assert "not enough steps to compute the lifetimes" in err
+    assert len(read_text_frames(output)) == 1
+
+
 if __name__ == "__main__":
     with tempfile.NamedTemporaryFile() as file:
         hbonds(file.name)
+        bonds_stream(file.name)
+        lifetimes(file.name)
+        single_step(file.name)
         correlations(file.name)
@@ -0,0 +1,88 @@
+#include <catch.hpp>
+
+#include <limits>
+
+#include "Averager.hpp"
+
+TEST_CASE("Histogram") {
+    SECTION("insert_many 1D") {
+        auto histogram = Histogram<1, uint32_t>(10, 0, 5);
+        histogram.insert_many({0.0, 0.2, 0.6, 4.99, 5.0, -0.1, std::numeric_limits<double>::quiet_NaN()});
+
+        CHECK(histogram[0] == 2);
+        CHECK(histogram[1] == 1);
+        CHECK(histogram[9] == 1);
+        CHECK(histogram.out_of_bounds() == 3);
+
+        auto total = 0.0;
+        for (auto value: histogram) {
+            total += value;
+        }
+        CHECK(total == 4);
+
+        // values are processed by batches, make sure all of them are used
+        auto values = std::vector<double>(1000, 2.6);
+        histogram.insert_many(values);
+        CHECK(histogram[5] == 1000);
+        CHECK(histogram.out_of_bounds() == 3);
+    }
+
+    SECTION("insert_many 2D") {
+        auto histogram = Histogram<2>(2, 0, 2, 3, 0, 3);
+        histogram.insert_many({0.5, 1.5, 1.5, 2.5, 0.5}, {0.5, 2.5, 2.5, 0.5, -1});
+
+        CHECK(histogram(0, 0) == 1);
+        CHECK(histogram(1, 2) == 2);
+        CHECK(histogram(0, 1) == 0);
+        CHECK(histogram.out_of_bounds() == 2);
+    }
+
+    SECTION("Averager") {
+        auto averager = Averager<1, uint32_t>(4, 0, 4);
+        averager.insert_many({0.5, 0.5, 2.5});
+        averager.step();
+        CHECK(averager[0] == 0);
+
+        averager.insert_many({0.5, 3.5});
+        averager.step();
+        averager.average();
+
+        CHECK(averager.averaged(0) == 1.5);
+        CHECK(averager.averaged(1) == 0);
+        CHECK(averager.averaged(2) == 0.5);
+        CHECK(averager.averaged(3) == 0.5);
+
+        auto averager_2d = Averager<2>(2, 0, 2, 2, 0, 2);
+        averager_2d.insert_many({0.5, 1.5}, {1.5, 1.5});
+        averager_2d.normalize([](size_t, double value) {
+            return 4 * value;
+        });
+        averager_2d.step();
+        averager_2d.average();
+        CHECK(averager_2d.averaged(0, 1) == 4);
+        CHECK(averager_2d.averaged(1, 1) == 4);
+        CHECK(averager_2d.averaged(1, 0) == 0);
+    }
+
+    SECTION("Averager with sparse data") {
+        // large enough to use multiple blocks for the averaged values
+        auto averager = Averager<2, uint32_t>(100, 0, 100, 100, 0, 100);
+        averager.insert_many({0.5, 99.5}, {0.5, 99.5});
+        averager.step();
+        CHECK(averager(0, 0) == 0);
+        CHECK(averager(99, 99) == 0);
+
+        averager.insert(0.5, 0.5);
+        averager.step();
+
+        // writing directly to the bins is also taken into account
+        averager[50] = 4;
+        averager.step();
+        averager.average();
+
+        CHECK(averager.averaged(0, 0) == 2.0 / 3.0);
+        CHECK(averager.averaged(99, 99) == 1.0 / 3.0);
+        CHECK(averager.averaged(0, 50) == 4.0 / 3.0);
+        CHECK(averager.averaged(50, 50) == 0);
+    }
+}
@@ -28,12 +28,155 @@ def msd(output):
     check_msd(data)
 
 
+def msd_threads(output):
+    out, err = cfiles(
+        "msd",
+        "-c",
+        "15",
+        "--unwrap",
+        "--threads",
+        "7",
+        "--selection",
+        "name O",
+        TRAJECTORY,
+        "-o",
+        output,
+    )
+    assert out == ""
+    assert err == ""
+
+    data = read_data(output)
+    check_msd(data)
+
+    # the results do not depend on the number of threads, with or without
+    # unwrapping
+    for unwrap in [[], ["-c", "15", "--unwrap"]]:
+        out, err = cfiles("msd", "--threads", "1", *unwrap, TRAJECTORY, "-o", output)
+        assert out == ""
+        assert err == ""
+        single = read_data(output)
+
+        out, err = cfiles("msd", "--threads", "7", *unwrap, TRAJECTORY, "-o", output)
+        assert out == ""
+        assert err == ""
+        assert read_data(output) == single
+
+
+def msd_max_lag(output):
+    out, err = cfiles(
+        "msd",
+        "-c",
+        "15",
+        "--unwrap",
+        "--max-lag",
+        "10",
+        "--selection",
+        "name O",
+        TRAJECTORY,
+        "-o",
+        output,
+    )
+    assert out == ""
+    assert err == ""
+
+    data = read_data(output)
+    assert len(data) == 10
+    check_msd(data)
+
+
+def msd_multitau(output):
+    out, err = cfiles(
+        "msd",
+        "-c",
+        "15",
+        "--unwrap",
+        "--correlator",
+        "multitau",
+        "--selection",
+        "name O",
+        TRAJECTORY,
+        "-o",
+        output,
+    )
+    assert out == ""
+    assert err == ""
+
+    # the first 15 lags are computed exactly by the multiple-tau correlator
+    data = read_data(output)
+    check_msd(data[:15])
+
+
+def msd_multiple_selections(directory):
+    output = os.path.join(directory, "msd.dat")
+    for correlator in ["fft", "multitau"]:
+        out, err = cfiles(
+            "msd",
+            "-c",
+            "15",
+            "--unwrap",
+            "--correlator",
+            correlator,
+            "--selection",
+            "name O",
+            "--selection",
+            "name H",
+            TRAJECTORY,
+            "-o",
+            output,
+        )
+        assert out == ""
+        assert err == ""
+
+        oxygen = read_data(os.path.join(directory, "msd.0.dat"))
+        hydrogen = read_data(os.path.join(directory, "msd.1.dat"))
+        assert len(oxygen) == len(hydrogen)
+        check_msd(oxygen[:15])
+
+        # each group gives the same result as a separate run
+        out, err = cfiles(
+            "msd",
+            "-c",
+            "15",
+            "--unwrap",
+            "--correlator",
+            correlator,
+            "--selection",
+            "name H",
+            TRAJECTORY,
+            "-o",
+            output,
+        )
+        assert out == ""
+        assert err == ""
+        assert read_data(output) == hydrogen
+
+
 def msd_no_cell(output):
     out, err = cfiles("msd", "--selection", "name O", TRAJECTORY, "-o", output)
     assert out == ""
     assert err == ""
 
 
+def msd_empty_steps(output):
+    for correlator in ["fft", "multitau"]:
+        out, err = cfiles(
+            "msd",
+            "-c",
+            "15",
+            "--unwrap",
+            "--correlator",
+            correlator,
+            "--steps",
+            "5:5",
+            TRAJECTORY,
+            "-o",
+            output,
+        )
+        assert out == ""
+        assert "no step to use in the trajectory" in err
+        assert read_data(output) == []
+
+
 def check_msd(data):
     # This is only a regression test, checking that the right output is
     # generated.
@@ -50,5 +193,20 @@ if __name__ == "__main__":
     with tempfile.NamedTemporaryFile() as file:
         msd(file.name)
 
+    with tempfile.NamedTemporaryFile() as file:
+        msd_threads(file.name)
+
+    with tempfile.NamedTemporaryFile() as file:
+        msd_max_lag(file.name)
+
+    with tempfile.NamedTemporaryFile() as file:
+        msd_multitau(file.name)
+
     with tempfile.NamedTemporaryFile() as file:
         msd_no_cell(file.name)
+
+    with tempfile.NamedTemporaryFile() as file:
+        msd_empty_steps(file.name)
+
+    with tempfile.TemporaryDirectory() as directory:
+        msd_multiple_selections(directory)
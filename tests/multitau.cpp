@@ -0,0 +1,76 @@
+#include <catch.hpp>
+
+#include <cmath>
+
+#include "MultiTau.hpp"
+#include "Errors.hpp"
+
+static double value(size_t serie, size_t step) {
+    return std::sin(0.1 * static_cast<double>(step) + static_cast<double>(serie)) + 0.01 * static_cast<double>(step % 7);
+}
+
+TEST_CASE("MultiTauCorrelator") {
+    SECTION("Product") {
+        const size_t nsteps = 100;
+        auto correlator = MultiTauCorrelator(3, 1, MultiTauCorrelator::Product);
+        for (size_t step=0; step<nsteps; step++) {
+            correlator.add({value(0, step), value(1, step), value(2, step)});
+        }
+
+        auto lags = correlator.lags();
+        auto correlation = correlator.correlation();
+        REQUIRE(lags.size() == correlation.size());
+        CHECK(lags[0] == 0);
+        CHECK(lags[15] == 15);
+        // lags are logarithmically spaced after the first level
+        CHECK(lags[16] == 16);
+        CHECK(lags[17] == 18);
+
+        // the first level is computed exactly
+        for (size_t lag=0; lag<16; lag++) {
+            double expected = 0;
+            for (size_t serie=0; serie<3; serie++) {
+                for (size_t step=0; step<nsteps - lag; step++) {
+                    expected += value(serie, step) * value(serie, step + lag);
+                }
+            }
+            expected /= 3.0 * static_cast<double>(nsteps - lag);
+            CHECK(std::abs(correlation[lag] - expected) < 1e-12);
+        }
+    }
+
+    SECTION("Squared difference") {
+        // linear motion with x(t) = t, the MSD is lag^2 for all lags,
+        // including the averaged ones
+        auto correlator = MultiTauCorrelator(1, 2, MultiTauCorrelator::SquaredDifference, {1.0, 0.0});
+        for (size_t step=0; step<1000; step++) {
+            auto x = static_cast<double>(step);
+            correlator.add({x, 42.0 * x});
+        }
+
+        auto lags = correlator.lags();
+        auto msd = correlator.correlation();
+        for (size_t i=0; i<lags.size(); i++) {
+            auto lag = static_cast<double>(lags[i]);
+            CHECK(std::abs(msd[i] - lag * lag) < 1e-9);
+        }
+    }
+
+    SECTION("New series") {
+        auto correlator = MultiTauCorrelator(1, 1, MultiTauCorrelator::Product);
+        correlator.add({1.0});
+        correlator.add({1.0});
+        correlator.add_series(1);
+        CHECK(correlator.nseries() == 2);
+        correlator.add({1.0, 1.0});
+
+        // lag 0: (3 + 1) / (3 * 2), lag 1: (2 + 0) / (2 * 2)
+        auto correlation = correlator.correlation();
+        CHECK(std::abs(correlation[0] - 4.0 / 6.0) < 1e-12);
+        CHECK(std::abs(correlation[1] - 2.0 / 4.0) < 1e-12);
+    }
+
+    SECTION("Errors") {
+        CHECK_THROWS_AS(MultiTauCorrelator(1, 3, MultiTauCorrelator::Product, {1.0, 2.0}), CFilesError);
+    }
+}
@@ -0,0 +1,96 @@
+#include <catch.hpp>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "Output.hpp"
+#include "Errors.hpp"
+
+static std::string read_file(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream content;
+    content << file.rdbuf();
+    return content.str();
+}
+
+static uint32_t read_u32(const std::string& data, size_t offset) {
+    uint32_t value = 0;
+    for (size_t i=0; i<4; i++) {
+        value |= static_cast<uint32_t>(static_cast<unsigned char>(data[offset + i])) << (8 * i);
+    }
+    return value;
+}
+
+TEST_CASE("Output format") {
+    CHECK(parse_output_format("text") == OutputFormat::Text);
+    CHECK(parse_output_format("npy") == OutputFormat::Numpy);
+    CHECK_THROWS_AS(parse_output_format("hdf5"), CFilesError);
+
+    CHECK(output_extension(OutputFormat::Text) == ".dat");
+    CHECK(output_extension(OutputFormat::Numpy) == ".npz");
+}
+
+TEST_CASE("Text output") {
+    auto path = std::string("cfiles-test-output.dat");
+    auto output = ResultWriter(path, OutputFormat::Text);
+    output.comment("a comment");
+    output.column("step", std::vector<uint64_t>{0, 10, 20});
+    output.column("value", std::vector<double>{0.5, 1.0 / 3.0, 104.85});
+    output.write();
+
+    CHECK(read_file(path) == "# a comment\n0 0.5\n10 0.33333333\n20 104.85\n");
+
+    output = ResultWriter(path, OutputFormat::Text);
+    output.grid("density", "x", {1, 2}, "y", {3, 4, 5}, {1, 2, 3, 4, 5, 6});
+    output.write();
+    CHECK(read_file(path) == "1 3 1\n1 4 2\n1 5 3\n2 3 4\n2 4 5\n2 5 6\n");
+
+    output = ResultWriter(path, OutputFormat::Text);
+    output.column("a", std::vector<double>{1, 2});
+    output.column("b", std::vector<double>{1});
+    CHECK_THROWS_AS(output.write(), CFilesError);
+
+    std::remove(path.c_str());
+}
+
+TEST_CASE("NumPy output") {
+    auto path = std::string("cfiles-test-output.npz");
+    auto output = NpzWriter(path);
+    output.add("values", {2, 3}, std::vector<double>{1, 2, 3, 4, 5, 6});
+    output.add("metadata", "some text");
+    CHECK_THROWS_AS(output.add("wrong", {2, 2}, std::vector<double>{1, 2, 3}), CFilesError);
+    output.write();
+    // the archive can only be written once
+    CHECK_THROWS_AS(output.write(), CFilesError);
+    CHECK_THROWS_AS(output.add("more", "text"), CFilesError);
+
+    auto content = read_file(path);
+    // local file header
+    CHECK(read_u32(content, 0) == 0x04034b50);
+    CHECK(content.substr(30, 10) == "values.npy");
+
+    // npy header, padded to 64 bytes
+    auto npy = content.substr(40);
+    CHECK(npy.substr(0, 8) == std::string("\x93NUMPY\x01\x00", 8));
+    auto header_size = static_cast<size_t>(static_cast<unsigned char>(npy[8])) + 256 * static_cast<size_t>(static_cast<unsigned char>(npy[9]));
+    CHECK(((header_size + 10) % 64) == 0);
+    auto header = npy.substr(10, header_size);
+    CHECK(header.find("'fortran_order': False") != std::string::npos);
+    CHECK(header.find("'shape': (2, 3)") != std::string::npos);
+    CHECK(header.back() == '\n');
+
+    // array data is stored uncompressed
+    double first = 0;
+    std::memcpy(&first, npy.data() + 10 + header_size, sizeof(double));
+    CHECK(first == 1);
+    CHECK(read_u32(content, 18) == 10 + header_size + 6 * sizeof(double));
+
+    // end of central directory, with two entries
+    auto end = content.size() - 22;
+    CHECK(read_u32(content, end) == 0x06054b50);
+    CHECK(content[end + 10] == 2);
+
+    std::remove(path.c_str());
+}
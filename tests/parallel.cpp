@@ -0,0 +1,42 @@
+#include <catch.hpp>
+
+#include "Parallel.hpp"
+#include "Errors.hpp"
+
+TEST_CASE("Split blocks") {
+    auto blocks = split_blocks(10, 3);
+    REQUIRE(blocks.size() == 3);
+    CHECK(blocks[0].begin == 0);
+    CHECK(blocks[0].end == 4);
+    CHECK(blocks[1].begin == 4);
+    CHECK(blocks[1].end == 7);
+    CHECK(blocks[2].begin == 7);
+    CHECK(blocks[2].end == 10);
+
+    blocks = split_blocks(2, 8);
+    REQUIRE(blocks.size() == 2);
+    CHECK(blocks[0].size() == 1);
+    CHECK(blocks[1].size() == 1);
+
+    CHECK(split_blocks(0, 4).empty());
+    CHECK(split_blocks(5, 0).size() == 1);
+}
+
+TEST_CASE("Parallel for") {
+    auto values = std::vector<size_t>(1000, 0);
+    parallel_for(values.size(), 4, [&](size_t i) {
+        values[i] = i * i;
+    });
+    for (size_t i=0; i<values.size(); i++) {
+        CHECK(values[i] == i * i);
+    }
+
+    CHECK_THROWS_AS(parallel_for(100, 4, [](size_t i) {
+        if (i == 42) {
+            throw CFilesError("oops");
+        }
+    }), CFilesError);
+
+    CHECK_THROWS_AS(parse_threads("0"), CFilesError);
+    CHECK(parse_threads("3") == 3);
+}
@@ -1,5 +1,8 @@
+import ast
 import os
+import struct
 import tempfile
+import zipfile
 
 from testrun import cfiles
 
@@ -17,6 +20,24 @@ def read_rdf(path):
     return data
 
 
+def read_npy_array(archive, name):
+    """Read a 1-D float64 array from a npz archive without requiring numpy"""
+    content = archive.read(name + ".npy")
+    assert content[:6] == b"\x93NUMPY"
+    header_size = struct.unpack("<H", content[8:10])[0]
+    header = ast.literal_eval(content[10 : 10 + header_size].decode("latin1"))
+    assert header["descr"] == "<f8"
+    assert header["fortran_order"] is False
+    (size,) = header["shape"]
+    return struct.unpack("<%dd" % size, content[10 + header_size :])
+
+
+def read_rdf_npz(path):
+    with zipfile.ZipFile(path) as archive:
+        columns = [read_npy_array(archive, n) for n in ["r", "rdf", "N_ij", "N_ji"]]
+    return list(zip(*columns))
+
+
 def check_oxygen_rdf(data):
     # Check the maximal value of the rdf
     max_index = max(enumerate(data), key=lambda u: u[1][1])[0]
@@ -121,6 +142,37 @@ def oxygen_rdf_partial(output):
     check_oxygen_rdf(data)
 
 
+def oxygen_rdf_skin(output):
+    """Oxygen rdf reusing the neighbor lists between frames"""
+    out, err = cfiles("rdf", "-c", "15", "-p", "150", "-s", "name O", TRAJECTORY, "-o", output)
+    assert out == ""
+    assert err == ""
+    reference = read_rdf(output)
+
+    out, err = cfiles(
+        "rdf",
+        "-c",
+        "15",
+        "-p",
+        "150",
+        "-s",
+        "name O",
+        "--skin",
+        "1.5",  # Use a 1.5 A skin around the neighbor lists
+        TRAJECTORY,
+        "-o",
+        output,
+    )
+    assert out == ""
+    assert err == ""
+
+    data = read_rdf(output)
+    assert len(data) == len(reference)
+    for actual, expected in zip(data, reference):
+        for a, b in zip(actual, expected):
+            assert abs(a - b) < 1e-9
+
+
 def OH_rdf_all(output):
     """Oxygen-Hydrogen rdf for the whole trajectory"""
     out, err = cfiles(
@@ -203,9 +255,73 @@ def OH_rdf_partial(output):
     check_ho_rdf(data)
 
 
+def partials_rdf(output):
+    """All partial rdf for the whole trajectory"""
+    out, err = cfiles(
+        "rdf",
+        "-c",
+        "15",
+        "-p",
+        "150",
+        "--partials",
+        "name",
+        TRAJECTORY,
+        "-o",
+        output,
+    )
+    assert out == ""
+    assert err == ""
+
+    data = []
+    with open(output) as fd:
+        for line in fd:
+            if line.startswith("#"):
+                continue
+            data.append(list(map(float, line.split())))
+    assert len(data) == 150
+    # r, then rdf and coordination numbers for O-O, O-H and H-H, then total
+    assert len(data[0]) == 11
+
+    check_oxygen_rdf([(u[0], u[1], u[2], u[3]) for u in data])
+    check_oh_rdf([(u[0], u[4], u[5], u[6]) for u in data])
+
+    end = [u[10] for u in data[len(data) // 2 :]]
+    ave = sum(end) / len(end)
+    assert abs(ave - 1) < 1e-1
+
+
+def oxygen_rdf_npy(output):
+    """Oxygen rdf for the whole trajectory, using NumPy output"""
+    out, err = cfiles(
+        "rdf",
+        "-c",
+        "15",
+        "-p",
+        "150",
+        "-s",
+        "name O",
+        "--output-format",
+        "npy",
+        TRAJECTORY,
+        "-o",
+        output,
+    )
+    assert out == ""
+    assert err == ""
+
+    data = read_rdf_npz(output)
+    assert len(data) == 150
+    max_index = max(enumerate(data), key=lambda u: u[1][1])[0]
+    assert abs(data[max_index][0] - 2.775) < 1e-9
+    assert data[max_index][1] > 3
+
+
 if __name__ == "__main__":
     with tempfile.NamedTemporaryFile() as file:
         oxygen_rdf_all(file.name)
         oxygen_rdf_partial(file.name)
+        oxygen_rdf_skin(file.name)
         OH_rdf_all(file.name)
         OH_rdf_partial(file.name)
+        partials_rdf(file.name)
+        oxygen_rdf_npy(file.name)
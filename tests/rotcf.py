@@ -0,0 +1,140 @@
+import math
+import os
+import tempfile
+
+from testrun import cfiles
+
+TRAJECTORY = os.path.join(os.path.dirname(__file__), "data", "water.xyz")
+
+
+def read_data(path):
+    data = []
+    with open(path) as fd:
+        for line in fd:
+            if line.startswith("#"):
+                continue
+            data.append(list(map(float, line.split())))
+    return data
+
+
+def rotcf(output):
+    out, err = cfiles("rotcf", "--guess-bonds", "-c", "15", TRAJECTORY, "-o", output)
+    assert out == ""
+    assert err == ""
+
+    data = read_data(output)
+    assert data[0][0] == 0
+    assert abs(data[0][1] - 1) < 1e-6
+    assert all(-0.5 <= value <= 1 + 1e-6 for _, value in data)
+    return data
+
+
+def rotcf_orders(output, expected):
+    out, err = cfiles(
+        "rotcf", "--guess-bonds", "-c", "15", "--order", "1,2,3", TRAJECTORY, "-o", output
+    )
+    assert out == ""
+    assert err == ""
+
+    data = read_data(output)
+    assert len(data) == len(expected)
+    for (step, p1, p2, p3), (exp_step, exp_p2) in zip(data, expected):
+        assert step == exp_step
+        assert abs(p2 - exp_p2) < 1e-6
+        assert -1 - 1e-6 <= p1 <= 1 + 1e-6
+        assert -1 - 1e-6 <= p3 <= 1 + 1e-6
+
+    # the water molecules rotate, the first order correlation decreases
+    assert abs(data[0][1] - 1) < 1e-6
+    assert data[-1][1] < data[0][1]
+
+
+def rotcf_multitau(output, expected):
+    out, err = cfiles(
+        "rotcf",
+        "--guess-bonds",
+        "-c",
+        "15",
+        "--correlator",
+        "multitau",
+        TRAJECTORY,
+        "-o",
+        output,
+    )
+    assert out == ""
+    assert err == ""
+
+    # the first 15 lags are computed exactly by the multiple-tau correlator
+    data = read_data(output)
+    for (step, value), (exp_step, exp_value) in zip(data[:15], expected):
+        assert step == exp_step
+        assert abs(value - exp_value) < 1e-5
+
+
+def rotcf_reference(output):
+    nsteps = 20
+    out, err = cfiles(
+        "rotcf",
+        "--guess-bonds",
+        "-c",
+        "15",
+        "--steps",
+        ":{}".format(nsteps),
+        TRAJECTORY,
+        "-o",
+        output,
+    )
+    assert out == ""
+    assert err == ""
+    data = read_data(output)
+
+    # compute <P2(u(0).u(t))> directly, averaged over the O-H bonds and the
+    # time origins
+    vectors = [bond_vectors(frame) for frame in read_frames(TRAJECTORY, nsteps)]
+    assert len(data) == nsteps // 2
+    for lag, (step, value) in enumerate(data):
+        assert step == lag
+        expected = 0.0
+        count = 0
+        for origin in range(nsteps - lag):
+            for u, v in zip(vectors[origin], vectors[origin + lag]):
+                cos = u[0] * v[0] + u[1] * v[1] + u[2] * v[2]
+                expected += 1.5 * cos * cos - 0.5
+                count += 1
+        assert abs(value - expected / count) < 1e-5
+
+
+def read_frames(path, nsteps):
+    frames = []
+    with open(path) as fd:
+        for _ in range(nsteps):
+            natoms = int(fd.readline())
+            fd.readline()
+            frame = []
+            for _ in range(natoms):
+                name, x, y, z = fd.readline().split()
+                frame.append((name, float(x), float(y), float(z)))
+            frames.append(frame)
+    return frames
+
+
+def bond_vectors(frame, cell=15.0):
+    # the atoms are ordered as O H H in each water molecule
+    vectors = []
+    for i in range(0, len(frame), 3):
+        assert [atom[0] for atom in frame[i : i + 3]] == ["O", "H", "H"]
+        for j in [i + 1, i + 2]:
+            rij = [frame[i][k] - frame[j][k] for k in [1, 2, 3]]
+            rij = [x - cell * round(x / cell) for x in rij]
+            norm = math.sqrt(sum(x * x for x in rij))
+            assert norm < 1.2
+            vectors.append([x / norm for x in rij])
+    return vectors
+
+
+if __name__ == "__main__":
+    with tempfile.NamedTemporaryFile() as file:
+        expected = rotcf(file.name)
+        rotcf_orders(file.name, expected)
+        rotcf_multitau(file.name, expected)
+        rotcf_reference(file.name)
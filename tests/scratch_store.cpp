@@ -0,0 +1,59 @@
+#include <catch.hpp>
+
+#include "ScratchStore.hpp"
+#include "Errors.hpp"
+
+static void check_store(const std::string& directory) {
+    // more series and steps than a single tile
+    const size_t nseries = 100000;
+    const size_t length = 37;
+    auto store = ScratchStore(nseries, length, directory);
+    CHECK(store.nseries() == nseries);
+    CHECK(store.length() == length);
+    CHECK(store.serie(42)[3] == 0);
+
+    // write with two writers, for different steps
+    ScratchStore::Writer first(store, 0);
+    ScratchStore::Writer second(store, 20);
+    for (size_t step=0; step<length; step++) {
+        auto& writer = step < 20 ? first : second;
+        auto values = writer.next();
+        for (size_t serie=0; serie<nseries; serie++) {
+            values[serie] = static_cast<float>(serie % 1000) + 1000.0f * static_cast<float>(step);
+        }
+    }
+    first.flush();
+    second.flush();
+
+    for (size_t serie: {0, 1, 999, 54321, 99999}) {
+        auto values = store.serie(serie);
+        for (size_t step=0; step<length; step++) {
+            CHECK(values[step] == static_cast<float>(serie % 1000) + 1000.0f * static_cast<float>(step));
+        }
+    }
+
+    // the store can be modified in place
+    store.serie(3)[5] += 1;
+    CHECK(store.serie(3)[5] == 5004);
+}
+
+TEST_CASE("ScratchStore") {
+    SECTION("Memory") {
+        check_store("");
+    }
+
+#ifndef _WIN32
+    SECTION("Temporary file") {
+        check_store(".");
+        CHECK_THROWS_AS(ScratchStore(10, 10, "this/does/not/exist"), CFilesError);
+    }
+#endif
+
+    SECTION("Empty store") {
+        auto store = ScratchStore(0, 10);
+        CHECK(store.nseries() == 0);
+        ScratchStore::Writer writer(store, 0);
+        writer.next();
+        writer.flush();
+    }
+}
@@ -0,0 +1,84 @@
+#include <catch.hpp>
+
+#include <random>
+
+#include "SphericalHarmonics.hpp"
+
+using namespace chemfiles;
+
+static double legendre(size_t l, double x) {
+    double previous = 1.0;
+    double current = x;
+    if (l == 0) {
+        return previous;
+    }
+    for (size_t n=2; n<=l; n++) {
+        auto next = ((2.0 * n - 1.0) * x * current - (n - 1.0) * previous) / n;
+        previous = current;
+        current = next;
+    }
+    return current;
+}
+
+static Vector3D random_unit_vector(std::mt19937& generator) {
+    auto normal = std::normal_distribution<double>(0, 1);
+    auto u = Vector3D(normal(generator), normal(generator), normal(generator));
+    return u / u.norm();
+}
+
+TEST_CASE("Spherical harmonics") {
+    SECTION("Low degrees") {
+        auto u = Vector3D(1, 2, 3) / std::sqrt(14.0);
+        double values[5];
+
+        auto first = SphericalHarmonics(1);
+        CHECK(first.size() == 3);
+        first.compute(u, values);
+        CHECK(values[0] == Approx(u[2]));
+        CHECK(values[1] == Approx(u[0]));
+        CHECK(values[2] == Approx(u[1]));
+
+        auto second = SphericalHarmonics(2);
+        CHECK(second.size() == 5);
+        second.compute(u, values);
+        CHECK(values[0] == Approx(1.5 * u[2] * u[2] - 0.5));
+        CHECK(values[1] == Approx(std::sqrt(3.0) * u[0] * u[2]));
+        CHECK(values[2] == Approx(std::sqrt(3.0) * u[1] * u[2]));
+        CHECK(values[3] == Approx(std::sqrt(3.0) / 2 * (u[0] * u[0] - u[1] * u[1])));
+        CHECK(values[4] == Approx(std::sqrt(3.0) * u[0] * u[1]));
+    }
+
+    SECTION("Addition theorem") {
+        auto generator = std::mt19937(42);
+        for (size_t l=1; l<=8; l++) {
+            auto harmonics = SphericalHarmonics(l);
+            auto first = std::vector<double>(harmonics.size());
+            auto second = std::vector<double>(harmonics.size());
+            for (size_t i=0; i<20; i++) {
+                auto u = random_unit_vector(generator);
+                auto v = random_unit_vector(generator);
+                harmonics.compute(u, first.data());
+                harmonics.compute(v, second.data());
+
+                double sum = 0;
+                for (size_t m=0; m<harmonics.size(); m++) {
+                    sum += first[m] * second[m];
+                }
+                CHECK(std::abs(sum - legendre(l, dot(u, v))) < 1e-10);
+            }
+        }
+    }
+
+    SECTION("Single harmonic") {
+        auto generator = std::mt19937(42);
+        for (size_t l=0; l<=8; l++) {
+            auto harmonics = SphericalHarmonics(l);
+            auto values = std::vector<double>(harmonics.size());
+            auto u = random_unit_vector(generator);
+            harmonics.compute(u, values.data());
+            for (size_t i=0; i<harmonics.size(); i++) {
+                CHECK(harmonics.value(u, i) == values[i]);
+            }
+        }
+    }
+}
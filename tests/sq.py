@@ -0,0 +1,96 @@
+import cmath
+import math
+import os
+import tempfile
+
+from testrun import cfiles
+
+TRAJECTORY = os.path.join(os.path.dirname(__file__), "data", "water.xyz")
+
+
+def read_data(path):
+    data = []
+    with open(path) as fd:
+        for line in fd:
+            if line.startswith("#"):
+                continue
+            q, value = map(float, line.split())
+            data.append((q, value))
+    return data
+
+
+def read_first_frame(path):
+    with open(path) as fd:
+        natoms = int(fd.readline())
+        fd.readline()
+        atoms = []
+        for _ in range(natoms):
+            name, x, y, z = fd.readline().split()[:4]
+            atoms.append((name, (float(x), float(y), float(z))))
+    return atoms
+
+
+def direct_sq(atoms, weights, cell, qmax, npoints):
+    """Compute S(q) with a direct sum over atoms for all the wave vectors
+    compatible with a cubic cell of size `cell`"""
+    norm = sum(weights[name] ** 2 for name, _ in atoms)
+    max_m = int(qmax * cell / (2 * math.pi))
+    sums = [0.0] * npoints
+    counts = [0] * npoints
+    for m0 in range(-max_m, max_m + 1):
+        for m1 in range(-max_m, max_m + 1):
+            for m2 in range(0, max_m + 1):
+                if m2 == 0 and (m1 < 0 or (m1 == 0 and m0 <= 0)):
+                    continue
+                q = [2 * math.pi * m / cell for m in (m0, m1, m2)]
+                q_norm = math.sqrt(sum(x * x for x in q))
+                if q_norm >= qmax:
+                    continue
+                rho = sum(
+                    weights[name] * cmath.exp(1j * sum(a * b for a, b in zip(q, r)))
+                    for name, r in atoms
+                )
+                index = int(q_norm / (qmax / npoints))
+                sums[index] += abs(rho) ** 2 / norm
+                counts[index] += 1
+    return [s / c if c != 0 else 0 for s, c in zip(sums, counts)]
+
+
+def single_frame(output, weights):
+    args = ["sq", "-c", "15", "--steps", ":1", "--max", "2.5", "--points", "25"]
+    if weights is not None:
+        args += ["--weights", ",".join("{}:{}".format(*w) for w in weights.items())]
+    out, err = cfiles(*args, TRAJECTORY, "-o", output)
+    assert out == ""
+    assert err == ""
+
+    data = read_data(output)
+    assert len(data) == 25
+    if weights is None:
+        weights = {"O": 1.0, "H": 1.0}
+    expected = direct_sq(read_first_frame(TRAJECTORY), weights, 15.0, 2.5, 25)
+    for (_, value), reference in zip(data, expected):
+        assert abs(value - reference) < 1e-2
+
+
+def whole_trajectory(output):
+    out, err = cfiles("sq", "-c", "15", "-s", "name O", TRAJECTORY, "-o", output)
+    assert out == ""
+    assert err == ""
+
+    data = read_data(output)
+    assert len(data) == 200
+    # No wave vector is smaller than 2π / 15
+    assert data[0][1] == 0
+    # S(q) goes to 1 at large q, there is no intramolecular contribution
+    # when only using oxygen atoms
+    end = [value for (q, value) in data if q > 8]
+    ave = sum(end) / len(end)
+    assert abs(ave - 1) < 1e-1
+
+
+if __name__ == "__main__":
+    with tempfile.NamedTemporaryFile() as file:
+        single_frame(file.name, None)
+        single_frame(file.name, {"O": 5.803, "H": -3.739})
+        whole_trajectory(file.name)
@@ -46,6 +46,11 @@ TEST_CASE("Steps ranges") {
     CHECK(range.count(100) == 0);
     CHECK(range.count(1001) == 160);
 
+    range = steps_range::parse("10::4");
+    expected = std::vector<size_t>{10, 14, 18};
+    CHECK(range.list(20) == expected);
+    CHECK(range.list(5).empty());
+
 
     SECTION("Errors") {
         auto bad_ranges = {
@@ -83,6 +88,27 @@ TEST_CASE("Split") {
     CHECK(splitted == expected);
 }
 
+TEST_CASE("Split pair selection") {
+    auto expected = std::vector<std::string>{"atoms: name(#1) O", "atoms: name(#1) H"};
+    CHECK(split_pair_selection("pairs: name(#1) O and name(#2) H") == expected);
+    CHECK(split_pair_selection("pairs:name(#2) H and name(#1) O") == expected);
+
+    expected = std::vector<std::string>{"atoms: name O and mass(#1) < 12", "atoms: (name(#1) H or name(#1) D)"};
+    CHECK(split_pair_selection("pairs: name O and (name(#2) H or name(#2) D) and mass(#1) < 12") == expected);
+
+    expected = std::vector<std::string>{"atoms: not name(#1) O", "atoms: all"};
+    CHECK(split_pair_selection("pairs: not name(#1) O") == expected);
+
+    // selections which can not be split
+    CHECK(split_pair_selection("name O").empty());
+    CHECK(split_pair_selection("atoms: name O").empty());
+    CHECK(split_pair_selection("bonds: name(#1) O and name(#2) H").empty());
+    CHECK(split_pair_selection("pairs: name(#1) O or name(#2) H").empty());
+    CHECK(split_pair_selection("pairs: distance(#1, #2) < 3").empty());
+    CHECK(split_pair_selection("pairs: name(#1) O and name(#2) \"H 1\"").empty());
+    CHECK(split_pair_selection("pairs: name(#1) O and name(#3) H").empty());
+}
+
 
 TEST_CASE("Parse cell") {
     auto cell = parse_cell("10");
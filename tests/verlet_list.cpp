@@ -0,0 +1,84 @@
+#include <catch.hpp>
+
+#include <algorithm>
+#include <random>
+
+#include "VerletList.hpp"
+
+using namespace chemfiles;
+
+using pair_list = std::vector<std::pair<size_t, size_t>>;
+
+static pair_list brute_force(const UnitCell& cell, const std::vector<Vector3D>& positions, const std::vector<size_t>& first, const std::vector<size_t>& second, double cutoff) {
+    auto pairs = pair_list();
+    for (auto i: first) {
+        for (auto j: second) {
+            if (i != j && cell.wrap(positions[j] - positions[i]).norm() < cutoff) {
+                pairs.emplace_back(i, j);
+            }
+        }
+    }
+    std::sort(pairs.begin(), pairs.end());
+    return pairs;
+}
+
+TEST_CASE("VerletList") {
+    auto generator = std::mt19937(42);
+    auto uniform = std::uniform_real_distribution<double>(0, 20);
+    auto step = std::uniform_real_distribution<double>(-0.05, 0.05);
+
+    auto cell = UnitCell(Vector3D(20, 20, 20));
+    auto positions = std::vector<Vector3D>(400);
+    for (auto& position: positions) {
+        position = Vector3D(uniform(generator), uniform(generator), uniform(generator));
+    }
+    auto all = std::vector<size_t>(positions.size());
+    for (size_t i=0; i<all.size(); i++) {
+        all[i] = i;
+    }
+    auto first = std::vector<size_t>(all.begin(), all.begin() + 150);
+    auto second = std::vector<size_t>(all.begin() + 100, all.end());
+
+    const double cutoff = 4.0;
+    auto single = VerletList(cutoff, 1.0);
+    auto pairs = VerletList(cutoff, 1.0);
+    for (size_t frame=0; frame<50; frame++) {
+        single.update(cell, positions, all);
+        auto found = pair_list();
+        single.foreach_pair([&](size_t i, size_t j, double distance) {
+            CHECK(distance < cutoff);
+            found.emplace_back(i, j);
+            found.emplace_back(j, i);
+        });
+        std::sort(found.begin(), found.end());
+        CHECK(found == brute_force(cell, positions, all, all, cutoff));
+
+        pairs.update(cell, positions, first, second);
+        found.clear();
+        pairs.foreach_pair([&](size_t i, size_t j, double) {
+            found.emplace_back(i, j);
+        });
+        std::sort(found.begin(), found.end());
+        CHECK(found == brute_force(cell, positions, first, second, cutoff));
+
+        // small displacements, some atoms crossing the cell boundaries
+        for (auto& position: positions) {
+            position = position + Vector3D(step(generator), step(generator), step(generator));
+        }
+    }
+
+    // each atom moves by at most 0.087 per frame, so the list stays valid
+    // for at least 5 frames
+    CHECK(single.builds() <= 10);
+    CHECK(pairs.builds() <= 10);
+
+    // changing the cell or the atoms rebuilds the list
+    auto builds = single.builds();
+    single.update(cell, positions, all);
+    CHECK(single.builds() == builds);
+    auto other_cell = UnitCell(Vector3D(21, 20, 20));
+    single.update(other_cell, positions, all);
+    CHECK(single.builds() == builds + 1);
+    single.update(other_cell, positions, first);
+    CHECK(single.builds() == builds + 2);
+}
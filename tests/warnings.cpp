@@ -0,0 +1,22 @@
+#include <catch.hpp>
+
+#include "warnings.hpp"
+#include "Parallel.hpp"
+
+TEST_CASE("Warning sites") {
+    static WarningSite WARNING("value {} is too big (max is {})");
+    CHECK(WARNING.count() == 0);
+
+    WARNING.emit(42, 3.5);
+    CHECK(WARNING.count() == 1);
+    CHECK(WARNING.message() == "value 42 is too big (max is 3.5)");
+
+    parallel_for(1000, 4, [](size_t i) {
+        WARNING.emit(i, 3.5);
+    });
+    CHECK(WARNING.count() == 1001);
+    // the message is only formatted the first time
+    CHECK(WARNING.message() == "value 42 is too big (max is 3.5)");
+
+    print_warnings_summary();
+}